@@ -59,6 +59,8 @@
 #include "sysemu/cpus.h"
 #include "sysemu/cpu-timers.h"
 #include "sysemu/tcg.h"
+#include "sysemu/sysemu.h"
+#include "qemu-version.h"
 
 /* #define DEBUG_TB_INVALIDATE */
 /* #define DEBUG_TB_FLUSH */
@@ -2417,6 +2419,288 @@ void dump_opcount_info(void)
     tcg_dump_op_count();
 }
 
+/*
+ * TB seed cache.
+ *
+ * Host code emitted by TCG embeds absolute addresses of the code buffer,
+ * the helpers and the CPU state, so it cannot be reused by another process.
+ * What can be reused is the knowledge of which blocks a given guest image
+ * ends up executing: the seed cache records (pc, cs_base, flags) of every
+ * TB inside a guest code window at exit, keyed by a hash of that window's
+ * contents and the CPU model, and replays the translations on the vCPU
+ * thread before the first guest instruction of the next run. Translation
+ * then happens in one batch up front instead of stalling the guest (and
+ * the virtual clock) on every first-time block during boot.
+ */
+#define TB_SEED_MAGIC   "QTBSEED1"
+#define TB_SEED_MAX     (256 * 1024)
+/* Code buffer left free for the run itself once seeding stops */
+#define TB_SEED_CODE_RESERVE (1 * MiB)
+
+typedef struct TBSeedHeader {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+} TBSeedHeader;
+
+typedef struct TBSeedEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t size;
+} TBSeedEntry;
+
+static struct {
+    char *path;
+    target_ulong start;
+    target_ulong end;
+    uint32_t aot_budget;
+    GArray *entries;
+    Notifier exit_notifier;
+} tb_seed;
+
+static gboolean tb_seed_collect_iter(gpointer key, gpointer value,
+                                     gpointer data)
+{
+    const TranslationBlock *tb = value;
+    GArray *entries = data;
+    TBSeedEntry e;
+
+    if (tb_cflags(tb) & (CF_COUNT_MASK | CF_LAST_IO | CF_NOCACHE | CF_INVALID)) {
+        return false;
+    }
+    if (tb->pc < tb_seed.start || tb->pc >= tb_seed.end) {
+        return false;
+    }
+    e.pc = tb->pc;
+    e.cs_base = tb->cs_base;
+    e.flags = tb->flags;
+    e.size = tb->size;
+    g_array_append_val(entries, e);
+    return entries->len >= TB_SEED_MAX;
+}
+
+static void tb_seed_save(Notifier *n, void *opaque)
+{
+    GArray *entries = g_array_new(false, false, sizeof(TBSeedEntry));
+    TBSeedHeader hdr = { .magic = TB_SEED_MAGIC };
+    FILE *f;
+
+    tcg_tb_foreach(tb_seed_collect_iter, entries);
+    hdr.count = entries->len;
+
+    f = fopen(tb_seed.path, "wb");
+    if (!f) {
+        warn_report("tb-seed: could not write %s: %s", tb_seed.path,
+                    strerror(errno));
+    } else {
+        if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+            fwrite(entries->data, sizeof(TBSeedEntry), hdr.count, f)
+                != hdr.count) {
+            warn_report("tb-seed: short write to %s", tb_seed.path);
+        }
+        fclose(f);
+    }
+    g_array_free(entries, true);
+}
+
+static GArray *tb_seed_read(const char *path)
+{
+    TBSeedHeader hdr;
+    GArray *entries;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TB_SEED_MAGIC, sizeof(hdr.magic)) ||
+        hdr.count > TB_SEED_MAX) {
+        fclose(f);
+        return NULL;
+    }
+    entries = g_array_sized_new(false, false, sizeof(TBSeedEntry), hdr.count);
+    g_array_set_size(entries, hdr.count);
+    if (fread(entries->data, sizeof(TBSeedEntry), hdr.count, f) != hdr.count) {
+        g_array_free(entries, true);
+        entries = NULL;
+    }
+    fclose(f);
+    return entries;
+}
+
+/*
+ * True if a TB at pc..pc+size can be translated without raising a fault.
+ * A size of 0 means unknown; the translator may then run one instruction
+ * into the following page, so that page has to be fetchable too.
+ */
+static bool tb_seed_fetchable(CPUArchState *env, target_ulong pc,
+                              uint32_t size)
+{
+    int mmu_idx = cpu_mmu_index(env, true);
+    target_ulong last = size ? pc + size - 1 : (pc | ~TARGET_PAGE_MASK) + 4;
+    void *host;
+    int flags;
+
+    if (pc < tb_seed.start || last >= tb_seed.end) {
+        return false;
+    }
+    flags = probe_access_flags(env, pc, MMU_INST_FETCH, mmu_idx, true,
+                               &host, 0);
+    if ((flags & (TLB_INVALID_MASK | TLB_MMIO)) || !host) {
+        return false;
+    }
+    if ((last & TARGET_PAGE_MASK) != (pc & TARGET_PAGE_MASK)) {
+        flags = probe_access_flags(env, last, MMU_INST_FETCH, mmu_idx, true,
+                                   &host, 0);
+        if ((flags & (TLB_INVALID_MASK | TLB_MMIO)) || !host) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * When the code buffer fills, tb_gen_code() flushes it and leaves through
+ * cpu_loop_exit(), whose longjmp target is only set up inside cpu_exec().
+ * Seeding runs as queued work outside of it, so it has to stop while the
+ * largest possible block still fits, and leave room for the run besides.
+ */
+static bool tb_seed_code_room(void)
+{
+    size_t capacity = tcg_code_capacity();
+
+    return capacity - tcg_code_size() > MAX(capacity / 4, TB_SEED_CODE_RESERVE);
+}
+
+/*
+ * Translate the seeded blocks, then spend up to tb_seed.aot_budget extra
+ * translations walking forward from every block (seeded or not) to the
+ * one that follows it in memory with the same flags. Those are the
+ * not-taken sides of conditional branches and the return sites of calls,
+ * i.e. the code a run is most likely to reach next. The block the CPU is
+ * about to execute is always queued so this also works without a seed file.
+ * The walk ends early, without queueing more, once the code buffer is short
+ * of room (see tb_seed_code_room()).
+ *
+ * This has to run on the vCPU thread: code generation uses the thread's
+ * TCGContext and instruction fetch goes through the vCPU's softmmu TLB.
+ */
+static void tb_seed_translate_work(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    uint32_t cflags = curr_cflags();
+    uint32_t budget = tb_seed.aot_budget;
+    unsigned int i, done = 0;
+    GArray *queue = tb_seed.entries;
+    TBSeedEntry e = {};
+    target_ulong pc, cs_base;
+    uint32_t flags;
+
+    if (!queue) {
+        queue = g_array_new(false, false, sizeof(TBSeedEntry));
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    e.pc = pc;
+    e.cs_base = cs_base;
+    e.flags = flags;
+    g_array_append_val(queue, e);
+
+    for (i = 0; i < queue->len; i++) {
+        TranslationBlock *tb;
+
+        e = g_array_index(queue, TBSeedEntry, i);
+        tb = tb_htable_lookup(cpu, e.pc, e.cs_base, e.flags, cflags);
+        if (!tb) {
+            if (!tb_seed_fetchable(env, e.pc, e.size)) {
+                continue;
+            }
+            if (!tb_seed_code_room()) {
+                break;
+            }
+            mmap_lock();
+            tb = tb_gen_code(cpu, e.pc, e.cs_base, e.flags, cflags);
+            mmap_unlock();
+            done++;
+        }
+        if (budget && tb->size && tb_seed_code_room() &&
+            !tb_htable_lookup(cpu, tb->pc + tb->size, e.cs_base, e.flags,
+                              cflags)) {
+            e.pc = tb->pc + tb->size;
+            e.size = 0;
+            g_array_append_val(queue, e);
+            budget--;
+        }
+    }
+    trace_tb_seed_translated(done, queue->len);
+    g_array_free(queue, true);
+    tb_seed.entries = NULL;
+}
+
+static void tb_seed_key_work(CPUState *cpu, run_on_cpu_data data)
+{
+    char *dir = data.host_ptr;
+    size_t len = tb_seed.end - tb_seed.start;
+    uint8_t *code = g_malloc(len);
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    char *name;
+
+    /*
+     * The window is hashed here rather than at machine init because ROM
+     * images are only copied into guest memory by the first system reset.
+     */
+    cpu_physical_memory_read(tb_seed.start, code, len);
+    g_checksum_update(sum, code, len);
+    g_checksum_update(sum, (const guchar *)object_get_typename(OBJECT(cpu)),
+                      -1);
+    g_checksum_update(sum, (const guchar *)QEMU_VERSION, -1);
+    g_free(code);
+
+    name = g_strdup_printf("%s.tbseed", g_checksum_get_string(sum));
+    tb_seed.path = g_build_filename(dir, name, NULL);
+    g_checksum_free(sum);
+    g_free(name);
+    g_free(dir);
+
+    tb_seed.entries = tb_seed_read(tb_seed.path);
+    tb_seed.exit_notifier.notify = tb_seed_save;
+    qemu_add_exit_notifier(&tb_seed.exit_notifier);
+
+    tb_seed_translate_work(cpu, RUN_ON_CPU_NULL);
+}
+
+/*
+ * Pre-translate guest code in [start, start + size) before the vCPU starts.
+ * If @dir is set, blocks executed by previous runs of the same code are
+ * loaded from (and this run's saved to) a seed file under @dir. Up to
+ * @aot_budget further blocks are discovered by walking forward from those.
+ * Must be called during machine init.
+ */
+void tb_seed_init(CPUState *cpu, const char *dir,
+                  target_ulong start, target_ulong size,
+                  uint32_t aot_budget)
+{
+    if (!tcg_enabled() || tb_seed.end) {
+        return;
+    }
+    if (dir && g_mkdir_with_parents(dir, 0755)) {
+        warn_report("tb-seed: could not create %s: %s", dir, strerror(errno));
+        dir = NULL;
+    }
+    if (!dir && !aot_budget) {
+        return;
+    }
+    tb_seed.start = start;
+    tb_seed.end = start + size;
+    tb_seed.aot_budget = aot_budget;
+    if (dir) {
+        async_run_on_cpu(cpu, tb_seed_key_work,
+                         RUN_ON_CPU_HOST_PTR(g_strdup(dir)));
+    } else {
+        async_run_on_cpu(cpu, tb_seed_translate_work, RUN_ON_CPU_NULL);
+    }
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -0,0 +1,148 @@
+/*
+ * Loopback plant for the Mini404 cosim-shm device
+ *
+ * Attaches to the shared-memory mailbox the emulator creates and answers
+ * every quantum by copying its inputs straight to its outputs. It stands in
+ * for a real plant model when testing the wiring and measuring the handoff
+ * cost, and doubles as a reference for writing one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/futex.h"
+#include <sys/mman.h>
+#include "hw/arm/prusa/utility/p404_cosim_shm.h"
+
+#define LOOPBACK_DEFAULT_SHM "/mini404-cosim"
+
+static volatile sig_atomic_t loopback_quit;
+
+static void loopback_quit_cb(int signum)
+{
+    loopback_quit = 1;
+}
+
+static void loopback_usage(const char *name)
+{
+    printf("Usage: %s [-s shm_name] [-v]\n"
+           "  -s: POSIX shm object the emulator was given (default %s)\n"
+           "  -v: print every quantum\n",
+           name, LOOPBACK_DEFAULT_SHM);
+}
+
+static int64_t loopback_host_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static P404CoSimMailbox *loopback_attach(const char *shm_name)
+{
+    P404CoSimMailbox *m;
+    int fd;
+
+    /* The emulator creates the object; it may not be there yet */
+    while ((fd = shm_open(shm_name, O_RDWR, 0)) < 0) {
+        if (errno != ENOENT || loopback_quit) {
+            perror("shm_open");
+            return NULL;
+        }
+        usleep(100000);
+    }
+    m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return m;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *shm_name = LOOPBACK_DEFAULT_SHM;
+    bool verbose = false;
+    P404CoSimMailbox *m;
+    uint64_t quanta = 0;
+    int64_t waited_ns = 0, start_ns;
+    int c;
+
+    while ((c = getopt(argc, argv, "hs:v")) != -1) {
+        switch (c) {
+        case 's':
+            shm_name = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'h':
+        default:
+            loopback_usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    /* No SA_RESTART: the futex wait has to return EINTR to see the quit */
+    struct sigaction sa = { .sa_handler = loopback_quit_cb };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    m = loopback_attach(shm_name);
+    if (!m) {
+        return 1;
+    }
+    while (qatomic_load_acquire(&m->magic) != P404_COSIM_SHM_MAGIC) {
+        if (loopback_quit) {
+            return 0;
+        }
+        usleep(100000);
+    }
+    if (m->version != P404_COSIM_SHM_VERSION) {
+        fprintf(stderr, "Mailbox version %u, expected %u\n", m->version,
+                P404_COSIM_SHM_VERSION);
+        return 1;
+    }
+    printf("Attached to %s: %u in, %u out, quantum %" PRId64 " ns\n",
+           shm_name, m->num_in, m->num_out, m->quantum_ns);
+
+    start_ns = loopback_host_ns();
+    while (!loopback_quit) {
+        uint32_t seq = qatomic_load_acquire(&m->seq_to_plant);
+
+        if (seq == qatomic_read(&m->seq_to_emu)) {
+            /*
+             * Nothing new; a signal wakes us up with EINTR to check quit.
+             * The timeout covers one that lands just before the wait.
+             */
+            struct timespec ts = { .tv_nsec = 100 * 1000 * 1000 };
+            int64_t t = loopback_host_ns();
+            qemu_futex(&m->seq_to_plant, FUTEX_WAIT, (int)seq, &ts, NULL, 0);
+            waited_ns += loopback_host_ns() - t;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < MIN(m->num_in, m->num_out); i++) {
+            m->out[i] = m->in[i];
+        }
+        if (verbose) {
+            printf("%" PRId64 " ns: seq %u\n", m->time_ns, seq);
+        }
+        qatomic_store_release(&m->seq_to_emu, seq);
+        qemu_futex_wake(&m->seq_to_emu, INT_MAX);
+        quanta++;
+    }
+
+    if (quanta) {
+        int64_t busy_ns = loopback_host_ns() - start_ns - waited_ns;
+        printf("%" PRIu64 " quanta, %" PRId64 " ns of plant time per quantum\n",
+               quanta, busy_ns / (int64_t)quanta);
+    }
+    munmap(m, sizeof(*m));
+    return 0;
+}
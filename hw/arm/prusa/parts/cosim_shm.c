@@ -0,0 +1,243 @@
+/*
+    cosim_shm.c - Lock-step co-simulation with an external plant model
+	over a shared-memory mailbox (see utility/p404_cosim_shm.h).
+
+	Signals arriving on "cosim-in" are handed to the plant at the end of
+	every quantum; the plant's answers come back out of "cosim-out". The VM
+	does not run ahead of the plant, so runs stay deterministic as long as
+	the plant is. A plant that stays silent for stall-ms (0 waits forever)
+	shuts the VM down instead of hanging it.
+
+	Copyright 2021 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of Mini404.
+
+	Mini404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Mini404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Mini404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/atomic.h"
+#include "qemu/futex.h"
+#include "qemu/timer.h"
+#include "hw/qdev-properties.h"
+#include "hw/sysbus.h"
+#include "hw/irq.h"
+#include "sysemu/runstate.h"
+#include "sysemu/sysemu.h"
+#include "migration/vmstate.h"
+#include <sys/mman.h>
+#include "../utility/p404_cosim_shm.h"
+#include "../utility/macros.h"
+
+#define TYPE_COSIM_SHM "cosim-shm"
+OBJECT_DECLARE_SIMPLE_TYPE(CoSimShmState, COSIM_SHM)
+
+struct CoSimShmState {
+    SysBusDevice parent;
+
+    char *shm_name;
+    uint32_t num_in, num_out;
+    uint32_t quantum_us;
+    uint32_t stall_ms;
+
+    P404CoSimMailbox *mbox;
+    uint32_t seq;
+    Notifier exit;
+
+    int32_t in[P404_COSIM_SHM_CHANNELS];
+    int32_t out[P404_COSIM_SHM_CHANNELS];
+
+    QEMUTimer *quantum;
+    qemu_irq irq_out[P404_COSIM_SHM_CHANNELS];
+};
+
+OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(CoSimShmState, cosim_shm, COSIM_SHM, SYS_BUS_DEVICE, {NULL});
+
+// How long to wait on the plant before complaining about it.
+#define COSIM_SHM_WARN_NS (5 * NANOSECONDS_PER_SECOND)
+// The wait holds the BQL, so it wakes up this often to look for a shutdown.
+#define COSIM_SHM_POLL_NS (100 * SCALE_MS)
+
+// Returns false if the plant did not answer and the VM is going down.
+static bool cosim_shm_wait_plant(CoSimShmState *s)
+{
+    P404CoSimMailbox *m = s->mbox;
+    struct timespec ts = {
+        .tv_nsec = COSIM_SHM_POLL_NS,
+    };
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool warned = false;
+    uint32_t seq;
+
+    while ((seq = qatomic_load_acquire(&m->seq_to_emu)) != s->seq) {
+        int64_t waited = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        if (qemu_shutdown_requested_get()) {
+            return false;
+        }
+        if (s->stall_ms && waited >= s->stall_ms * SCALE_MS) {
+            error_report("%s: no answer from the plant on %s in %u ms, giving up",
+                         TYPE_COSIM_SHM, s->shm_name, s->stall_ms);
+            qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_ERROR);
+            return false;
+        }
+        if (!warned && waited >= COSIM_SHM_WARN_NS) {
+            warn_report("%s: waiting for the plant on %s", TYPE_COSIM_SHM, s->shm_name);
+            warned = true;
+        }
+        qemu_futex(&m->seq_to_emu, FUTEX_WAIT, (int)seq, &ts, NULL, 0);
+    }
+    return true;
+}
+
+static void cosim_shm_quantum(void *opaque)
+{
+    CoSimShmState *s = opaque;
+    P404CoSimMailbox *m = s->mbox;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    memcpy(m->in, s->in, s->num_in * sizeof(s->in[0]));
+    m->time_ns = now;
+    qatomic_store_release(&m->seq_to_plant, ++s->seq);
+    qemu_futex_wake(&m->seq_to_plant, INT_MAX);
+
+    if (!cosim_shm_wait_plant(s)) {
+        return;
+    }
+
+    for (int i = 0; i < s->num_out; i++) {
+        int32_t v = m->out[i];
+        if (v != s->out[i]) {
+            s->out[i] = v;
+            qemu_set_irq(s->irq_out[i], v);
+        }
+    }
+    timer_mod(s->quantum, now + s->quantum_us * SCALE_US);
+}
+
+static void cosim_shm_input(void *opaque, int n, int level)
+{
+    CoSimShmState *s = opaque;
+    s->in[n] = level;
+}
+
+static void cosim_shm_reset(DeviceState *dev)
+{
+    CoSimShmState *s = COSIM_SHM(dev);
+    memset(s->in, 0, sizeof(s->in));
+    timer_mod(s->quantum, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->quantum_us * SCALE_US);
+}
+
+// The plant keeps its mapping; only the name goes, so no stale object is left behind.
+static void cosim_shm_exit(Notifier *n, void *data)
+{
+    CoSimShmState *s = container_of(n, CoSimShmState, exit);
+    shm_unlink(s->shm_name);
+}
+
+static void cosim_shm_realize(DeviceState *dev, Error **errp)
+{
+    CoSimShmState *s = COSIM_SHM(dev);
+
+    if (!s->shm_name) {
+        error_setg(errp, "%s: shm property is required", TYPE_COSIM_SHM);
+        return;
+    }
+    if (s->num_in > P404_COSIM_SHM_CHANNELS || s->num_out > P404_COSIM_SHM_CHANNELS) {
+        error_setg(errp, "%s: at most %d channels each way", TYPE_COSIM_SHM, P404_COSIM_SHM_CHANNELS);
+        return;
+    }
+    if (!s->quantum_us) {
+        error_setg(errp, "%s: quantum-us must be positive", TYPE_COSIM_SHM);
+        return;
+    }
+
+    int fd = shm_open(s->shm_name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "%s: can't open %s", TYPE_COSIM_SHM, s->shm_name);
+        return;
+    }
+    if (ftruncate(fd, sizeof(P404CoSimMailbox)) < 0) {
+        error_setg_errno(errp, errno, "%s: can't size %s", TYPE_COSIM_SHM, s->shm_name);
+        close(fd);
+        return;
+    }
+    void *p = mmap(NULL, sizeof(P404CoSimMailbox), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        error_setg_errno(errp, errno, "%s: can't map %s", TYPE_COSIM_SHM, s->shm_name);
+        return;
+    }
+    s->mbox = p;
+    s->exit.notify = cosim_shm_exit;
+    qemu_add_exit_notifier(&s->exit);
+
+    // The object survives a run that did not exit cleanly; a plant still
+    // attached to it sees the magic drop and waits for the new header.
+    memset(s->mbox, 0, sizeof(P404CoSimMailbox));
+    s->mbox->version = P404_COSIM_SHM_VERSION;
+    s->mbox->num_in = s->num_in;
+    s->mbox->num_out = s->num_out;
+    s->mbox->quantum_ns = s->quantum_us * SCALE_US;
+    qatomic_store_release(&s->mbox->magic, P404_COSIM_SHM_MAGIC);
+
+    qdev_init_gpio_in_named(dev, cosim_shm_input, "cosim-in", s->num_in);
+    qdev_init_gpio_out_named(dev, s->irq_out, "cosim-out", s->num_out);
+}
+
+static void cosim_shm_finalize(Object *obj)
+{
+    CoSimShmState *s = COSIM_SHM(obj);
+    if (s->mbox) {
+        qemu_remove_exit_notifier(&s->exit);
+        munmap(s->mbox, sizeof(P404CoSimMailbox));
+    }
+}
+
+static void cosim_shm_init(Object *obj)
+{
+    CoSimShmState *s = COSIM_SHM(obj);
+    s->quantum = timer_new_ns(QEMU_CLOCK_VIRTUAL, cosim_shm_quantum, s);
+}
+
+static Property cosim_shm_properties[] = {
+    DEFINE_PROP_STRING("shm", CoSimShmState, shm_name),
+    DEFINE_PROP_UINT32("num-in", CoSimShmState, num_in, 4),
+    DEFINE_PROP_UINT32("num-out", CoSimShmState, num_out, 4),
+    DEFINE_PROP_UINT32("quantum-us", CoSimShmState, quantum_us, 1000),
+    DEFINE_PROP_UINT32("stall-ms", CoSimShmState, stall_ms, 30000),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static const VMStateDescription vmstate_cosim_shm = {
+    .name = TYPE_COSIM_SHM,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT32_ARRAY(in, CoSimShmState, P404_COSIM_SHM_CHANNELS),
+        VMSTATE_INT32_ARRAY(out, CoSimShmState, P404_COSIM_SHM_CHANNELS),
+        VMSTATE_TIMER_PTR(quantum, CoSimShmState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void cosim_shm_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = cosim_shm_realize;
+    dc->reset = cosim_shm_reset;
+    dc->vmsd = &vmstate_cosim_shm;
+    device_class_set_props(dc, cosim_shm_properties);
+}
@@ -29,6 +29,8 @@
 #include "qemu/module.h"
 #include "hw/irq.h"
 #include "qemu/timer.h"
+#include "qemu/cutils.h"
+#include "hw/qdev-properties.h"
 #include "ui/console.h"
 #include "qom/object.h"
 #include "hw/sysbus.h"
@@ -38,6 +40,10 @@
 
 #define TYPE_ENCODER_INPUT "encoder-input"
 
+// Queued gestures: a signed number of detents to twist, or 0 for a push.
+#define ENCODER_GESTURE_MAX 64
+#define ENCODER_GESTURE_PUSH 0
+
 OBJECT_DECLARE_SIMPLE_TYPE(InputState, ENCODER_INPUT)
 
 struct InputState {
@@ -55,12 +61,25 @@ struct InputState {
     int8_t encoder_dir;
 
     QEMUTimer *timer, *release;
+
+    // Gesture queue, walked by a single timer.
+    int16_t gestures[ENCODER_GESTURE_MAX];
+    uint8_t gesture_head;
+    uint8_t gesture_count;
+    int32_t gesture_phases;     // Phase changes left in the current twist.
+    bool gesture_pressed;
+    bool gesture_waiting;       // A Gestures action is waiting for the queue to drain.
+    QEMUTimer *gesture_timer;
+
+    uint32_t phase_us;
+    uint32_t push_ms;
 };
 
 enum {
     ACT_TWIST, 
     ACT_PUSH,
-    ACT_RESET
+    ACT_RESET,
+    ACT_GESTURES,
 };
 
 static void encoder_input_keyevent(void *opaque, int keycode)
@@ -106,11 +125,10 @@ static void buddy_autorelease_timer_expire(void *opaque)
     qemu_set_irq(s->irq_enc_button,1);
 }
 
-static void encoder_input_timer_expire(void *opaque)
+static void encoder_input_step_phase(InputState *s, int dir)
 {
     static const uint8_t encoder_input_phases[4] = {0x11, 0x01, 0x00, 0x10};
-    InputState *s = opaque;
-    if (s->encoder_dir<0){
+    if (dir<0){
         s->phase++;
     } else {
         s->phase+=3;
@@ -118,6 +136,12 @@ static void encoder_input_timer_expire(void *opaque)
     s->phase = s->phase%4;
     qemu_set_irq(s->irq_enc_a, (encoder_input_phases[s->phase]&0xF0)>0);
     qemu_set_irq(s->irq_enc_b, (encoder_input_phases[s->phase]&0x0F)>0);
+}
+
+static void encoder_input_timer_expire(void *opaque)
+{
+    InputState *s = opaque;
+    encoder_input_step_phase(s, s->encoder_dir);
     s->encoder_ticks--;
 
     if (s->encoder_ticks>0)
@@ -127,6 +151,79 @@ static void encoder_input_timer_expire(void *opaque)
 
 }
 
+// Advances the gesture queue by one phase change or button edge.
+static void encoder_input_gesture_expire(void *opaque)
+{
+    InputState *s = opaque;
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL);
+    if (!s->gesture_count) {
+        return;
+    }
+    int16_t g = s->gestures[s->gesture_head];
+    if (g == ENCODER_GESTURE_PUSH) {
+        s->gesture_pressed = !s->gesture_pressed;
+        qemu_set_irq(s->irq_enc_button, !s->gesture_pressed);
+        if (!s->gesture_pressed) {
+            s->gesture_head = (s->gesture_head + 1) % ENCODER_GESTURE_MAX;
+            s->gesture_count--;
+        }
+        // Hold the button, then leave the same time released before moving on.
+        timer_mod(s->gesture_timer, now + s->push_ms * 1000);
+        return;
+    }
+    if (s->gesture_phases == 0) {
+        s->gesture_phases = abs(g) * 2;
+    }
+    // Positive twists match Twist(1), which turns the same way as key up.
+    encoder_input_step_phase(s, g > 0 ? -1 : 1);
+    if (--s->gesture_phases == 0) {
+        s->gesture_head = (s->gesture_head + 1) % ENCODER_GESTURE_MAX;
+        s->gesture_count--;
+    }
+    timer_mod(s->gesture_timer, now + s->phase_us);
+}
+
+// Queues a gesture string: signed detent counts to twist, and "p" for a push,
+// separated by spaces or commas, e.g. "5 p -2 p".
+static bool encoder_input_queue_gestures(InputState *s, const char *str)
+{
+    int16_t parsed[ENCODER_GESTURE_MAX];
+    int count = 0;
+    bool ok = true;
+
+    gchar **tokens = g_strsplit_set(str, " ,;", -1);
+    for (gchar **t = tokens; ok && *t; t++) {
+        int value;
+        if (!**t) {
+            continue;
+        }
+        if (count + s->gesture_count == ENCODER_GESTURE_MAX) {
+            ok = false;
+        } else if (g_ascii_strcasecmp(*t, "p") == 0) {
+            parsed[count++] = ENCODER_GESTURE_PUSH;
+        } else if (qemu_strtoi(*t, NULL, 0, &value) == 0 && value != 0 && abs(value) <= INT16_MAX) {
+            parsed[count++] = value;
+        } else {
+            ok = false;
+        }
+    }
+    g_strfreev(tokens);
+    if (!ok) {
+        printf("encoder-input: bad or too many gestures in \"%s\"\n", str);
+        return false;
+    }
+
+    bool idle = s->gesture_count == 0;
+    for (int i = 0; i < count; i++) {
+        s->gestures[(s->gesture_head + s->gesture_count) % ENCODER_GESTURE_MAX] = parsed[i];
+        s->gesture_count++;
+    }
+    if (idle && count) {
+        encoder_input_gesture_expire(s);
+    }
+    return true;
+}
+
 static void encoder_input_mouseevent(void *opaque, int dx, int dy, int dz, int buttons_state)
 {
     InputState *s = opaque;
@@ -166,6 +263,10 @@ static void encoder_input_reset(DeviceState *dev)
     InputState *s = ENCODER_INPUT(dev);
     s->last_state = 0;
     s->phase = 0;
+    s->gesture_count = 0;
+    s->gesture_phases = 0;
+    s->gesture_pressed = false;
+    timer_del(s->gesture_timer);
     qemu_irq_lower(s->irq_enc_a);
     qemu_irq_lower(s->irq_enc_b);
 }
@@ -190,6 +291,19 @@ static int encoder_input_process_action(P404ScriptIF *obj, unsigned int action,
         case ACT_RESET:
             qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
             break;
+        case ACT_GESTURES:
+            // Finishes once the whole queue has been played out.
+            if (!s->gesture_waiting) {
+                if (!encoder_input_queue_gestures(s, scripthost_get_string(args, 0))) {
+                    return ScriptLS_Error;
+                }
+                s->gesture_waiting = true;
+            }
+            if (s->gesture_count) {
+                return ScriptLS_Waiting;
+            }
+            s->gesture_waiting = false;
+            break;
         default:
             return ScriptLS_Unhandled;
     }
@@ -209,6 +323,8 @@ static void encoder_input_init(Object *obj)
                     (QEMUTimerCB *)encoder_input_timer_expire, s);
     s->release = timer_new_ms(QEMU_CLOCK_VIRTUAL,
             (QEMUTimerCB *)buddy_autorelease_timer_expire, s);
+    s->gesture_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+            (QEMUTimerCB *)encoder_input_gesture_expire, s);
 
     script_handle pScript = script_instance_new(P404_SCRIPTABLE(obj), TYPE_ENCODER_INPUT);
 
@@ -216,6 +332,8 @@ static void encoder_input_init(Object *obj)
     script_add_arg_int(pScript, ACT_TWIST);
     script_register_action(pScript, "Push",  "Presses the encoder", ACT_PUSH);
     script_register_action(pScript, "Reset", "Resets the printer", ACT_RESET);
+    script_register_action(pScript, "Gestures", "Plays a queue of twists (signed detents) and pushes (p), e.g. \"5 p -2 p\", and waits for it to finish", ACT_GESTURES);
+    script_add_arg_string(pScript, ACT_GESTURES);
 
     scripthost_register_scriptable(pScript);
 }
@@ -229,13 +347,15 @@ static int encoder_post_load(void *opaque, int version_id)
     }
     if (s->encoder_dir <-1 || s->encoder_dir>1)
         return -EINVAL;
+    if (s->gesture_head >= ENCODER_GESTURE_MAX || s->gesture_count > ENCODER_GESTURE_MAX)
+        return -EINVAL;
 
     return 0;
 }
 
 static const VMStateDescription vmstate_encoder_input = {
     .name = TYPE_ENCODER_INPUT,
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .post_load = encoder_post_load,
     .fields      = (VMStateField []) {
@@ -245,10 +365,24 @@ static const VMStateDescription vmstate_encoder_input = {
         VMSTATE_INT8(encoder_dir,InputState),
         VMSTATE_TIMER_PTR(timer,InputState),
         VMSTATE_TIMER_PTR(release,InputState),
+        VMSTATE_INT16_ARRAY_V(gestures,InputState,ENCODER_GESTURE_MAX, 2),
+        VMSTATE_UINT8_V(gesture_head,InputState, 2),
+        VMSTATE_UINT8_V(gesture_count,InputState, 2),
+        VMSTATE_INT32_V(gesture_phases,InputState, 2),
+        VMSTATE_BOOL_V(gesture_pressed,InputState, 2),
+        VMSTATE_BOOL_V(gesture_waiting,InputState, 2),
+        VMSTATE_TIMER_PTR_V(gesture_timer,InputState, 2),
         VMSTATE_END_OF_LIST()
     }
 };
 
+static Property encoder_input_properties[] = {
+    // Time between quadrature phase changes; keep it above the firmware's encoder sampling period.
+    DEFINE_PROP_UINT32("phase-us", InputState, phase_us, 2000),
+    DEFINE_PROP_UINT32("push-ms", InputState, push_ms, 100),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void encoder_input_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -258,4 +392,5 @@ static void encoder_input_class_init(ObjectClass *oc, void *data)
     P404ScriptIFClass *sc = P404_SCRIPTABLE_CLASS(oc);
     sc->ScriptHandler = encoder_input_process_action;
     dc->vmsd = &vmstate_encoder_input;
+    device_class_set_props(dc, encoder_input_properties);
 }
@@ -0,0 +1,390 @@
+/*
+    esp8266.c - ESP8266 Wi-Fi module stand-in for Mini404
+
+    Buddy firmware drives the module as a UART NIC: the ESP runs Prusa's
+    uart_nic firmware and the MCU runs the TCP/IP stack, so the UART
+    carries Ethernet frames. Every message starts with an 8-byte intron
+    followed by a type byte:
+
+      DEVINFO      ESP->MCU  u16 version, u8 MAC length, MAC
+      LINK         ESP->MCU  u8 up
+      GETLINK      MCU->ESP  -
+      CLIENTCONFIG MCU->ESP  u8 SSID length, SSID, u8 password length, password
+      PACKET       both      u32 length, Ethernet frame
+      INTRON       MCU->ESP  the intron to use from now on
+
+    Multi-byte fields are little-endian. Frames are bridged to a QEMU
+    netdev - typically -netdev user (slirp), which terminates TCP/UDP.
+    They are handed to the USART in bulk and leave it byte by byte, but
+    no per-character timing is involved in either direction.
+
+	Copyright 2021 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of Mini404.
+
+	Mini404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Mini404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Mini404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qom/object.h"
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+#include "qemu/log.h"
+#include "qemu/bswap.h"
+#include "hw/irq.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "net/net.h"
+#include "../stm32f407/stm32.h"
+#include "../stm32f407/stm32_uart.h"
+#include "qemu/module.h"
+
+#define TYPE_ESP8266 "esp8266"
+OBJECT_DECLARE_SIMPLE_TYPE(esp8266_state, ESP8266)
+
+#define ESP_FRAME_MAX   1518
+#define ESP_INTRON_LEN  8
+// Intron, type and length ahead of every frame.
+#define ESP_PACKET_HDR  (ESP_INTRON_LEN + 1 + 4)
+#define ESP_IN_SIZE     (ESP_PACKET_HDR + ESP_FRAME_MAX)
+// Room for a few whole frames on their way to the USART.
+#define ESP_OUT_SIZE    (4 * (ESP_PACKET_HDR + ESP_FRAME_MAX))
+
+#define ESP_BOOT_NS     (300 * SCALE_MS)
+
+enum {
+    MSG_DEVINFO,
+    MSG_LINK,
+    MSG_GETLINK,
+    MSG_CLIENTCONFIG,
+    MSG_PACKET,
+    MSG_INTRON,
+};
+
+static const uint8_t esp8266_default_intron[ESP_INTRON_LEN] = {
+    'U', 'N', 0x00, 0x01, 0x02, 0x03, 0x04, 0x05
+};
+
+struct esp8266_state {
+    SysBusDevice parent;
+
+    NICState *nic;
+    NICConf conf;
+    Stm32Uart *uart;
+    uint16_t fw_version;
+
+    QEMUTimer *boot;
+
+    bool booted;
+    bool link_up;
+    bool pushing;
+
+    uint8_t intron[ESP_INTRON_LEN];
+
+    uint8_t in[ESP_IN_SIZE];
+    uint32_t in_len;
+
+    uint8_t out[ESP_OUT_SIZE];
+    uint32_t out_len;
+};
+
+OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(esp8266_state, esp8266, ESP8266, SYS_BUS_DEVICE, {NULL});
+
+static bool esp8266_can_receive(NetClientState *nc);
+
+// Hand as much of the output queue to the USART as it has room for.
+static void esp8266_push(esp8266_state *s)
+{
+    uint8_t chunk[USART_RCV_BUF_LEN];
+
+    // A DMA read of the USART can bring us back here mid-transfer.
+    if (s->pushing) {
+        return;
+    }
+    s->pushing = true;
+    while (s->out_len) {
+        uint32_t n = MIN(MIN(s->out_len, sizeof(chunk)), stm32_uart_rx_space(s->uart));
+        if (!n) {
+            break;
+        }
+        memcpy(chunk, s->out, n);
+        s->out_len -= n;
+        memmove(s->out, s->out + n, s->out_len);
+        stm32_uart_rx_bulk(s->uart, chunk, n);
+    }
+    s->pushing = false;
+}
+
+// The USART has room again: keep the output moving, and once a whole
+// frame fits, take the next one from the netdev.
+static void esp8266_uart_ready(void *opaque)
+{
+    esp8266_state *s = ESP8266(opaque);
+    if (s->pushing) {
+        return;
+    }
+    esp8266_push(s);
+    if (esp8266_can_receive(qemu_get_queue(s->nic))) {
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+    }
+}
+
+// Queue one message; control messages are dropped if the MCU stopped reading.
+static void esp8266_send(esp8266_state *s, uint8_t type, const void *data, uint32_t len)
+{
+    if (sizeof(s->out) - s->out_len < ESP_INTRON_LEN + 1 + len) {
+        return;
+    }
+    memcpy(s->out + s->out_len, s->intron, ESP_INTRON_LEN);
+    s->out_len += ESP_INTRON_LEN;
+    s->out[s->out_len++] = type;
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+    esp8266_push(s);
+}
+
+static void esp8266_send_link(esp8266_state *s)
+{
+    uint8_t up = s->link_up;
+    esp8266_send(s, MSG_LINK, &up, 1);
+}
+
+static void esp8266_boot_done(void *opaque)
+{
+    esp8266_state *s = ESP8266(opaque);
+    uint8_t info[3 + sizeof(s->conf.macaddr.a)];
+
+    s->booted = true;
+    stw_le_p(info, s->fw_version);
+    info[2] = sizeof(s->conf.macaddr.a);
+    memcpy(info + 3, s->conf.macaddr.a, sizeof(s->conf.macaddr.a));
+    esp8266_send(s, MSG_DEVINFO, info, sizeof(info));
+}
+
+static void esp8266_reboot(esp8266_state *s)
+{
+    s->booted = false;
+    s->link_up = false;
+    s->in_len = 0;
+    memcpy(s->intron, esp8266_default_intron, ESP_INTRON_LEN);
+    timer_mod(s->boot, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ESP_BOOT_NS);
+}
+
+// Length of the message being received, 0 if its header is still
+// incomplete, or -1 if it can't be valid.
+static int esp8266_msg_len(esp8266_state *s)
+{
+    const uint8_t *p = s->in + ESP_INTRON_LEN + 1;
+    uint32_t have = s->in_len - (ESP_INTRON_LEN + 1);
+    uint32_t len;
+
+    switch (s->in[ESP_INTRON_LEN]) {
+        case MSG_GETLINK:
+            return ESP_INTRON_LEN + 1;
+        case MSG_INTRON:
+            return ESP_INTRON_LEN + 1 + ESP_INTRON_LEN;
+        case MSG_CLIENTCONFIG:
+            if (have < 1 || have < 2u + p[0]) {
+                return 0;
+            }
+            return ESP_INTRON_LEN + 1 + 2 + p[0] + p[1 + p[0]];
+        case MSG_PACKET:
+            if (have < 4) {
+                return 0;
+            }
+            len = ldl_le_p(p);
+            return len <= ESP_FRAME_MAX ? ESP_PACKET_HDR + len : -1;
+        default:
+            return -1;
+    }
+}
+
+static void esp8266_message(esp8266_state *s)
+{
+    const uint8_t *p = s->in + ESP_INTRON_LEN + 1;
+
+    switch (s->in[ESP_INTRON_LEN]) {
+        case MSG_GETLINK:
+            esp8266_send_link(s);
+            break;
+        case MSG_CLIENTCONFIG:
+            // Any network will do; the netdev is the only one there is.
+            s->link_up = qemu_get_queue(s->nic)->peer != NULL;
+            esp8266_send_link(s);
+            if (s->link_up) {
+                qemu_flush_queued_packets(qemu_get_queue(s->nic));
+            }
+            break;
+        case MSG_PACKET:
+            if (s->link_up) {
+                qemu_send_packet(qemu_get_queue(s->nic), p + 4, ldl_le_p(p));
+            }
+            break;
+        case MSG_INTRON:
+            memcpy(s->intron, p, ESP_INTRON_LEN);
+            break;
+    }
+}
+
+static void esp8266_byte_in(void *opaque, int n, int level)
+{
+    esp8266_state *s = ESP8266(opaque);
+    uint8_t byte = level;
+    int len;
+
+    if (!s->booted) {
+        return;
+    }
+    if (s->in_len < ESP_INTRON_LEN && byte != s->intron[s->in_len]) {
+        // Out of step: wait for the next intron.
+        s->in_len = 0;
+        if (byte != s->intron[0]) {
+            return;
+        }
+    }
+    s->in[s->in_len++] = byte;
+    if (s->in_len <= ESP_INTRON_LEN) {
+        return;
+    }
+    len = esp8266_msg_len(s);
+    if (len < 0) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: bad message type %u\n", TYPE_ESP8266,
+                      s->in[ESP_INTRON_LEN]);
+        s->in_len = 0;
+    } else if (s->in_len == len) {
+        esp8266_message(s);
+        s->in_len = 0;
+    }
+}
+
+static bool esp8266_can_receive(NetClientState *nc)
+{
+    esp8266_state *s = qemu_get_nic_opaque(nc);
+    return s->booted &&
+        sizeof(s->out) - s->out_len >= ESP_PACKET_HDR + ESP_FRAME_MAX;
+}
+
+static ssize_t esp8266_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    esp8266_state *s = qemu_get_nic_opaque(nc);
+    uint8_t *p;
+
+    if (!s->link_up || size > ESP_FRAME_MAX) {
+        return size; // Dropped, as on the air.
+    }
+    if (!esp8266_can_receive(nc)) {
+        return 0;
+    }
+    p = s->out + s->out_len;
+    memcpy(p, s->intron, ESP_INTRON_LEN);
+    p[ESP_INTRON_LEN] = MSG_PACKET;
+    stl_le_p(p + ESP_INTRON_LEN + 1, size);
+    memcpy(p + ESP_PACKET_HDR, buf, size);
+    s->out_len += ESP_PACKET_HDR + size;
+    esp8266_push(s);
+    return size;
+}
+
+static NetClientInfo net_esp8266_info = {
+    .type = NET_CLIENT_DRIVER_NIC,
+    .size = sizeof(NICState),
+    .can_receive = esp8266_can_receive,
+    .receive = esp8266_receive,
+};
+
+static void esp8266_finalize(Object *obj)
+{
+    esp8266_state *s = ESP8266(obj);
+    timer_del(s->boot);
+    timer_free(s->boot);
+    if (s->nic) {
+        qemu_del_nic(s->nic);
+    }
+}
+
+static void esp8266_init(Object *obj)
+{
+    esp8266_state *s = ESP8266(obj);
+    s->boot = timer_new_ns(QEMU_CLOCK_VIRTUAL, esp8266_boot_done, s);
+    qdev_init_gpio_in_named(DEVICE(obj), esp8266_byte_in, "esp-byte-in", 1);
+}
+
+static void esp8266_realize(DeviceState *dev, Error **errp)
+{
+    esp8266_state *s = ESP8266(dev);
+
+    if (!s->uart) {
+        error_setg(errp, "esp8266: 'uart' link not set");
+        return;
+    }
+    stm32_uart_set_peer(s->uart, esp8266_uart_ready, s);
+
+    qemu_macaddr_default_if_unset(&s->conf.macaddr);
+    s->nic = qemu_new_nic(&net_esp8266_info, &s->conf,
+                          object_get_typename(OBJECT(dev)), dev->id, s);
+    qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
+}
+
+static void esp8266_reset(DeviceState *dev)
+{
+    esp8266_state *s = ESP8266(dev);
+    s->out_len = 0;
+    esp8266_reboot(s);
+}
+
+static Property esp8266_properties[] = {
+    DEFINE_NIC_PROPERTIES(esp8266_state, conf),
+    DEFINE_PROP_LINK("uart", esp8266_state, uart, TYPE_STM32_UART, Stm32Uart *),
+    // uart_nic firmware version to report; the MCU reflashes a mismatch.
+    DEFINE_PROP_UINT16("fw-version", esp8266_state, fw_version, 10),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static int esp8266_post_load(void *opaque, int version_id)
+{
+    esp8266_state *s = opaque;
+    if (s->in_len > ESP_IN_SIZE || s->out_len > ESP_OUT_SIZE) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_esp8266 = {
+    .name = TYPE_ESP8266,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .post_load = esp8266_post_load,
+    .fields      = (VMStateField []) {
+        VMSTATE_TIMER_PTR(boot, esp8266_state),
+        VMSTATE_BOOL(booted, esp8266_state),
+        VMSTATE_BOOL(link_up, esp8266_state),
+        VMSTATE_UINT8_ARRAY(intron, esp8266_state, ESP_INTRON_LEN),
+        VMSTATE_UINT8_ARRAY(in, esp8266_state, ESP_IN_SIZE),
+        VMSTATE_UINT32(in_len, esp8266_state),
+        VMSTATE_UINT8_ARRAY(out, esp8266_state, ESP_OUT_SIZE),
+        VMSTATE_UINT32(out_len, esp8266_state),
+        VMSTATE_END_OF_LIST(),
+    }
+};
+
+static void esp8266_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = esp8266_realize;
+    dc->reset = esp8266_reset;
+    device_class_set_props(dc, esp8266_properties);
+    dc->vmsd = &vmstate_esp8266;
+    set_bit(DEVICE_CATEGORY_NETWORK, dc->categories);
+}
@@ -30,6 +30,7 @@
 #include "hw/irq.h"
 #include "qom/object.h"
 #include "hw/sysbus.h"
+#include "hw/qdev-properties.h"
 
 #define TYPE_IRSENSOR "ir-sensor"
 
@@ -41,12 +42,30 @@ struct IRState {
     /*< public >*/
     bool state;
     qemu_irq irq;
-
+    qemu_irq jam_irq;
+
+    // Filament tracking from the E driver position, in tmc2209 step units.
+    // e_pos is unwrapped from the driver's 32-bit position.
+    int64_t e_pos;
+    bool e_valid;
+    int64_t consumed;
+    int64_t runout_at;  // 0 = endless spool
+    int64_t jam_at;     // 0 = no jam
+    bool runout;
+    bool jammed;
+
+    uint32_t steps_per_mm;
+    uint32_t spool_mm;
+    uint32_t jam_mm;
+    bool runout_level;
 };
 
 enum {
     ACT_SET, 
     ACT_TOGGLE,
+    ACT_LOAD_SPOOL,
+    ACT_JAM_AFTER,
+    ACT_GET_USED,
 };
 
 OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(IRState, irsensor, IRSENSOR, SYS_BUS_DEVICE, {TYPE_P404_SCRIPTABLE}, {NULL})
@@ -56,14 +75,58 @@ static void irsensor_finalize(Object *obj)
 {
 }
 
+static void irsensor_update(IRState *s) {
+    qemu_set_irq(s->irq,s->state);
+}
+
+static int64_t irsensor_mm_to_steps(IRState *s, float mm) {
+    return mm > 0 ? (int64_t)(mm * s->steps_per_mm) : 0;
+}
+
+// New spool (or the configured one at reset): filament present, nothing used.
+static void irsensor_load_spool(IRState *s, float length_mm) {
+    s->consumed = 0;
+    s->runout_at = irsensor_mm_to_steps(s, length_mm);
+    s->runout = false;
+    s->jammed = false;
+    s->state = !s->runout_level;
+    qemu_set_irq(s->jam_irq, 0);
+    irsensor_update(s);
+}
+
 static void irsensor_reset(DeviceState *dev)
 {
     IRState *s = IRSENSOR(dev);
-    qemu_set_irq(s->irq,0);
+    s->e_valid = false;
+    irsensor_load_spool(s, s->spool_mm);
+    s->jam_at = irsensor_mm_to_steps(s, s->jam_mm);
 }
 
-static void irsensor_update(IRState *s) {
-    qemu_set_irq(s->irq,s->state);
+// Runs on every E step, so only compares against precomputed step counts.
+static void irsensor_e_position(void *opaque, int n, int level) {
+    IRState *s = IRSENSOR(opaque);
+    if (!s->e_valid) {
+        s->e_pos = level;
+        s->e_valid = true;
+        return;
+    }
+    // Modulo 2^32, so the step across a wrap of the driver position is still small.
+    int32_t delta = (uint32_t)level - (uint32_t)s->e_pos;
+    s->e_pos += delta;
+    if (s->jammed || s->runout) {
+        // Stuck filament doesn't move, and after runout there's none left to move.
+        return;
+    }
+    s->consumed = MAX(s->consumed + delta, 0);
+    if (s->jam_at && s->consumed >= s->jam_at) {
+        s->jammed = true;
+        qemu_set_irq(s->jam_irq, 1);
+    }
+    if (s->runout_at && s->consumed >= s->runout_at) {
+        s->runout = true;
+        s->state = s->runout_level;
+        irsensor_update(s);
+    }
 }
 
 static int irsensor_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
@@ -79,6 +142,18 @@ static int irsensor_process_action(P404ScriptIF *obj, unsigned int action, scrip
         case ACT_SET:
             s->state = scripthost_get_bool(args, 0);
             break;
+        case ACT_LOAD_SPOOL:
+            irsensor_load_spool(s, scripthost_get_float(args, 0));
+            break;
+        case ACT_JAM_AFTER:
+        {
+            float mm = scripthost_get_float(args, 0);
+            s->jam_at = mm > 0 ? s->consumed + irsensor_mm_to_steps(s, mm) : 0;
+            break;
+        }
+        case ACT_GET_USED:
+            script_print_float((float)s->consumed / (float)s->steps_per_mm);
+            return ScriptLS_Finished;
         default:
             return ScriptLS_Unhandled;
     }
@@ -90,6 +165,8 @@ static void irsensor_init(Object *obj)
 {
     IRState *s = IRSENSOR(obj);
     qdev_init_gpio_out(DEVICE(obj), &s->irq, 1);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->jam_irq, "jam-out", 1);
+    qdev_init_gpio_in_named(DEVICE(obj), irsensor_e_position, "e-position-in", 1);
 
     script_handle pScript = script_instance_new(P404_SCRIPTABLE(obj), TYPE_IRSENSOR);
 
@@ -97,24 +174,46 @@ static void irsensor_init(Object *obj)
     script_add_arg_bool(pScript, ACT_SET);
     script_register_action(pScript, "Toggle",  "Toggles IR sensor state", ACT_TOGGLE);
 
+    script_register_action(pScript, "LoadSpool", "Loads a new spool of the given length in mm (0 = endless)", ACT_LOAD_SPOOL);
+    script_add_arg_float(pScript, ACT_LOAD_SPOOL);
+    script_register_action(pScript, "JamAfter", "Jams the filament after the given further mm of extrusion (0 = never)", ACT_JAM_AFTER);
+    script_add_arg_float(pScript, ACT_JAM_AFTER);
+    script_register_action(pScript, "GetUsed", "Reports the filament used from the current spool in mm", ACT_GET_USED);
+
     scripthost_register_scriptable(pScript);
 }
 
 static const VMStateDescription vmstate_irsensor = {
     .name = TYPE_IRSENSOR,
-    .version_id = 1,
-    .minimum_version_id = 1,
+    .version_id = 3,
+    .minimum_version_id = 3,
     .fields      = (VMStateField []) {
         VMSTATE_BOOL(state, IRState),
+        VMSTATE_INT64(e_pos, IRState),
+        VMSTATE_BOOL(e_valid, IRState),
+        VMSTATE_INT64(consumed, IRState),
+        VMSTATE_INT64(runout_at, IRState),
+        VMSTATE_INT64(jam_at, IRState),
+        VMSTATE_BOOL(runout, IRState),
+        VMSTATE_BOOL(jammed, IRState),
         VMSTATE_END_OF_LIST(),
     }
 };
 
+static Property irsensor_properties[] = {
+    DEFINE_PROP_UINT32("steps-per-mm", IRState, steps_per_mm, 320*16),
+    DEFINE_PROP_UINT32("spool-mm", IRState, spool_mm, 0),
+    DEFINE_PROP_UINT32("jam-mm", IRState, jam_mm, 0),
+    DEFINE_PROP_BOOL("runout-level", IRState, runout_level, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void irsensor_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
     dc->reset = irsensor_reset;
     dc->vmsd = &vmstate_irsensor;
+    device_class_set_props(dc, irsensor_properties);
     P404ScriptIFClass *sc = P404_SCRIPTABLE_CLASS(oc);
     sc->ScriptHandler = irsensor_process_action;
 }
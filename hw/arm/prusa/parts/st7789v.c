@@ -26,6 +26,7 @@
 #include "qemu/module.h"
 #include "ui/console.h"
 #include "qom/object.h"
+#include "qemu/host-utils.h"
 #include "../utility/macros.h"
 #include "../utility/p404scriptable.h"
 #include "../utility/ScriptHost_C.h"
@@ -70,6 +71,26 @@ do { fprintf(stderr, "st7789v: error: " fmt , ## __VA_ARGS__);} while (0)
 #define DPY_ROWS 320
 #define DPY_COLS 240
 
+// Glyph atlases follow the firmware font images: 16 glyphs per row,
+// starting from ' ', each glyph a fixed-size cell.
+#define FONT_MAX 4
+#define FONT_FIRST_CHAR 32
+#define FONT_GLYPHS 96
+#define FONT_MAX_W 32
+#define FONT_MAX_H 64
+#define FONT_ATLAS_COLS 16
+
+// Luminance difference from the background that counts as ink.
+#define FONT_INK_THRESHOLD 64
+
+typedef struct st7789v_font {
+    uint8_t w, h;
+    uint8_t count;
+    // Each glyph row as a bitmask, bit n set where column n is ink, so a
+    // whole row is matched with one XOR and popcount.
+    uint32_t rows[FONT_GLYPHS][FONT_MAX_H];
+} st7789v_font;
+
 enum st7789v_mode
 {
     ST7789V_CMD,
@@ -94,14 +115,34 @@ struct st7789v_state {
     int32_t remap;
     uint32_t mode;
     uint32_t framebuffer[DPY_ROWS * DPY_COLS];
+    // The same frame as written, in RGB565. Rebuilt from framebuffer on load.
+    uint16_t gram[DPY_ROWS * DPY_COLS];
+
+    // Decoded reference images, keyed by "png|mask".
+    GHashTable *references;
+
+    st7789v_font *fonts[FONT_MAX];
+    uint8_t font_count;
+};
+
+enum {
+    ActScreenshot,
+    ActLoadFont,
+    ActGetText,
+    ActWaitForText,
+    ActCompareToReference,
 };
 
+typedef struct st7789v_reference {
+    uint16_t pixels[DPY_ROWS * DPY_COLS];
+    uint16_t mask[DPY_ROWS * DPY_COLS];   // 0xFFFF where compared, 0 where ignored.
+} st7789v_reference;
+
 #define TYPE_ST7789V "st7789v"
 OBJECT_DECLARE_SIMPLE_TYPE(st7789v_state, ST7789V)
 
-static uint32_t st7789v_transfer(SSISlave *dev, uint32_t data)
+static void st7789v_put_pixel(st7789v_state *s, uint16_t word)
 {
-    st7789v_state *s = ST7789V(dev);
     union color{
         uint32_t full;
         struct{
@@ -111,8 +152,28 @@ static uint32_t st7789v_transfer(SSISlave *dev, uint32_t data)
             uint8_t a;
         };
     } color;
-    color.full = 0;
-    uint16_t word = 0;
+    color.r = (word & 0xF800)>>8;
+    color.g = (word & 0x7E0)>> 3;
+    color.b = (word & 0x1F) << 3;
+    color.a = 0xFF;
+    s->framebuffer[(s->col) + (s->row*DPY_COLS)] = color.full;
+    s->gram[(s->col) + (s->row*DPY_COLS)] = word;
+    s->col++;
+    if (s->col>s->col_end)
+    {
+        s->row++;
+        s->col = s->col_start;
+    }
+    if (s->row>s->row_end)
+    {
+        s->row = s->row_start;
+    }
+    s->redraw = 1;
+}
+
+static uint32_t st7789v_transfer(SSISlave *dev, uint32_t data)
+{
+    st7789v_state *s = ST7789V(dev);
         if (s->mode == ST7789V_CMD) {
             s->cmd = data;
             s->cmd_len=0;
@@ -158,24 +219,8 @@ static uint32_t st7789v_transfer(SSISlave *dev, uint32_t data)
                 DATA(2);
             } else {// One of an unknown number of 16-bit words.    
                 DATA(2);    
-                word = (s->cmd_data[0]<<8|s->cmd_data[1]);
-                color.r = (word & 0xF800)>>8;
-                color.g = (word & 0x7E0)>> 3;
-                color.b = (word & 0x1F) << 3;
-                color.a = 0xFF;
-                s->framebuffer[(s->col) + (s->row*DPY_COLS)] = color.full;
-                s->col++;
-                if (s->col>s->col_end)
-                {
-                    s->row++;
-                    s->col = s->col_start;
-                }
-                if (s->row>s->row_end)
-                {
-                    s->row = s->row_start;
-                }
+                st7789v_put_pixel(s, s->cmd_data[0]<<8|s->cmd_data[1]);
                 s->cmd_len=0; // "remove" the data from the queue. We'll get more,
-                s->redraw = 1;
 
             }
             break;
@@ -190,6 +235,25 @@ static uint32_t st7789v_transfer(SSISlave *dev, uint32_t data)
 
 }
 
+// Pixel data is nearly all of the traffic, so unpack whole RAMWR pairs
+// here and only hand odd bytes and commands to the per-byte path.
+static void st7789v_transfer_block(SSISlave *dev, const uint8_t *tx, uint8_t *rx, size_t len)
+{
+    st7789v_state *s = ST7789V(dev);
+    size_t i = 0;
+    while (i < len) {
+        if (s->mode == ST7789V_DATA && s->cmd == CMD_RAMWR && s->cmd_len == 0 && i + 1 < len) {
+            st7789v_put_pixel(s, tx[i]<<8 | tx[i+1]);
+            i += 2;
+        } else {
+            st7789v_transfer(dev, tx[i++]);
+        }
+    }
+    if (rx) {
+        memset(rx, 0, len);
+    }
+}
+
 static void st7789v_update_display(void *opaque)
 {
     st7789v_state *s = (st7789v_state *)opaque;
@@ -279,16 +343,299 @@ static void st7789v_write_png(st7789v_state *s, const char* file)
     fclose(handle);
 }
 
-static int st7789v_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+// Reads a PNG in the framebuffer's BGRA layout. Caller frees.
+static uint32_t *st7789v_read_png(const char *file, uint32_t *width, uint32_t *height)
 {
-    if (action == 0) {
-        const char* file = scripthost_get_string(args, 0);
-        printf("Saving screenshot to: %s\n",file);
-        st7789v_write_png(ST7789V(obj), file);
-        return ScriptLS_Finished;
+    png_image image = { .version = PNG_IMAGE_VERSION };
+    if (!png_image_begin_read_from_file(&image, file)) {
+        printf("st7789v: could not read %s: %s\n", file, image.message);
+        return NULL;
+    }
+    image.format = PNG_FORMAT_BGRA;
+    uint32_t *buffer = g_new(uint32_t, image.width * image.height);
+    if (!png_image_finish_read(&image, NULL, buffer, 0, NULL)) {
+        printf("st7789v: could not decode %s: %s\n", file, image.message);
+        png_image_free(&image);
+        g_free(buffer);
+        return NULL;
+    }
+    *width = image.width;
+    *height = image.height;
+    return buffer;
+}
+
+static inline int st7789v_luma(uint32_t px)
+{
+    uint32_t r = (px >> 16) & 0xFF, g = (px >> 8) & 0xFF, b = px & 0xFF, a = px >> 24;
+    return (((r * 77 + g * 150 + b * 29) >> 8) * a) / 255;
+}
+
+static inline bool st7789v_is_ink(uint32_t px, int bg_luma)
+{
+    return abs(st7789v_luma(px) - bg_luma) > FONT_INK_THRESHOLD;
+}
+
+static int st7789v_load_font(st7789v_state *s, const char *file, int w, int h)
+{
+    uint32_t aw, ah;
+    if (s->font_count == FONT_MAX || w <= 0 || w > FONT_MAX_W || h <= 0 || h > FONT_MAX_H) {
+        printf("st7789v: fonts are limited to %d of at most %dx%d\n", FONT_MAX, FONT_MAX_W, FONT_MAX_H);
+        return -1;
+    }
+    uint32_t *atlas = st7789v_read_png(file, &aw, &ah);
+    if (!atlas) {
+        return -1;
+    }
+    st7789v_font *f = g_new0(st7789v_font, 1);
+    f->w = w;
+    f->h = h;
+    f->count = MIN((aw / w) , FONT_ATLAS_COLS) * (ah / h);
+    f->count = MIN(f->count, FONT_GLYPHS);
+    if (f->count == 0) {
+        printf("st7789v: %s is smaller than one %dx%d glyph\n", file, w, h);
+        g_free(atlas);
+        g_free(f);
+        return -1;
+    }
+    // The first cell is the space, so its corner is background.
+    int bg = st7789v_luma(atlas[0]);
+    for (int g = 0; g < f->count; g++) {
+        uint32_t x0 = (g % FONT_ATLAS_COLS) * w, y0 = (g / FONT_ATLAS_COLS) * h;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                if (st7789v_is_ink(atlas[(y0 + y) * aw + x0 + x], bg)) {
+                    f->rows[g][y] |= 1U << x;
+                }
+            }
+        }
+    }
+    g_free(atlas);
+    s->fonts[s->font_count] = f;
+    return s->font_count++;
+}
+
+// w bits of a packed ink row starting at bit x.
+static inline uint32_t st7789v_ink_bits(const uint64_t *row, int x, int w)
+{
+    uint64_t bits = row[x >> 6] >> (x & 63);
+    if ((x & 63) + w > 64) {
+        bits |= row[(x >> 6) + 1] << (64 - (x & 63));
+    }
+    return bits & ((1ULL << w) - 1);
+}
+
+// Best glyph for the cell at column x, returns its mismatched pixel count.
+static int st7789v_match_cell(const st7789v_font *f, uint64_t ink[][4], int x, int *glyph)
+{
+    uint32_t cell[FONT_MAX_H];
+    int best = INT_MAX;
+    for (int y = 0; y < f->h; y++) {
+        cell[y] = st7789v_ink_bits(ink[y], x, f->w);
+    }
+    for (int g = 0; g < f->count; g++) {
+        int err = 0;
+        for (int y = 0; y < f->h && err < best; y++) {
+            err += ctpop32(cell[y] ^ f->rows[g][y]);
+        }
+        if (err < best) {
+            best = err;
+            *glyph = g;
+        }
+    }
+    return best;
+}
+
+// Reads one line of monospaced text whose cells start at row y, somewhere
+// within columns x..x+w. The background is taken from the top-left pixel.
+static char *st7789v_get_text(st7789v_state *s, int font, int x0, int y0, int w)
+{
+    if (font < 0 || font >= s->font_count) {
+        return NULL;
+    }
+    const st7789v_font *f = s->fonts[font];
+    if (x0 < 0 || y0 < 0 || w < f->w || x0 + w > DPY_COLS || y0 + f->h > DPY_ROWS) {
+        return NULL;
+    }
+
+    uint64_t ink[FONT_MAX_H][4] = { 0 };
+    int bg = st7789v_luma(s->framebuffer[y0 * DPY_COLS + x0]);
+    for (int y = 0; y < f->h; y++) {
+        const uint32_t *px = &s->framebuffer[(y0 + y) * DPY_COLS + x0];
+        for (int x = 0; x < w; x++) {
+            if (st7789v_is_ink(px[x], bg)) {
+                ink[y][x >> 6] |= 1ULL << (x & 63);
+            }
+        }
+    }
+
+    // Find the cell phase that fits best, then read the line at that pitch.
+    int64_t best_err = -1;
+    int best_cells = 1, best_off = 0, glyph = 0;
+    for (int off = 0; off < f->w && off + f->w <= w; off++) {
+        int cells = (w - off) / f->w;
+        int64_t err = 0;
+        for (int c = 0; c < cells; c++) {
+            err += st7789v_match_cell(f, ink, off + c * f->w, &glyph);
+        }
+        if (best_err < 0 || err * best_cells < best_err * cells) {
+            best_err = err;
+            best_cells = cells;
+            best_off = off;
+        }
+    }
+
+    int tolerance = (f->w * f->h) / 16 + 1;
+    GString *text = g_string_sized_new(best_cells);
+    for (int c = 0; c < best_cells; c++) {
+        int err = st7789v_match_cell(f, ink, best_off + c * f->w, &glyph);
+        g_string_append_c(text, err <= tolerance ? FONT_FIRST_CHAR + glyph : '?');
+    }
+    return g_strstrip(g_string_free(text, false));
+}
+
+static inline uint16_t st7789v_to_rgb565(uint32_t px)
+{
+    return ((px >> 8) & 0xF800) | ((px >> 5) & 0x7E0) | ((px >> 3) & 0x1F);
+}
+
+static st7789v_reference *st7789v_get_reference(st7789v_state *s, const char *png, const char *mask)
+{
+    g_autofree gchar *key = g_strdup_printf("%s|%s", png, mask);
+    st7789v_reference *ref = g_hash_table_lookup(s->references, key);
+    uint32_t w, h;
+    if (ref) {
+        return ref;
+    }
+
+    g_autofree uint32_t *image = st7789v_read_png(png, &w, &h);
+    if (!image) {
+        return NULL;
+    }
+    if (w != DPY_COLS || h != DPY_ROWS) {
+        printf("st7789v: reference %s is not %dx%d\n", png, DPY_COLS, DPY_ROWS);
+        return NULL;
+    }
+    g_autofree uint32_t *mask_image = NULL;
+    if (*mask) {
+        mask_image = st7789v_read_png(mask, &w, &h);
+        if (!mask_image) {
+            return NULL;
+        }
+        if (w != DPY_COLS || h != DPY_ROWS) {
+            printf("st7789v: mask %s is not %dx%d\n", mask, DPY_COLS, DPY_ROWS);
+            return NULL;
+        }
+    }
+
+    ref = g_new(st7789v_reference, 1);
+    for (int i = 0; i < DPY_ROWS * DPY_COLS; i++) {
+        ref->pixels[i] = st7789v_to_rgb565(image[i]);
+        // Black (or transparent) mask pixels are left out of the comparison.
+        ref->mask[i] = (!mask_image || st7789v_luma(mask_image[i]) >= 128) ? 0xFFFF : 0;
+    }
+    g_hash_table_insert(s->references, g_steal_pointer(&key), ref);
+    return ref;
+}
+
+static inline bool st7789v_pixel_within(uint16_t a, uint16_t b, int tol_rb, int tol_g)
+{
+    return abs((a >> 11) - (b >> 11)) <= tol_rb &&
+        abs(((a >> 5) & 0x3F) - ((b >> 5) & 0x3F)) <= tol_g &&
+        abs((a & 0x1F) - (b & 0x1F)) <= tol_rb;
+}
+
+// Counts pixels that differ from the reference by more than tolerance (per
+// channel, on a 0-255 scale) and reports their bounding box.
+static void st7789v_compare(st7789v_state *s, const st7789v_reference *ref, int tolerance)
+{
+    int tol_rb = tolerance >> 3, tol_g = tolerance >> 2;
+    int count = 0;
+    int x0 = DPY_COLS, y0 = DPY_ROWS, x1 = -1, y1 = -1;
+
+    // Four pixels per word; identical or fully masked runs (nearly all of a
+    // matching frame) cost one XOR/AND each.
+    QEMU_BUILD_BUG_ON((DPY_ROWS * DPY_COLS) % 4);
+    for (int i = 0; i < DPY_ROWS * DPY_COLS; i += 4) {
+        uint64_t live, want, mask;
+        memcpy(&live, &s->gram[i], sizeof(live));
+        memcpy(&want, &ref->pixels[i], sizeof(want));
+        memcpy(&mask, &ref->mask[i], sizeof(mask));
+        if (!((live ^ want) & mask)) {
+            continue;
+        }
+        for (int j = i; j < i + 4; j++) {
+            if (!ref->mask[j] || st7789v_pixel_within(s->gram[j], ref->pixels[j], tol_rb, tol_g)) {
+                continue;
+            }
+            int x = j % DPY_COLS, y = j / DPY_COLS;
+            count++;
+            x0 = MIN(x0, x);
+            x1 = MAX(x1, x);
+            y0 = MIN(y0, y);
+            y1 = MAX(y1, y);
+        }
+    }
+
+    if (count) {
+        g_autofree gchar *result = g_strdup_printf("%d mismatched, box %d,%d-%d,%d", count, x0, y0, x1, y1);
+        script_print_string(result);
     } else {
-        return ScriptLS_Unhandled;
+        script_print_string("0 mismatched");
+    }
+}
+
+static int st7789v_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+{
+    st7789v_state *s = ST7789V(obj);
+    switch (action)
+    {
+        case ActScreenshot:
+        {
+            const char* file = scripthost_get_string(args, 0);
+            printf("Saving screenshot to: %s\n",file);
+            st7789v_write_png(s, file);
+            break;
+        }
+        case ActLoadFont:
+        {
+            int font = st7789v_load_font(s, scripthost_get_string(args, 0),
+                scripthost_get_int(args, 1), scripthost_get_int(args, 2));
+            if (font < 0) {
+                return ScriptLS_Error;
+            }
+            script_print_int(font);
+            break;
+        }
+        case ActGetText:
+        case ActWaitForText:
+        {
+            g_autofree char *text = st7789v_get_text(s, scripthost_get_int(args, 0),
+                scripthost_get_int(args, 1), scripthost_get_int(args, 2), scripthost_get_int(args, 3));
+            if (!text) {
+                printf("st7789v: no such font, or the region is off screen\n");
+                return ScriptLS_Error;
+            }
+            if (action == ActGetText) {
+                script_print_string(text);
+            } else if (!strstr(text, scripthost_get_string(args, 4))) {
+                return ScriptLS_Waiting;
+            }
+            break;
+        }
+        case ActCompareToReference:
+        {
+            st7789v_reference *ref = st7789v_get_reference(s, scripthost_get_string(args, 0),
+                scripthost_get_string(args, 1));
+            if (!ref) {
+                return ScriptLS_Error;
+            }
+            st7789v_compare(s, ref, MAX(scripthost_get_int(args, 2), 0));
+            break;
+        }
+        default:
+            return ScriptLS_Unhandled;
     }
+    return ScriptLS_Finished;
 }
 
 static const GraphicHwOps st7789v_ops = {
@@ -300,12 +647,19 @@ OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(st7789v_state, st7789v, ST7789V, SSI_S
 
 static void st7789v_finalize(Object *obj)
 {
+    st7789v_state *s = ST7789V(obj);
+    for (int i = 0; i < s->font_count; i++) {
+        g_free(s->fonts[i]);
+    }
+    g_hash_table_destroy(s->references);
     printf("Disp_finalize\n");
 }
 
 
 static void st7789v_init(Object *obj)
 {
+    st7789v_state *s = ST7789V(obj);
+    s->references = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 }
 
 
@@ -323,13 +677,36 @@ static void st7789v_realize(SSISlave *d, Error **errp)
 
     script_handle pScript = script_instance_new(P404_SCRIPTABLE(s), TYPE_ST7789V);
 
-    script_register_action(pScript, "Screenshot", "Takes a screenshot to the specified file.", 0);
-    script_add_arg_string(pScript, 0);
+    script_register_action(pScript, "Screenshot", "Takes a screenshot to the specified file.", ActScreenshot);
+    script_add_arg_string(pScript, ActScreenshot);
+    script_register_action(pScript, "LoadFont", "Loads a glyph atlas PNG with the given glyph width and height, and reports its font index.", ActLoadFont);
+    script_add_arg_string(pScript, ActLoadFont);
+    script_add_arg_int(pScript, ActLoadFont);
+    script_add_arg_int(pScript, ActLoadFont);
+    script_register_action(pScript, "GetText", "Reads a line of text (font, x, y, width) from the screen.", ActGetText);
+    script_add_arg_int(pScript, ActGetText);
+    script_add_arg_int(pScript, ActGetText);
+    script_add_arg_int(pScript, ActGetText);
+    script_add_arg_int(pScript, ActGetText);
+    script_register_action(pScript, "WaitForText", "Waits for a line of text (font, x, y, width) to contain the given string.", ActWaitForText);
+    script_add_arg_int(pScript, ActWaitForText);
+    script_add_arg_int(pScript, ActWaitForText);
+    script_add_arg_int(pScript, ActWaitForText);
+    script_add_arg_int(pScript, ActWaitForText);
+    script_add_arg_string(pScript, ActWaitForText);
+    script_register_action(pScript, "CompareToReference", "Compares the screen to a reference PNG, ignoring black areas of the mask PNG (\"\" for none), with a per-channel tolerance of 0-255.", ActCompareToReference);
+    script_add_arg_string(pScript, ActCompareToReference);
+    script_add_arg_string(pScript, ActCompareToReference);
+    script_add_arg_int(pScript, ActCompareToReference);
     scripthost_register_scriptable(pScript);
 
 }
 
 static int st7789v_post_load(void *opaque, int version) {
+    st7789v_state *s = ST7789V(opaque);
+    for (int i = 0; i < DPY_ROWS * DPY_COLS; i++) {
+        s->gram[i] = st7789v_to_rgb565(s->framebuffer[i]);
+    }
     st7789v_invalidate_display(opaque);
     return 0;
 }
@@ -370,5 +747,6 @@ static void st7789v_class_init(ObjectClass *klass, void *data)
 
     k->realize = st7789v_realize;
     k->transfer = st7789v_transfer;
+    k->transfer_block = st7789v_transfer_block;
     k->cs_polarity = SSI_CS_LOW;
 }
@@ -0,0 +1,495 @@
+/*
+    telemetry.c - Samples named firmware variables straight out of guest
+	RAM at a fixed virtual-time rate and logs them as a compact time series.
+
+	Variables are looked up by name in the firmware ELF's symbol table.
+	Besides plain symbol names, dotted C++ names such as
+	planner.block_buffer_head are matched against the nested (_ZN...E)
+	object symbols, case-insensitively, and failing that against the static
+	member of that name in any class, so thermalManager.temp_hotend finds
+	Temperature::temp_hotend. Each entry is name[+offset][:size], size being
+	1, 2, 4 or 8 bytes; it defaults to the symbol's own size where that fits.
+
+	The variables' host pointers are resolved once, so a sample is only a
+	handful of loads and nothing goes through the debugger or the memory API.
+
+	Copyright 2021 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of Mini404.
+
+	Mini404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Mini404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Mini404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/units.h"
+#include "qemu/timer.h"
+#include "hw/qdev-properties.h"
+#include "hw/sysbus.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
+#include "migration/vmstate.h"
+#include "sysemu/sysemu.h"
+#include "elf.h"
+#include "../utility/p404scriptable.h"
+#include "../utility/macros.h"
+#include "../utility/ScriptHost_C.h"
+
+#define TYPE_TELEMETRY "telemetry"
+OBJECT_DECLARE_SIMPLE_TYPE(TelemetryState, TELEMETRY)
+
+// Binary log: this magic, a little-endian uint64 sample period in ns and a
+// uint32 variable count, then per variable a uint32 address, a uint8 size,
+// a uint8 name length and the name. Records follow, one per sample in which
+// something changed: a varint number of periods since the previous record
+// (0 means an absolute period number follows, as in the first record and
+// whenever virtual time went backwards), a bitmap of the variables that
+// changed, and a zigzag varint delta for each of them, in order.
+#define TELEMETRY_MAGIC "P404TS\0\1"
+
+// Log bytes held before they go out to the file.
+#define TELEMETRY_BUFFER (64 * KiB)
+
+typedef struct TelemetryVar {
+    char *name;
+    uint32_t addr;
+    uint8_t size;
+    const uint8_t *host;
+    uint64_t last, cur;
+} TelemetryVar;
+
+struct TelemetryState {
+    SysBusDevice parent;
+
+    TelemetryVar *vars;
+    unsigned var_count;
+    uint8_t *changed;
+
+    int64_t last_period;
+    GByteArray *buf;
+    FILE *out;
+    Notifier exit;
+
+    QEMUTimer *sample;
+
+    char *elf;
+    char *spec;
+    char *file;
+    uint32_t period_us;
+};
+
+enum {
+    ActFlush,
+};
+
+OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(TelemetryState, telemetry, TELEMETRY, SYS_BUS_DEVICE, {TYPE_P404_SCRIPTABLE}, {NULL})
+
+static void telemetry_put_varint(GByteArray *b, uint64_t v)
+{
+    uint8_t c;
+    while (v >= 0x80) {
+        c = (v & 0x7F) | 0x80;
+        g_byte_array_append(b, &c, 1);
+        v >>= 7;
+    }
+    c = v;
+    g_byte_array_append(b, &c, 1);
+}
+
+static uint64_t telemetry_load(const TelemetryVar *v)
+{
+    switch (v->size) {
+        case 1:
+            return ldub_p(v->host);
+        case 2:
+            return lduw_le_p(v->host);
+        case 4:
+            return (uint32_t)ldl_le_p(v->host);
+        default:
+            return ldq_le_p(v->host);
+    }
+}
+
+static void telemetry_flush(TelemetryState *s)
+{
+    if (s->out && s->buf->len) {
+        fwrite(s->buf->data, 1, s->buf->len, s->out);
+        fflush(s->out);
+    }
+    g_byte_array_set_size(s->buf, 0);
+}
+
+static void telemetry_sample(void *opaque)
+{
+    TelemetryState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t period_ns = s->period_us * SCALE_US;
+    int64_t period = now / period_ns;
+    unsigned bitmap_len = (s->var_count + 7) / 8;
+    bool any = false;
+
+    memset(s->changed, 0, bitmap_len);
+    for (unsigned i = 0; i < s->var_count; i++) {
+        TelemetryVar *v = &s->vars[i];
+        v->cur = telemetry_load(v);
+        if (v->cur != v->last || s->last_period < 0) {
+            s->changed[i / 8] |= 1 << (i % 8);
+            any = true;
+        }
+    }
+
+    if (any) {
+        if (s->last_period < 0 || period <= s->last_period) {
+            telemetry_put_varint(s->buf, 0);
+            telemetry_put_varint(s->buf, period);
+        } else {
+            telemetry_put_varint(s->buf, period - s->last_period);
+        }
+        g_byte_array_append(s->buf, s->changed, bitmap_len);
+        for (unsigned i = 0; i < s->var_count; i++) {
+            TelemetryVar *v = &s->vars[i];
+            if (s->changed[i / 8] & (1 << (i % 8))) {
+                int64_t d = v->cur - v->last;
+                telemetry_put_varint(s->buf, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+                v->last = v->cur;
+            }
+        }
+        s->last_period = period;
+        if (s->buf->len >= TELEMETRY_BUFFER) {
+            telemetry_flush(s);
+        }
+    }
+
+    timer_mod(s->sample, (period + 1) * period_ns);
+}
+
+static void telemetry_exit_notify(Notifier *n, void *data)
+{
+    TelemetryState *s = container_of(n, TelemetryState, exit);
+    telemetry_flush(s);
+    if (s->out) {
+        fclose(s->out);
+        s->out = NULL;
+    }
+}
+
+static int telemetry_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+{
+    TelemetryState *s = TELEMETRY(obj);
+    switch (action)
+    {
+        case ActFlush:
+            telemetry_flush(s);
+            break;
+        default:
+            return ScriptLS_Unhandled;
+    }
+    return ScriptLS_Finished;
+}
+
+// Splits an Itanium nested name (_ZN<len><id>...E) into its components.
+// Anything fancier (templates, substitutions, functions) is not a variable
+// we can name from the command line, so it is rejected.
+static bool telemetry_demangle_nested(const char *sym, GPtrArray *parts)
+{
+    if (strncmp(sym, "_ZN", 3)) {
+        return false;
+    }
+    sym += 3;
+    while (*sym != 'E') {
+        char *end;
+        unsigned long len = strtoul(sym, &end, 10);
+        if (end == sym || len == 0 || strnlen(end, len) < len) {
+            return false;
+        }
+        g_ptr_array_add(parts, g_strndup(end, len));
+        sym = end + len;
+    }
+    return sym[1] == '\0' && parts->len >= 2;
+}
+
+static bool telemetry_parts_match(GPtrArray *a, gchar **b, unsigned b_len)
+{
+    if (a->len != b_len) {
+        return false;
+    }
+    for (unsigned i = 0; i < b_len; i++) {
+        if (g_ascii_strcasecmp(g_ptr_array_index(a, i), b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finds name among the object symbols; see the top of the file for the rules.
+static const Elf32_Sym *telemetry_find_symbol(const Elf32_Sym *syms, unsigned nsyms,
+                                              const char *strtab, size_t strtab_size,
+                                              const char *name, Error **errp)
+{
+    g_autofree gchar *dotted = g_strdup(name);
+    const Elf32_Sym *exact = NULL, *nested = NULL, *member = NULL;
+    unsigned members = 0;
+
+    // Accept both planner.block_buffer_head and Planner::block_buffer_head.
+    for (char *p = dotted; (p = strstr(p, "::")); ) {
+        *p = '.';
+        memmove(p + 1, p + 2, strlen(p + 2) + 1);
+    }
+    g_auto(GStrv) want = g_strsplit(dotted, ".", -1);
+    unsigned want_len = g_strv_length(want);
+
+    for (unsigned i = 0; i < nsyms; i++) {
+        const Elf32_Sym *sym = &syms[i];
+        uint32_t off = le32_to_cpu(sym->st_name);
+        if (ELF_ST_TYPE(sym->st_info) != STT_OBJECT || off >= strtab_size) {
+            continue;
+        }
+        const char *sname = strtab + off;
+        if (!strcmp(sname, name)) {
+            exact = sym;
+            break;
+        }
+        if (want_len < 2) {
+            continue;
+        }
+        g_autoptr(GPtrArray) parts = g_ptr_array_new_with_free_func(g_free);
+        if (!telemetry_demangle_nested(sname, parts)) {
+            continue;
+        }
+        if (telemetry_parts_match(parts, want, want_len)) {
+            nested = sym;
+        } else if (!strcmp(g_ptr_array_index(parts, parts->len - 1), want[want_len - 1])) {
+            member = sym;
+            members++;
+        }
+    }
+
+    if (exact || nested) {
+        return exact ? exact : nested;
+    }
+    if (members == 1) {
+        return member;
+    }
+    if (members > 1) {
+        error_setg(errp, "telemetry: %s is ambiguous, qualify it with its class", name);
+    } else {
+        error_setg(errp, "telemetry: no variable named %s", name);
+    }
+    return NULL;
+}
+
+static bool telemetry_resolve(TelemetryState *s, Error **errp)
+{
+    g_autofree gchar *data = NULL;
+    gsize len;
+    GError *gerr = NULL;
+
+    if (!g_file_get_contents(s->elf, &data, &len, &gerr)) {
+        error_setg(errp, "telemetry: %s", gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+
+    const Elf32_Ehdr *eh = (const Elf32_Ehdr *)data;
+    if (len < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+        eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_ident[EI_DATA] != ELFDATA2LSB) {
+        error_setg(errp, "telemetry: %s is not a 32-bit little-endian ELF", s->elf);
+        return false;
+    }
+    uint32_t shoff = le32_to_cpu(eh->e_shoff);
+    uint16_t shnum = le16_to_cpu(eh->e_shnum);
+    if (shoff > len || shnum > (len - shoff) / sizeof(Elf32_Shdr)) {
+        error_setg(errp, "telemetry: %s has a truncated section table", s->elf);
+        return false;
+    }
+    const Elf32_Shdr *sh = (const Elf32_Shdr *)(data + shoff);
+    const Elf32_Shdr *symtab = NULL;
+    for (unsigned i = 0; i < shnum; i++) {
+        if (le32_to_cpu(sh[i].sh_type) == SHT_SYMTAB) {
+            symtab = &sh[i];
+            break;
+        }
+    }
+    if (!symtab || le32_to_cpu(symtab->sh_link) >= shnum) {
+        error_setg(errp, "telemetry: %s has no symbol table", s->elf);
+        return false;
+    }
+    const Elf32_Shdr *strsh = &sh[le32_to_cpu(symtab->sh_link)];
+    uint32_t sym_off = le32_to_cpu(symtab->sh_offset), sym_size = le32_to_cpu(symtab->sh_size);
+    uint32_t str_off = le32_to_cpu(strsh->sh_offset), str_size = le32_to_cpu(strsh->sh_size);
+    if (sym_off > len || sym_size > len - sym_off || str_off > len ||
+        str_size > len - str_off || !str_size || data[str_off + str_size - 1]) {
+        error_setg(errp, "telemetry: %s has a truncated symbol table", s->elf);
+        return false;
+    }
+    const Elf32_Sym *syms = (const Elf32_Sym *)(data + sym_off);
+    unsigned nsyms = sym_size / sizeof(Elf32_Sym);
+
+    g_auto(GStrv) entries = g_strsplit(s->spec, ";", -1);
+    s->var_count = g_strv_length(entries);
+    s->vars = g_new0(TelemetryVar, s->var_count);
+
+    for (unsigned i = 0; i < s->var_count; i++) {
+        TelemetryVar *v = &s->vars[i];
+        char *entry = g_strstrip(entries[i]);
+        unsigned long offset = 0, size = 0;
+        char *p;
+
+        if ((p = strchr(entry, ':'))) {
+            *p++ = '\0';
+            size = strtoul(p, NULL, 0);
+            if (size != 1 && size != 2 && size != 4 && size != 8) {
+                error_setg(errp, "telemetry: %s: size must be 1, 2, 4 or 8", entry);
+                return false;
+            }
+        }
+        if ((p = strchr(entry, '+'))) {
+            *p++ = '\0';
+            offset = strtoul(p, NULL, 0);
+        }
+
+        const Elf32_Sym *sym = telemetry_find_symbol(syms, nsyms, data + str_off, str_size, entry, errp);
+        if (!sym) {
+            return false;
+        }
+        uint32_t sym_len = le32_to_cpu(sym->st_size);
+        if (!size) {
+            uint32_t left = sym_len > offset ? sym_len - offset : 0;
+            size = left == 8 ? 8 : left >= 4 ? 4 : left >= 2 ? 2 : 1;
+        }
+
+        v->name = g_strdup(entry);
+        v->addr = le32_to_cpu(sym->st_value) + offset;
+        v->size = size;
+
+        MemoryRegionSection sec = memory_region_find(get_system_memory(), v->addr, v->size);
+        if (!sec.mr || !memory_region_is_ram(sec.mr) ||
+            int128_get64(sec.size) < v->size) {
+            if (sec.mr) {
+                memory_region_unref(sec.mr);
+            }
+            error_setg(errp, "telemetry: %s at 0x%08x is not in RAM", v->name, v->addr);
+            return false;
+        }
+        // Keeps the reference: the region lives as long as the machine.
+        v->host = (uint8_t *)memory_region_get_ram_ptr(sec.mr) + sec.offset_within_region;
+    }
+    return true;
+}
+
+static void telemetry_realize(DeviceState *dev, Error **errp)
+{
+    TelemetryState *s = TELEMETRY(dev);
+
+    if (!s->elf || !s->spec || !s->file) {
+        error_setg(errp, "telemetry: elf, vars and file are required");
+        return;
+    }
+    if (!s->period_us) {
+        error_setg(errp, "telemetry: period-us must be non-zero");
+        return;
+    }
+    if (!telemetry_resolve(s, errp)) {
+        return;
+    }
+
+    s->out = fopen(s->file, "wb");
+    if (!s->out) {
+        error_setg_errno(errp, errno, "telemetry: could not create %s", s->file);
+        return;
+    }
+    s->buf = g_byte_array_sized_new(TELEMETRY_BUFFER);
+    s->changed = g_malloc0((s->var_count + 7) / 8);
+
+    g_byte_array_append(s->buf, (const uint8_t *)TELEMETRY_MAGIC, 8);
+    uint64_t period_ns = cpu_to_le64(s->period_us * SCALE_US);
+    uint32_t count = cpu_to_le32(s->var_count);
+    g_byte_array_append(s->buf, (uint8_t *)&period_ns, sizeof(period_ns));
+    g_byte_array_append(s->buf, (uint8_t *)&count, sizeof(count));
+    for (unsigned i = 0; i < s->var_count; i++) {
+        TelemetryVar *v = &s->vars[i];
+        uint32_t addr = cpu_to_le32(v->addr);
+        uint8_t name_len = MIN(strlen(v->name), UINT8_MAX);
+        g_byte_array_append(s->buf, (uint8_t *)&addr, sizeof(addr));
+        g_byte_array_append(s->buf, &v->size, 1);
+        g_byte_array_append(s->buf, &name_len, 1);
+        g_byte_array_append(s->buf, (const uint8_t *)v->name, name_len);
+    }
+    s->last_period = -1;
+
+    s->exit.notify = telemetry_exit_notify;
+    qemu_add_exit_notifier(&s->exit);
+}
+
+static void telemetry_reset(DeviceState *dev)
+{
+    TelemetryState *s = TELEMETRY(dev);
+    timer_mod(s->sample, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+static void telemetry_finalize(Object *obj)
+{
+    TelemetryState *s = TELEMETRY(obj);
+    for (unsigned i = 0; i < s->var_count; i++) {
+        g_free(s->vars[i].name);
+    }
+    g_free(s->vars);
+    g_free(s->changed);
+    if (s->buf) {
+        g_byte_array_free(s->buf, true);
+    }
+}
+
+static void telemetry_init(Object *obj)
+{
+    TelemetryState *s = TELEMETRY(obj);
+    s->sample = timer_new_ns(QEMU_CLOCK_VIRTUAL, telemetry_sample, s);
+
+    script_handle pScript = script_instance_new(P404_SCRIPTABLE(obj), "Telemetry");
+    script_register_action(pScript, "Flush", "Writes out the buffered telemetry samples", ActFlush);
+    scripthost_register_scriptable(pScript);
+}
+
+// Only the sampling timer: the log is a record of what happened, so the
+// values it deltas against stay as they are across a restore.
+static const VMStateDescription vmstate_telemetry = {
+    .name = TYPE_TELEMETRY,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_TIMER_PTR(sample, TelemetryState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property telemetry_properties[] = {
+    DEFINE_PROP_STRING("elf", TelemetryState, elf),
+    DEFINE_PROP_STRING("vars", TelemetryState, spec),
+    DEFINE_PROP_STRING("file", TelemetryState, file),
+    DEFINE_PROP_UINT32("period-us", TelemetryState, period_us, 10000),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void telemetry_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = telemetry_realize;
+    dc->reset = telemetry_reset;
+    dc->vmsd = &vmstate_telemetry;
+    device_class_set_props(dc, telemetry_properties);
+
+    P404ScriptIFClass *sc = P404_SCRIPTABLE_CLASS(klass);
+    sc->ScriptHandler = telemetry_process_action;
+}
@@ -17,6 +17,7 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "hw/irq.h"
 #include "hw/ssi/ssi.h"
 #include "qemu/timer.h"
@@ -46,6 +47,66 @@ do { fprintf(stderr, "tmc2209: error: " fmt , ## __VA_ARGS__);} while (0)
 #endif
 
 #define TMC2209_CMD_LEN 8
+#define TMC2209_READ_LEN 4
+#define TMC2209_SYNC 0x05
+
+// Microstep resolution (as a 1/256 increment) used until the firmware sets
+// GCONF.mstep_reg_select. MS1/MS2 double as the UART address on Buddy.
+#define TMC2209_PIN_MS_INCREMENT 16
+
+// Register access types.
+#define TMC2209_ACC_NONE 0x0
+#define TMC2209_ACC_R    0x1
+#define TMC2209_ACC_W    0x2
+#define TMC2209_ACC_RW   (TMC2209_ACC_R | TMC2209_ACC_W)
+#define TMC2209_ACC_RC   (TMC2209_ACC_RW | 0x4) // Write 1 to clear
+
+// The register map: name, address, access, implemented bits, reset value.
+// Anything not listed is unimplemented, reads back 0 and ignores writes.
+#define TMC2209_REGISTERS(X) \
+    X(GCONF,        0x00, RW, 0x000003FF, 0x00000101) \
+    X(GSTAT,        0x01, RC, 0x00000007, 0x00000001) \
+    X(IFCNT,        0x02, R,  0x000000FF, 0x00000000) \
+    X(SLAVECONF,    0x03, W,  0x00000F00, 0x00000000) \
+    X(OTP_PROG,     0x04, W,  0x0000FF37, 0x00000000) \
+    X(OTP_READ,     0x05, R,  0x00FFFFFF, 0x00000000) \
+    X(IOIN,         0x06, R,  0xFF0003FF, 0x21000040) \
+    X(FACTORY_CONF, 0x07, RW, 0x0000031F, 0x0000000F) \
+    X(IHOLD_IRUN,   0x10, W,  0x000F1F1F, 0x00011F10) \
+    X(TPOWERDOWN,   0x11, W,  0x000000FF, 0x00000014) \
+    X(TSTEP,        0x12, R,  0x000FFFFF, 0x000FFFFF) \
+    X(TPWMTHRS,     0x13, W,  0x000FFFFF, 0x00000000) \
+    X(TCOOLTHRS,    0x14, W,  0x000FFFFF, 0x00000000) \
+    X(VACTUAL,      0x22, W,  0x00FFFFFF, 0x00000000) \
+    X(SGTHRS,       0x40, W,  0x000000FF, 0x00000000) \
+    X(SG_RESULT,    0x41, R,  0x000003FF, 0x00000000) \
+    X(COOLCONF,     0x42, W,  0x0000EF6F, 0x00000000) \
+    X(MSCNT,        0x6A, R,  0x000003FF, 0x00000000) \
+    X(MSCURACT,     0x6B, R,  0x01FF01FF, 0x00F70000) \
+    X(CHOPCONF,     0x6C, RW, 0xFF0387FF, 0x10000053) \
+    X(DRV_STATUS,   0x6F, R,  0xC01F0FFF, 0x80000000) \
+    X(PWMCONF,      0x70, RW, 0xFF3FFFFF, 0xC10D0024) \
+    X(PWM_SCALE,    0x71, R,  0x01FF00FF, 0x00000000) \
+    X(PWM_AUTO,     0x72, R,  0x00FF00FF, 0x00000000)
+
+typedef struct {
+    uint8_t access;
+    uint32_t mask;
+    uint32_t reset;
+} tmc2209_reg_info_t;
+
+#define TMC2209_REG_INFO(name, addr, acc, msk, rst) \
+    [addr] = { .access = TMC2209_ACC_##acc, .mask = msk, .reset = rst },
+
+// Indexed by register address, so a datagram needs a single lookup.
+static const tmc2209_reg_info_t tmc2209_reg_info[128] = {
+    TMC2209_REGISTERS(TMC2209_REG_INFO)
+};
+
+#define TMC2209_REG_ADDR(name, addr, ...) TMC2209_##name = addr,
+enum {
+    TMC2209_REGISTERS(TMC2209_REG_ADDR)
+};
 
 // the internal programming registers.
 typedef union 
@@ -78,7 +139,54 @@ typedef union
             uint32_t ifcnt :8;
             uint32_t :24; // unused
         }  __attribute__ ((__packed__)) IFCNT; // 0x02
-        uint32_t _unimplemented[61]; //0x03 - 0x6B
+        uint32_t SLAVECONF; // 0x03
+        uint32_t OTP_PROG; // 0x04
+        uint32_t OTP_READ; // 0x05
+        struct // 0x06
+        {
+            uint32_t enn        :1;
+            uint32_t            :1;
+            uint32_t ms1        :1;
+            uint32_t ms2        :1;
+            uint32_t diag       :1;
+            uint32_t            :1;
+            uint32_t pdn_uart   :1;
+            uint32_t step       :1;
+            uint32_t spread_en  :1;
+            uint32_t dir        :1;
+            uint32_t            :14;
+            uint32_t version    :8;
+        } __attribute__((__packed__)) IOIN; // 0x06
+        uint32_t FACTORY_CONF; // 0x07
+        uint32_t _unimplemented[8]; //0x08 - 0x0F
+        struct // 0x10
+        {
+            uint32_t ihold      :5;
+            uint32_t            :3;
+            uint32_t irun       :5;
+            uint32_t            :3;
+            uint32_t iholddelay :4;
+            uint32_t            :12;
+        } __attribute__((__packed__)) IHOLD_IRUN; // 0x10
+        uint32_t TPOWERDOWN; // 0x11
+        struct // 0x12
+        {
+            uint32_t tstep      :20;
+            uint32_t            :12;
+        } __attribute__((__packed__)) TSTEP; // 0x12
+        struct // 0x13
+        {
+            uint32_t tpwmthrs   :20;
+            uint32_t            :12;
+        } __attribute__((__packed__)) TPWMTHRS; // 0x13
+        struct // 0x14
+        {
+            uint32_t tcoolthrs  :20;
+            uint32_t            :12;
+        } __attribute__((__packed__)) TCOOLTHRS; // 0x14
+        uint32_t _unimplemented1[13]; //0x15 - 0x21
+        uint32_t VACTUAL; // 0x22
+        uint32_t _unimplemented1b[29]; //0x23 - 0x3F
         struct // 0x40
         {
             uint32_t sgthrs :8;
@@ -89,7 +197,20 @@ typedef union
             uint32_t sg_result :10;
             uint32_t :22;
         } __attribute__((__packed__)) SG_RESULT; // 0x41
-        uint32_t _unimplemented2a[42]; //0x03 - 0x6B
+        uint32_t COOLCONF; // 0x42
+        uint32_t _unimplemented2a[39]; //0x43 - 0x69
+        struct // 0x6A
+        {
+            uint32_t mscnt      :10;
+            uint32_t            :22;
+        } __attribute__((__packed__)) MSCNT; // 0x6A
+        struct // 0x6B
+        {
+            uint32_t cur_a      :9;
+            uint32_t            :7;
+            uint32_t cur_b      :9;
+            uint32_t            :7;
+        } __attribute__((__packed__)) MSCURACT; // 0x6B
         struct                        //0x6C
         {
             uint32_t toff		:4;
@@ -126,9 +247,19 @@ typedef union
             uint8_t stealth     :1;
             uint8_t stst        :1;
         }  __attribute__ ((__packed__)) DRV_STATUS;
+        uint32_t PWMCONF; // 0x70
+        uint32_t PWM_SCALE; // 0x71
+        uint32_t PWM_AUTO; // 0x72
+        uint32_t _unimplemented3[13]; //0x73 - 0x7F
     }defs;
 } tmc2209_registers_t;
 
+// Keep the named fields and the register table in step.
+#define TMC2209_REG_CHECK(name, addr, ...) \
+    QEMU_BUILD_BUG_ON(offsetof(tmc2209_registers_t, defs.name) != (addr) * 4);
+TMC2209_REGISTERS(TMC2209_REG_CHECK)
+QEMU_BUILD_BUG_ON(sizeof(tmc2209_registers_t) != 128 * 4);
+
 
 struct tmc2209_state {
 
@@ -157,6 +288,10 @@ struct tmc2209_state {
 
     float current_position; // Current position, in mm.
 
+    int64_t last_step_ns;   // For the step interval StallGuard is derived from.
+    uint16_t sg_load;       // Mechanical load on the axis, 0-1023.
+    int64_t burst_interval_ns; // Pulse spacing for tmc2209-step-burst.
+
     tmc2209_registers_t regs; // The programming registers. 
 
     qemu_irq irq_diag;
@@ -169,9 +304,15 @@ struct tmc2209_state {
 };
 
 enum {
-    ActGetPosFloat
+    ActGetPosFloat,
+    ActSetLoad,
+    ActGetSG,
+    ActStepBurst,
 };
 
+// SG_RESULT is 9 significant bits on the 2209.
+#define TMC2209_SG_MAX 510
+
 #define TYPE_TMC2209 "tmc2209"
 OBJECT_DECLARE_SIMPLE_TYPE(tmc2209_state, TMC2209)
 
@@ -222,19 +363,16 @@ static float tmc2209_step_to_pos(int32_t step, uint32_t max_steps_per_mm)
 // 	}
 // }
 
-static int tmc2209_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+// StallGuard estimate for one microstep taken tstep_us after the previous one.
+// The unloaded reading grows with the motor's full-step velocity (it is
+// meaningless when crawling), so the interval is scaled up by the microstep
+// resolution first. The load eats into it less the more run current there is.
+static uint16_t tmc2209_stallguard(tmc2209_state *s, int64_t tstep_us)
 {
-    tmc2209_state *s = TMC2209(obj);
-    switch (action)
-    {
-        case ActGetPosFloat:
-            script_print_float(s->current_position);
-            break;
-        default:
-            return ScriptLS_Unhandled;
-
-    }
-    return ScriptLS_Finished;
+    int64_t fullstep_us = tstep_us * (256 / s->ms_increment);
+    int32_t sg_free = TMC2209_SG_MAX - MIN(fullstep_us >> 6, TMC2209_SG_MAX);
+    int32_t load = (s->sg_load * 32) / (s->regs.defs.IHOLD_IRUN.irun + 1);
+    return MAX(sg_free - load, 0);
 }
 
 // Fired on standstill. set the STST flag and clear DIAG
@@ -242,31 +380,23 @@ static void tmc2209_standstill_timer(void *opaque)
 {
     tmc2209_state *s = opaque;
     s->regs.defs.DRV_STATUS.stst = 1;
+    s->regs.defs.TSTEP.tstep = 0xFFFFF;
     qemu_set_irq(s->irq_diag,0);
     s->regs.defs.SG_RESULT.sg_result = 0;
 }
 
-static void tmc2209_step(void *opaque, int n, int value) {
-    
-    tmc2209_state *s = opaque;
-    if (!s->enabled) return;
-	if (!s->regs.defs.CHOPCONF.dedge)
-	{
-		// In normal mode only step on rising pulse
-		if (!value) return;
-	}
-	else
-	{
-		// With DEDGE step on each value change
-		if (value == s->last_step) return;
-	}
+// Moves count microsteps in the current direction, the last one now and
+// the others interval_ns apart before it.
+static void tmc2209_move(tmc2209_state *s, uint32_t count, int64_t interval_ns)
+{
+    int64_t delta = (int64_t)count * s->ms_increment;
     if (s->dir)
 	{
-        s->current_step-=s->ms_increment;
+        s->current_step-=delta;
 	}
     else
 	{
-        s->current_step+=s->ms_increment;
+        s->current_step+=delta;
 	}
     bool bStall = false;
     if (s->max_step != 0 )// If max_step ==0 it means endstopless, e.g. extruder.
@@ -285,18 +415,29 @@ static void tmc2209_step(void *opaque, int n, int value) {
 
     s->current_position = tmc2209_step_to_pos(s->current_step, s->max_steps_per_mm);
     qemu_set_irq(s->position_out, s->current_step);
-	bStall |= s->stalled;
-    if (bStall)
+    qemu_set_irq(s->hard_out, bStall && s->current_step==0);
+
+    if (bStall || s->stalled)
     {
-        if (s->current_step==0) qemu_set_irq(s->hard_out,1);
-        qemu_set_irq(s->irq_diag,1);
+        // Running into the frame or an external jam stalls the motor outright.
         s->regs.defs.SG_RESULT.sg_result = 0;
+        qemu_set_irq(s->irq_diag,1);
     }
-    else if (!bStall)
+    else if (s->regs.defs.DRV_STATUS.stst && count == 1)
     {
-            qemu_set_irq(s->hard_out,0);
-            qemu_set_irq(s->irq_diag,0);
-          s->regs.defs.SG_RESULT.sg_result = 250;
+        // First step out of standstill, no interval to measure yet.
+        qemu_set_irq(s->irq_diag,0);
+    }
+    else
+    {
+        uint16_t sg = tmc2209_stallguard(s, interval_ns / 1000);
+        s->regs.defs.SG_RESULT.sg_result = sg;
+        // TSTEP is in 12MHz clocks per 1/256 microstep. DIAG follows the
+        // SGTHRS comparison only at or above the TCOOLTHRS velocity.
+        uint32_t tstep = MIN((interval_ns * 12 / 1000) / s->ms_increment, 0xFFFFF);
+        s->regs.defs.TSTEP.tstep = tstep;
+        bool enabled = tstep <= s->regs.defs.TCOOLTHRS.tcoolthrs;
+        qemu_set_irq(s->irq_diag, enabled && sg <= 2U * s->regs.defs.SGTHRS.sgthrs);
     }
     s->regs.defs.DRV_STATUS.stst = false;
     // 2^20 comes from the datasheet.
@@ -305,30 +446,155 @@ static void tmc2209_step(void *opaque, int n, int value) {
     timer_mod(s->standstill, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL)+87);
 }
 
+static void tmc2209_step(void *opaque, int n, int value) {
+    
+    tmc2209_state *s = opaque;
+    bool changed = value != s->last_step;
+    s->last_step = value;
+    if (!s->enabled) return;
+	if (!s->regs.defs.CHOPCONF.dedge)
+	{
+		// In normal mode only step on rising pulse
+		if (!value) return;
+	}
+	else
+	{
+		// With DEDGE step on each value change
+		if (!changed) return;
+	}
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t tstep_ns = now - s->last_step_ns;
+    s->last_step_ns = now;
+    tmc2209_move(s, 1, tstep_ns);
+}
+
+// Pulse trains from a timer/DMA source, consumed as one (count, interval)
+// burst instead of an edge per microstep. Line 1 latches the pulse interval
+// in ns, line 0 takes the pulse count and applies the whole burst at once.
+static void tmc2209_step_burst(void *opaque, int n, int level) {
+    tmc2209_state *s = opaque;
+    if (n == 1)
+    {
+        s->burst_interval_ns = MAX(level, 0);
+        return;
+    }
+    if (!s->enabled || level <= 0) return;
+    s->last_step_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    tmc2209_move(s, level, s->burst_interval_ns);
+}
+
+// External load, e.g. jammed filament on E. Reported through DIAG on the next step.
+static void tmc2209_stall_in(void *opaque, int n, int level) {
+    tmc2209_state *s = opaque;
+    s->stalled = level;
+}
+
+static int tmc2209_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+{
+    tmc2209_state *s = TMC2209(obj);
+    switch (action)
+    {
+        case ActGetPosFloat:
+            script_print_float(s->current_position);
+            break;
+        case ActSetLoad:
+            s->sg_load = MIN(MAX(scripthost_get_int(args, 0), 0), 1023);
+            break;
+        case ActGetSG:
+            script_print_int(s->regs.defs.SG_RESULT.sg_result);
+            break;
+        case ActStepBurst:
+        {
+            int count = scripthost_get_int(args, 0);
+            if (count < 0) return ScriptLS_Error;
+            tmc2209_step_burst(s, 1, scripthost_get_int(args, 1) * 1000);
+            tmc2209_step_burst(s, 0, count);
+            break;
+        }
+        default:
+            return ScriptLS_Unhandled;
+
+    }
+    return ScriptLS_Finished;
+}
+
 static void tmc2209_dir(void *opaque, int n, int level) {
     tmc2209_state *s = opaque;
     s->dir = (level^s->is_inverted)&0x1;
 }
 
+// Microstep resolution from CHOPCONF.mres once the firmware has taken it over
+// from the MS pins. current_step always counts in 1/256 microsteps.
+static void tmc2209_update_mres(tmc2209_state *s)
+{
+    if (s->regs.defs.GCONF.mstep_reg_select)
+    {
+        s->ms_increment = 1U << MIN(s->regs.defs.CHOPCONF.mres, 8);
+    }
+    else
+    {
+        s->ms_increment = TMC2209_PIN_MS_INCREMENT;
+    }
+}
+
+// Refreshes the registers that reflect live driver state before a read.
+static void tmc2209_update_status(tmc2209_state *s)
+{
+    s->regs.defs.IOIN.enn = !s->enabled;
+    s->regs.defs.IOIN.ms1 = s->address & 1;
+    s->regs.defs.IOIN.ms2 = (s->address >> 1) & 1;
+    s->regs.defs.IOIN.step = s->last_step;
+    s->regs.defs.IOIN.dir = s->dir;
+
+    uint16_t mscnt = s->current_step & 0x3FF;
+    double phase = (mscnt + 0.5) * (M_PI / 512.0);
+    s->regs.defs.MSCNT.mscnt = mscnt;
+    s->regs.defs.MSCURACT.cur_a = (int)lround(248.0 * sin(phase)) & 0x1FF;
+    s->regs.defs.MSCURACT.cur_b = (int)lround(248.0 * cos(phase)) & 0x1FF;
+}
+
 static void tmc2209_write(tmc2209_state *s)
 {
+    uint8_t reg = s->rx_buffer[2] & 0x7F;
+    const tmc2209_reg_info_t *info = &tmc2209_reg_info[reg];
+    if (!(info->access & TMC2209_ACC_W))
+    {
+        DPRINTF("write to read-only/unimplemented register 0x%02x ignored\n", reg);
+        return;
+    }
     uint32_t data = 0;
     for(int i=3; i<7; i++)
     {
         data<<=8;
         data |=s->rx_buffer[i];
     }
-    s->regs.raw[s->rx_buffer[2]&0x7F] = data;
-    // TODO- check CRC.
+    if (info->access == TMC2209_ACC_RC)
+    {
+        s->regs.raw[reg] &= ~(data & info->mask);
+    }
+    else
+    {
+        s->regs.raw[reg] = data & info->mask;
+    }
+    // IFCNT only counts writes the driver accepted.
     s->regs.defs.IFCNT.ifcnt++;
-    
+
+    if (reg == TMC2209_GCONF || reg == TMC2209_CHOPCONF)
+    {
+        tmc2209_update_mres(s);
+    }
 }
 
 static void tmc2209_read(tmc2209_state *s)
 {
-    // TODO, actually construct reply.
-    uint32_t data = s->regs.raw[s->rx_buffer[2]];
-    uint8_t reply[8] = {0x05, 0xFF, s->rx_buffer[2],data>>24,data>>16,data>>8,data,0x00};
+    uint8_t reg = s->rx_buffer[2] & 0x7F;
+    uint32_t data = 0;
+    if (tmc2209_reg_info[reg].access & TMC2209_ACC_R)
+    {
+        tmc2209_update_status(s);
+        data = s->regs.raw[reg];
+    }
+    uint8_t reply[8] = {TMC2209_SYNC, 0xFF, reg, data>>24, data>>16, data>>8, data, 0x00};
     reply[7] = tmc2209_calcCRC(reply,7);
     for (int i=0; i<8; i++)
     {
@@ -340,15 +606,43 @@ static void tmc2209_receive(void *opaque, int n, int level)
 {
     tmc2209_state *s = (tmc2209_state *)opaque;
 
+    // Resynchronise on anything that can't start a datagram.
+    if (s->rx_pos == 0 && (level & 0x0F) != TMC2209_SYNC)
+    {
+        return;
+    }
+
     s->rx_buffer[s->rx_pos] = (uint8_t)level;
     s->rx_pos++;
 
-    if (s->rx_pos == 8 && s->rx_buffer[2] & 0x80)
+    if (s->rx_pos == TMC2209_CMD_LEN && s->rx_buffer[2] & 0x80)
     {
-        if (s->rx_buffer[1] == s->address) tmc2209_write(s);
+        if (s->rx_buffer[1] != s->address)
+        {
+            // Not for us.
+        }
+        else if (s->rx_buffer[7] != tmc2209_calcCRC(s->rx_buffer, 7))
+        {
+            DPRINTF("CRC error on write to 0x%02x\n", s->rx_buffer[2] & 0x7F);
+        }
+        else
+        {
+            tmc2209_write(s);
+        }
         s->rx_pos = 0;
-    } else if (s->rx_pos == 4 && !(s->rx_buffer[2] & 0x80)) {
-        if (s->rx_buffer[1] == s->address) tmc2209_read(s);
+    } else if (s->rx_pos == TMC2209_READ_LEN && !(s->rx_buffer[2] & 0x80)) {
+        if (s->rx_buffer[1] != s->address)
+        {
+            // Not for us.
+        }
+        else if (s->rx_buffer[3] != tmc2209_calcCRC(s->rx_buffer, 3))
+        {
+            DPRINTF("CRC error on read of 0x%02x\n", s->rx_buffer[2]);
+        }
+        else
+        {
+            tmc2209_read(s);
+        }
         s->rx_pos = 0;
     }
 }
@@ -363,6 +657,12 @@ static void tmc2209_realize(DeviceState *obj, Error **errp){
     const char buffer[2] = {s->id, '\0'};
     script_handle pScript = script_instance_new(P404_SCRIPTABLE(s), &buffer[0]);
     script_register_action(pScript, "GetPosFloat","Reports current position in mm.",ActGetPosFloat);
+    script_register_action(pScript, "SetLoad","Sets the mechanical load on the axis (0-1023) seen by StallGuard.",ActSetLoad);
+    script_add_arg_int(pScript, ActSetLoad);
+    script_register_action(pScript, "GetSG","Reports the current SG_RESULT.",ActGetSG);
+    script_register_action(pScript, "StepBurst","Steps count microsteps in the current direction, interval_us apart.",ActStepBurst);
+    script_add_arg_int(pScript, ActStepBurst);
+    script_add_arg_int(pScript, ActStepBurst);
     scripthost_register_scriptable(pScript);
 }
 
@@ -372,17 +672,17 @@ static void tmc2209_init(Object *obj){
     s->id=' ';
     s->address=0;
     s->dir = 0;
-    s->ms_increment = 16;
+    s->ms_increment = TMC2209_PIN_MS_INCREMENT;
     s->is_inverted = 0;
     // s->max_steps_per_mm = 256*100;
     // s->max_step  = 160*16*100;
     s->current_step = 0 * s->ms_increment; // 10mm
-    s->regs.defs.SG_RESULT.sg_result = 250;
-    s->regs.defs.DRV_STATUS.stst = 1;
 
     qdev_init_gpio_in_named( DEVICE(obj),tmc2209_dir, "tmc2209-dir",1);
     qdev_init_gpio_in_named( DEVICE(obj),tmc2209_step, "tmc2209-step",1);
+    qdev_init_gpio_in_named( DEVICE(obj),tmc2209_step_burst, "tmc2209-step-burst",2);
     qdev_init_gpio_in_named( DEVICE(obj),tmc2209_enable, "tmc2209-enable",1);
+    qdev_init_gpio_in_named( DEVICE(obj),tmc2209_stall_in, "tmc2209-stall",1);
     qdev_init_gpio_out_named(DEVICE(obj),&s->irq_diag, "tmc2209-diag", 1);
     qdev_init_gpio_out_named(DEVICE(obj),&s->hard_out, "tmc2209-hard", 1);
     qdev_init_gpio_in_named( DEVICE(obj),tmc2209_receive, "tmc2209-byte-in",1);
@@ -397,12 +697,24 @@ static void tmc2209_init(Object *obj){
 
 }
 
+static void tmc2209_reset(DeviceState *dev)
+{
+    tmc2209_state *s = TMC2209(dev);
+    for (int i=0; i<128; i++)
+    {
+        s->regs.raw[i] = tmc2209_reg_info[i].reset;
+    }
+    s->rx_pos = 0;
+    tmc2209_update_mres(s);
+}
+
 static Property tmc2209_properties[] = {
     DEFINE_PROP_UINT8("axis", tmc2209_state, id,(uint8_t)' '),
     DEFINE_PROP_UINT8("address", tmc2209_state, address,0),
     DEFINE_PROP_UINT8("inverted",tmc2209_state, is_inverted, 0),
     DEFINE_PROP_UINT64("max_step", tmc2209_state, max_step,16*100),
     DEFINE_PROP_UINT32("fullstepspermm",tmc2209_state, max_steps_per_mm,160*16*100),
+    DEFINE_PROP_UINT16("sg-load",tmc2209_state, sg_load, 64),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -421,7 +733,7 @@ static int tmc2209_post_load(void *opaque, int version_id)
 
 static const VMStateDescription vmstate_tmc2209 = {
     .name = TYPE_TMC2209,
-    .version_id = 1,
+    .version_id = 3,
     .minimum_version_id = 1,
     .post_load = tmc2209_post_load,
     .fields      = (VMStateField []) {
@@ -440,6 +752,9 @@ static const VMStateDescription vmstate_tmc2209 = {
         VMSTATE_UINT16(ms_increment,tmc2209_state),
         VMSTATE_UINT32(max_steps_per_mm,tmc2209_state),
         VMSTATE_TIMER_PTR(standstill,tmc2209_state),        
+        VMSTATE_INT64_V(last_step_ns,tmc2209_state, 2),
+        VMSTATE_UINT16_V(sg_load,tmc2209_state, 2),
+        VMSTATE_INT64_V(burst_interval_ns,tmc2209_state, 3),
         VMSTATE_END_OF_LIST(),
     }
 };
@@ -449,6 +764,7 @@ static void tmc2209_class_init(ObjectClass *klass, void *data)
     DeviceClass *dc = DEVICE_CLASS(klass);
     device_class_set_props(dc, tmc2209_properties);
     dc->realize = tmc2209_realize;
+    dc->reset = tmc2209_reset;
     dc->vmsd = &vmstate_tmc2209;
     P404ScriptIFClass *sc = P404_SCRIPTABLE_CLASS(klass);
     sc->ScriptHandler = tmc2209_process_action;
@@ -0,0 +1,340 @@
+/*
+    toolpath.c - Reconstructs the printed toolpath from the stepper
+    positions and streams it out as a binary segment log and
+    per-layer raster images.
+
+	Copyright 2021 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of Mini404.
+
+	Mini404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Mini404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Mini404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/notify.h"
+#include "qapi/error.h"
+#include "qom/object.h"
+#include "qemu/module.h"
+#include "hw/sysbus.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "sysemu/sysemu.h"
+#include "../utility/macros.h"
+#include "../utility/p404scriptable.h"
+#include "../utility/ScriptHost_C.h"
+
+#define TYPE_TOOLPATH "toolpath"
+OBJECT_DECLARE_SIMPLE_TYPE(ToolpathState, TOOLPATH)
+
+// Binary log: this header, then one little-endian int32 record per segment of
+// { end X um, end Y um, Z um, filament um }. Each segment starts where the
+// previous one ended; negative filament is a retraction.
+#define TOOLPATH_MAGIC "P404TP\0\1"
+
+enum {
+    AXIS_X,
+    AXIS_Y,
+    AXIS_Z,
+    AXIS_E,
+    AXIS_COUNT
+};
+
+struct ToolpathState {
+    SysBusDevice parent;
+
+    int32_t pos[AXIS_COUNT];    // Last reported step positions.
+    bool e_valid;
+
+    // Segment being accumulated, in um.
+    int32_t seg_start[2];
+    int32_t seg_z;
+    int32_t seg_e;
+
+    // Raster of the current layer; only one is ever held in memory.
+    uint8_t *layer;
+    uint32_t width, height;
+    int32_t layer_z;
+    uint32_t layer_count;
+    bool layer_dirty;
+
+    uint64_t segments;
+    int64_t extruded_um;
+
+    FILE *out;
+    Notifier exit;
+
+    uint32_t steps_per_mm[AXIS_COUNT];
+    uint32_t bed_mm[2];
+    uint32_t pixel_um;
+    uint32_t segment_um;
+    char *prefix;
+};
+
+enum {
+    ActFlush,
+    ActGetExtruded,
+};
+
+OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(ToolpathState, toolpath, TOOLPATH, SYS_BUS_DEVICE, {TYPE_P404_SCRIPTABLE}, {NULL})
+
+static int32_t toolpath_to_um(ToolpathState *s, int axis)
+{
+    return ((int64_t)s->pos[axis] * 1000) / s->steps_per_mm[axis];
+}
+
+static void toolpath_write_layer(ToolpathState *s)
+{
+    if (!s->layer_dirty) {
+        return;
+    }
+    g_autofree gchar *name = g_strdup_printf("%s-layer%04u.pgm", s->prefix, s->layer_count);
+    FILE *f = fopen(name, "wb");
+    if (f) {
+        fprintf(f, "P5\n# Z=%.3f\n%u %u\n255\n", s->layer_z / 1000.f, s->width, s->height);
+        fwrite(s->layer, 1, s->width * s->height, f);
+        fclose(f);
+    } else {
+        printf("toolpath: could not write %s\n", name);
+    }
+    memset(s->layer, 0, s->width * s->height);
+    s->layer_dirty = false;
+    s->layer_count++;
+}
+
+static void toolpath_plot(ToolpathState *s, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= s->width || y >= s->height) {
+        return;
+    }
+    // Flip Y so the image is seen from above with the front at the bottom.
+    uint8_t *px = &s->layer[(s->height - 1 - y) * s->width + x];
+    *px = MIN(*px + 128, 255);
+}
+
+static void toolpath_draw(ToolpathState *s, const int32_t *from, const int32_t *to)
+{
+    int x0 = from[AXIS_X] / (int32_t)s->pixel_um, y0 = from[AXIS_Y] / (int32_t)s->pixel_um;
+    int x1 = to[AXIS_X] / (int32_t)s->pixel_um, y1 = to[AXIS_Y] / (int32_t)s->pixel_um;
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+
+    for (;;) {
+        toolpath_plot(s, x0, y0);
+        if (x0 == x1 && y0 == y1) {
+            break;
+        }
+        int e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+// Closes the current segment at the present X/Y and starts the next one.
+static void toolpath_emit(ToolpathState *s)
+{
+    int32_t end[2] = { toolpath_to_um(s, AXIS_X), toolpath_to_um(s, AXIS_Y) };
+
+    if (end[AXIS_X] != s->seg_start[AXIS_X] || end[AXIS_Y] != s->seg_start[AXIS_Y] || s->seg_e) {
+        if (s->out) {
+            int32_t rec[4] = {
+                cpu_to_le32(end[AXIS_X]), cpu_to_le32(end[AXIS_Y]),
+                cpu_to_le32(s->seg_z), cpu_to_le32(s->seg_e)
+            };
+            fwrite(rec, sizeof(rec), 1, s->out);
+        }
+        if (s->seg_e > 0) {
+            if (s->seg_z != s->layer_z) {
+                toolpath_write_layer(s);
+                s->layer_z = s->seg_z;
+            }
+            toolpath_draw(s, s->seg_start, end);
+            s->layer_dirty = true;
+        }
+        s->extruded_um += s->seg_e;
+        s->segments++;
+    }
+    s->seg_start[AXIS_X] = end[AXIS_X];
+    s->seg_start[AXIS_Y] = end[AXIS_Y];
+    s->seg_z = toolpath_to_um(s, AXIS_Z);
+    s->seg_e = 0;
+}
+
+static void toolpath_position_in(void *opaque, int n, int level)
+{
+    ToolpathState *s = TOOLPATH(opaque);
+
+    if (n == AXIS_E) {
+        int32_t last = toolpath_to_um(s, AXIS_E);
+        s->pos[n] = level;
+        if (!s->e_valid) {
+            s->e_valid = true;
+            return;
+        }
+        int32_t delta = toolpath_to_um(s, AXIS_E) - last;
+        // Retraction and extrusion never share a segment.
+        if ((delta < 0 && s->seg_e > 0) || (delta > 0 && s->seg_e < 0)) {
+            toolpath_emit(s);
+        }
+        s->seg_e += delta;
+        return;
+    }
+
+    if (n == AXIS_Z) {
+        toolpath_emit(s);
+        s->pos[n] = level;
+        s->seg_z = toolpath_to_um(s, AXIS_Z);
+        return;
+    }
+
+    s->pos[n] = level;
+    int64_t dx = toolpath_to_um(s, AXIS_X) - s->seg_start[AXIS_X];
+    int64_t dy = toolpath_to_um(s, AXIS_Y) - s->seg_start[AXIS_Y];
+    if (dx * dx + dy * dy >= (int64_t)s->segment_um * s->segment_um) {
+        toolpath_emit(s);
+    }
+}
+
+static void toolpath_flush(ToolpathState *s)
+{
+    toolpath_emit(s);
+    toolpath_write_layer(s);
+    if (s->out) {
+        fflush(s->out);
+    }
+}
+
+static void toolpath_exit_notify(Notifier *n, void *data)
+{
+    ToolpathState *s = container_of(n, ToolpathState, exit);
+    toolpath_flush(s);
+    if (s->out) {
+        fclose(s->out);
+        s->out = NULL;
+    }
+}
+
+static int toolpath_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+{
+    ToolpathState *s = TOOLPATH(obj);
+    switch (action)
+    {
+        case ActFlush:
+            toolpath_flush(s);
+            break;
+        case ActGetExtruded:
+            script_print_float((s->extruded_um + s->seg_e) / 1000.f);
+            break;
+        default:
+            return ScriptLS_Unhandled;
+    }
+    return ScriptLS_Finished;
+}
+
+static void toolpath_finalize(Object *obj)
+{
+    ToolpathState *s = TOOLPATH(obj);
+    g_free(s->layer);
+}
+
+static void toolpath_init(Object *obj)
+{
+    qdev_init_gpio_in_named(DEVICE(obj), toolpath_position_in, "position-in", AXIS_COUNT);
+
+    script_handle pScript = script_instance_new(P404_SCRIPTABLE(obj), "Toolpath");
+    script_register_action(pScript, "Flush", "Writes out the current layer and flushes the toolpath log", ActFlush);
+    script_register_action(pScript, "GetExtruded", "Reports the net filament length extruded so far, in mm", ActGetExtruded);
+    scripthost_register_scriptable(pScript);
+}
+
+static void toolpath_realize(DeviceState *dev, Error **errp)
+{
+    ToolpathState *s = TOOLPATH(dev);
+
+    if (!s->prefix) {
+        error_setg(errp, "toolpath: an output prefix is required");
+        return;
+    }
+    if (s->pixel_um == 0) {
+        error_setg(errp, "toolpath: pixel-um must be non-zero");
+        return;
+    }
+    for (int i = 0; i < AXIS_COUNT; i++) {
+        if (s->steps_per_mm[i] == 0) {
+            error_setg(errp, "toolpath: steps per mm must be non-zero");
+            return;
+        }
+    }
+
+    g_autofree gchar *name = g_strdup_printf("%s.tp", s->prefix);
+    s->out = fopen(name, "wb");
+    if (!s->out) {
+        error_setg_errno(errp, errno, "toolpath: could not create %s", name);
+        return;
+    }
+    fwrite(TOOLPATH_MAGIC, 8, 1, s->out);
+
+    s->width = (s->bed_mm[AXIS_X] * 1000) / s->pixel_um;
+    s->height = (s->bed_mm[AXIS_Y] * 1000) / s->pixel_um;
+    s->layer = g_malloc0(s->width * s->height);
+    s->layer_z = INT32_MIN;
+
+    s->exit.notify = toolpath_exit_notify;
+    qemu_add_exit_notifier(&s->exit);
+}
+
+static const VMStateDescription vmstate_toolpath = {
+    .name = TYPE_TOOLPATH,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_INT32_ARRAY(pos, ToolpathState, AXIS_COUNT),
+        VMSTATE_BOOL(e_valid, ToolpathState),
+        VMSTATE_INT32_ARRAY(seg_start, ToolpathState, 2),
+        VMSTATE_INT32(seg_z, ToolpathState),
+        VMSTATE_INT32(seg_e, ToolpathState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property toolpath_properties[] = {
+    DEFINE_PROP_UINT32("x-steps-per-mm", ToolpathState, steps_per_mm[AXIS_X], 100*16),
+    DEFINE_PROP_UINT32("y-steps-per-mm", ToolpathState, steps_per_mm[AXIS_Y], 100*16),
+    DEFINE_PROP_UINT32("z-steps-per-mm", ToolpathState, steps_per_mm[AXIS_Z], 400*16),
+    DEFINE_PROP_UINT32("e-steps-per-mm", ToolpathState, steps_per_mm[AXIS_E], 320*16),
+    DEFINE_PROP_UINT32("bed-x-mm", ToolpathState, bed_mm[AXIS_X], 180),
+    DEFINE_PROP_UINT32("bed-y-mm", ToolpathState, bed_mm[AXIS_Y], 180),
+    DEFINE_PROP_UINT32("pixel-um", ToolpathState, pixel_um, 250),
+    DEFINE_PROP_UINT32("segment-um", ToolpathState, segment_um, 500),
+    DEFINE_PROP_STRING("prefix", ToolpathState, prefix),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void toolpath_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = toolpath_realize;
+    dc->vmsd = &vmstate_toolpath;
+    device_class_set_props(dc, toolpath_properties);
+
+    P404ScriptIFClass *sc = P404_SCRIPTABLE_CLASS(klass);
+    sc->ScriptHandler = toolpath_process_action;
+}
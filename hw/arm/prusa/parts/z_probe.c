@@ -0,0 +1,302 @@
+/*
+    z_probe.c - Z probe (MINDA) model for Mini404 that triggers
+    from the axis positions and a bed height map.
+
+	Copyright 2021 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of Mini404.
+
+	Mini404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Mini404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Mini404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/irq.h"
+#include "qom/object.h"
+#include "qemu/module.h"
+#include "hw/sysbus.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "../utility/macros.h"
+#include "../utility/p404scriptable.h"
+#include "../utility/ScriptHost_C.h"
+
+#define TYPE_Z_PROBE "z-probe"
+OBJECT_DECLARE_SIMPLE_TYPE(ZProbeState, Z_PROBE)
+
+#define Z_PROBE_MAP_MAX 16
+
+enum {
+    AXIS_X,
+    AXIS_Y,
+    AXIS_Z,
+    AXIS_COUNT
+};
+
+struct ZProbeState {
+    SysBusDevice parent;
+
+    qemu_irq irq;
+
+    // Axis positions as reported on tmc2209-step-out.
+    int32_t pos[AXIS_COUNT];
+    bool z_valid;
+    bool triggered;
+
+    // Z position at or below which the probe fires at the current X/Y.
+    // Only changes when X or Y move, so a Z step is a single compare.
+    int32_t threshold;
+
+    // Bed height map in um, row-major from Y=0, evenly spread over the bed.
+    uint8_t nx, ny;
+    int32_t map_um[Z_PROBE_MAP_MAX * Z_PROBE_MAP_MAX];
+
+    uint32_t steps_per_mm[AXIS_COUNT];
+    uint32_t bed_mm[2];
+    char *map_file;
+};
+
+enum {
+    ActLoadMap,
+    ActGetThreshold,
+};
+
+OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(ZProbeState, z_probe, Z_PROBE, SYS_BUS_DEVICE, {TYPE_P404_SCRIPTABLE}, {NULL})
+
+static void z_probe_finalize(Object *obj)
+{
+}
+
+// Position along one bed axis in map cells, as 16.16 fixed point.
+static int64_t z_probe_to_grid(ZProbeState *s, int axis, uint8_t n)
+{
+    int64_t span = (int64_t)s->bed_mm[axis] * s->steps_per_mm[axis];
+    if (n < 2 || span == 0 || s->pos[axis] <= 0) {
+        return 0;
+    }
+    int64_t g = (((int64_t)s->pos[axis] * (n - 1)) << 16) / span;
+    return MIN(g, (int64_t)(n - 1) << 16);
+}
+
+static void z_probe_update_threshold(ZProbeState *s)
+{
+    int64_t gx = z_probe_to_grid(s, AXIS_X, s->nx);
+    int64_t gy = z_probe_to_grid(s, AXIS_Y, s->ny);
+    int ix = gx >> 16, iy = gy >> 16;
+    int64_t fx = gx & 0xFFFF, fy = gy & 0xFFFF;
+    int ix1 = MIN(ix + 1, s->nx - 1);
+    int iy1 = MIN(iy + 1, s->ny - 1);
+
+    const int32_t *row0 = &s->map_um[iy * s->nx];
+    const int32_t *row1 = &s->map_um[iy1 * s->nx];
+    int64_t front = row0[ix] * (0x10000 - fx) + row0[ix1] * fx;
+    int64_t back  = row1[ix] * (0x10000 - fx) + row1[ix1] * fx;
+    int64_t height_um = (front * (0x10000 - fy) + back * fy) >> 32;
+
+    s->threshold = (height_um * s->steps_per_mm[AXIS_Z]) / 1000;
+}
+
+static void z_probe_evaluate(ZProbeState *s)
+{
+    bool triggered = s->z_valid && s->pos[AXIS_Z] <= s->threshold;
+    if (triggered != s->triggered) {
+        s->triggered = triggered;
+        qemu_set_irq(s->irq, triggered);
+    }
+}
+
+static void z_probe_position_in(void *opaque, int n, int level)
+{
+    ZProbeState *s = Z_PROBE(opaque);
+    s->pos[n] = level;
+    if (n == AXIS_Z) {
+        s->z_valid = true;
+    } else {
+        z_probe_update_threshold(s);
+    }
+    z_probe_evaluate(s);
+}
+
+// Text map: one row of heights in mm per line, starting at Y=0,
+// values separated by spaces, tabs or commas. Lines starting with # are skipped.
+// A map that dips below 0 is raised so its lowest cell sits at 0.
+static bool z_probe_load_map(ZProbeState *s, const char *file)
+{
+    gchar *contents = NULL;
+    int32_t map[Z_PROBE_MAP_MAX * Z_PROBE_MAP_MAX];
+    uint8_t nx = 0, ny = 0;
+    bool ok = true;
+
+    if (!g_file_get_contents(file, &contents, NULL, NULL)) {
+        printf("z-probe: could not read bed map %s\n", file);
+        return false;
+    }
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    for (gchar **line = lines; ok && *line; line++) {
+        if (**line == '#') {
+            continue;
+        }
+        gchar **cells = g_strsplit_set(*line, " \t,;\r", -1);
+        uint8_t count = 0;
+        for (gchar **cell = cells; *cell; cell++) {
+            if (!**cell) {
+                continue;
+            }
+            if (count == Z_PROBE_MAP_MAX || ny == Z_PROBE_MAP_MAX) {
+                ok = false;
+                break;
+            }
+            map[ny * Z_PROBE_MAP_MAX + count++] = g_ascii_strtod(*cell, NULL) * 1000.0;
+        }
+        g_strfreev(cells);
+        if (count == 0) {
+            continue;
+        }
+        if (nx && count != nx) {
+            ok = false;
+        }
+        nx = count;
+        ny++;
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    if (!ok || nx == 0) {
+        printf("z-probe: bed map %s must be a rectangular grid of at most %dx%d heights\n",
+            file, Z_PROBE_MAP_MAX, Z_PROBE_MAP_MAX);
+        return false;
+    }
+
+    // Z is clamped at 0 by the drivers, so a threshold below it would never
+    // trigger. Lift the map so its lowest point is at 0; only the relative
+    // heights matter once the printer has homed on the probe.
+    int32_t lowest = 0;
+    for (int y = 0; y < ny; y++) {
+        for (int x = 0; x < nx; x++) {
+            lowest = MIN(lowest, map[y * Z_PROBE_MAP_MAX + x]);
+        }
+    }
+
+    s->nx = nx;
+    s->ny = ny;
+    for (int y = 0; y < ny; y++) {
+        for (int x = 0; x < nx; x++) {
+            s->map_um[y * nx + x] = map[y * Z_PROBE_MAP_MAX + x] - lowest;
+        }
+    }
+    z_probe_update_threshold(s);
+    z_probe_evaluate(s);
+    return true;
+}
+
+static int z_probe_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+{
+    ZProbeState *s = Z_PROBE(obj);
+    switch (action)
+    {
+        case ActLoadMap:
+            if (!z_probe_load_map(s, scripthost_get_string(args, 0))) {
+                return ScriptLS_Error;
+            }
+            break;
+        case ActGetThreshold:
+            script_print_float((float)s->threshold / (float)s->steps_per_mm[AXIS_Z]);
+            break;
+        default:
+            return ScriptLS_Unhandled;
+    }
+    return ScriptLS_Finished;
+}
+
+static void z_probe_reset(DeviceState *dev)
+{
+    ZProbeState *s = Z_PROBE(dev);
+    s->triggered = false;
+    qemu_set_irq(s->irq, 0);
+    z_probe_evaluate(s);
+}
+
+static void z_probe_init(Object *obj)
+{
+    ZProbeState *s = Z_PROBE(obj);
+
+    // Flat bed until told otherwise: fires at Z=0 like the old hard endstop.
+    s->nx = 1;
+    s->ny = 1;
+
+    qdev_init_gpio_in_named(DEVICE(obj), z_probe_position_in, "position-in", AXIS_COUNT);
+    qdev_init_gpio_out(DEVICE(obj), &s->irq, 1);
+
+    script_handle pScript = script_instance_new(P404_SCRIPTABLE(obj), TYPE_Z_PROBE);
+    script_register_action(pScript, "LoadMap", "Loads a bed height map (rows of heights in mm from Y=0)", ActLoadMap);
+    script_add_arg_string(pScript, ActLoadMap);
+    script_register_action(pScript, "GetThreshold", "Reports the trigger height in mm at the current X/Y", ActGetThreshold);
+    scripthost_register_scriptable(pScript);
+}
+
+static void z_probe_realize(DeviceState *dev, Error **errp)
+{
+    ZProbeState *s = Z_PROBE(dev);
+    if (s->map_file) {
+        z_probe_load_map(s, s->map_file);
+    }
+}
+
+static int z_probe_post_load(void *opaque, int version_id)
+{
+    ZProbeState *s = Z_PROBE(opaque);
+    if (s->nx == 0 || s->nx > Z_PROBE_MAP_MAX || s->ny == 0 || s->ny > Z_PROBE_MAP_MAX) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_z_probe = {
+    .name = TYPE_Z_PROBE,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = z_probe_post_load,
+    .fields      = (VMStateField []) {
+        VMSTATE_INT32_ARRAY(pos, ZProbeState, AXIS_COUNT),
+        VMSTATE_BOOL(z_valid, ZProbeState),
+        VMSTATE_BOOL(triggered, ZProbeState),
+        VMSTATE_INT32(threshold, ZProbeState),
+        VMSTATE_UINT8(nx, ZProbeState),
+        VMSTATE_UINT8(ny, ZProbeState),
+        VMSTATE_INT32_ARRAY(map_um, ZProbeState, Z_PROBE_MAP_MAX * Z_PROBE_MAP_MAX),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property z_probe_properties[] = {
+    DEFINE_PROP_UINT32("x-steps-per-mm", ZProbeState, steps_per_mm[AXIS_X], 100*16),
+    DEFINE_PROP_UINT32("y-steps-per-mm", ZProbeState, steps_per_mm[AXIS_Y], 100*16),
+    DEFINE_PROP_UINT32("z-steps-per-mm", ZProbeState, steps_per_mm[AXIS_Z], 400*16),
+    DEFINE_PROP_UINT32("bed-x-mm", ZProbeState, bed_mm[AXIS_X], 180),
+    DEFINE_PROP_UINT32("bed-y-mm", ZProbeState, bed_mm[AXIS_Y], 180),
+    DEFINE_PROP_STRING("map", ZProbeState, map_file),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void z_probe_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = z_probe_realize;
+    dc->reset = z_probe_reset;
+    dc->vmsd = &vmstate_z_probe;
+    device_class_set_props(dc, z_probe_properties);
+
+    P404ScriptIFClass *sc = P404_SCRIPTABLE_CLASS(klass);
+    sc->ScriptHandler = z_probe_process_action;
+}
@@ -29,11 +29,17 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "qemu/error-report.h"
+#include "qemu/config-file.h"
+#include "qemu/option.h"
 #include "stm32f407/stm32f407_soc.h"
 #include "hw/arm/boot.h"
 #include "hw/loader.h"
 #include "utility/ArgHelper.h"
 #include "sysemu/runstate.h"
+#include "exec/exec-all.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/cpu-timers.h"
+#include "net/net.h"
 
 #define BOOTLOADER_IMAGE "bootloader.bin"
 
@@ -41,13 +47,42 @@ static void prusa_mini_init(MachineState *machine)
 {
     DeviceState *dev;
 
+    // We (ab)use the kernel command line to piggyback custom arguments into QEMU. 
+    // Parse those now. 
+    arghelper_setargs(machine->kernel_cmdline);
+
+    // Reproducible runs: the RTC must be created on the virtual clock, so this
+    // has to happen before the SoC exists. Checked against icount below.
+    bool deterministic = arghelper_is_arg("deterministic");
+    if (deterministic) {
+        rtc_clock = QEMU_CLOCK_VIRTUAL;
+    }
+
     dev = qdev_new(TYPE_STM32F407_SOC);
     qdev_prop_set_string(dev, "cpu-type", ARM_CPU_TYPE_NAME("cortex-m4"));
+    // part=<STM32F4xx part number> swaps the SoC for bring-up and model testing.
+    qdev_prop_set_string(dev, "part", arghelper_is_arg("part") ? arghelper_get_string("part") : "STM32F407VGT6");
     sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
     STM32F407State *SOC = STM32F407_SOC(dev);
-    // We (ab)use the kernel command line to piggyback custom arguments into QEMU. 
-    // Parse those now. 
-    arghelper_setargs(machine->kernel_cmdline);
+
+    if (deterministic) {
+        // Guest time must come from the instruction count at the firmware's
+        // SYSCLK rate, with idle periods skipped rather than slept through.
+        uint32_t sysclk = SOC->rcc.SYSCLK.max_output_freq;
+        if (icount_enabled() != 1 || icount_sleep_enabled() ||
+            icount_to_ns(sysclk) != NANOSECONDS_PER_SECOND) {
+            error_setg(&error_fatal, "deterministic requires -icount freq=%u,sleep=off", sysclk);
+            return;
+        }
+        // The RTC calendar starts from -rtc base, which is the host's wall
+        // clock (or time zone) unless a fixed date is given.
+        QemuOpts *rtc = qemu_opts_find(qemu_find_opts("rtc"), NULL);
+        const char *base = rtc ? qemu_opt_get(rtc, "base") : NULL;
+        if (!base || !strcmp(base, "utc") || !strcmp(base, "localtime")) {
+            error_setg(&error_fatal, "deterministic requires -rtc base=<date>, e.g. base=2021-01-01T00:00:00");
+            return;
+        }
+    }
     
     if (arghelper_is_arg("appendix")) {
         SOC->gpio[GPIO_A].idr_mask |= 0x2000;
@@ -79,6 +114,20 @@ static void prusa_mini_init(MachineState *machine)
                             FLASH_SIZE);
         }
     }
+    // Opt-in: translate flash code before the guest starts instead of on first use.
+    // tbcache=<dir> replays the blocks a previous run of the same image executed,
+    // tbaot[=<n>] additionally walks forward from those for up to n more blocks.
+    const char* tb_cache_dir = arghelper_get_string("tbcache");
+    uint32_t tb_aot_budget = 0;
+    if (arghelper_is_arg("tbaot")) {
+        tb_aot_budget = strtoul(arghelper_get_string("tbaot"), NULL, 0);
+        if (tb_aot_budget == 0) {
+            tb_aot_budget = 8192;
+        }
+    }
+    if (tb_cache_dir || tb_aot_budget) {
+        tb_seed_init(first_cpu, tb_cache_dir, FLASH_BASE_ADDRESS, FLASH_SIZE, tb_aot_budget);
+    }
     /* Wire up display */
 
     void *bus;
@@ -144,6 +193,60 @@ static void prusa_mini_init(MachineState *machine)
     DeviceState *vis = qdev_new("mini-visuals");
     sysbus_realize(SYS_BUS_DEVICE(vis), &error_fatal);
    
+    // Microsteps per mm for X/Y/Z/E, shared by the drivers and the parts that
+    // follow their positions.
+    static const int32_t stepsize[4] = { 100*16, 100*16, 400*16, 320*16 };
+
+    // The MINDA on PA8 fires from the X/Y/Z positions and an optional bed map.
+    DeviceState *probe = qdev_new("z-probe");
+    qdev_prop_set_uint32(probe, "x-steps-per-mm", stepsize[0]);
+    qdev_prop_set_uint32(probe, "y-steps-per-mm", stepsize[1]);
+    qdev_prop_set_uint32(probe, "z-steps-per-mm", stepsize[2]);
+    if (arghelper_is_arg("bedmap")) {
+        qdev_prop_set_string(probe, "map", arghelper_get_string("bedmap"));
+    }
+    sysbus_realize(SYS_BUS_DEVICE(probe), &error_fatal);
+    qdev_connect_gpio_out(probe, 0, qemu_irq_split(qdev_get_gpio_in(DEVICE(&SOC->gpio[GPIO_A]),8), qdev_get_gpio_in_named(vis,"indicator-logic",7)));
+
+    // Filament sensor on PB4 follows the E driver, for runout/jam scenarios.
+    DeviceState *fsensor = qdev_new("ir-sensor");
+    qdev_prop_set_uint32(fsensor, "steps-per-mm", stepsize[3]);
+    if (arghelper_is_arg("spool")) {
+        qdev_prop_set_uint32(fsensor, "spool-mm", strtoul(arghelper_get_string("spool"), NULL, 0));
+    }
+    if (arghelper_is_arg("jam")) {
+        qdev_prop_set_uint32(fsensor, "jam-mm", strtoul(arghelper_get_string("jam"), NULL, 0));
+    }
+    sysbus_realize(SYS_BUS_DEVICE(fsensor), &error_fatal);
+    qdev_connect_gpio_out(fsensor, 0, qemu_irq_split(qdev_get_gpio_in(DEVICE(&SOC->gpio[GPIO_B]),4), qdev_get_gpio_in_named(vis,"indicator-logic",6)));
+
+    // Optional toolpath reconstruction for print-quality checks.
+    DeviceState *toolpath = NULL;
+    if (arghelper_is_arg("toolpath")) {
+        toolpath = qdev_new("toolpath");
+        qdev_prop_set_string(toolpath, "prefix", arghelper_get_string("toolpath"));
+        qdev_prop_set_uint32(toolpath, "x-steps-per-mm", stepsize[0]);
+        qdev_prop_set_uint32(toolpath, "y-steps-per-mm", stepsize[1]);
+        qdev_prop_set_uint32(toolpath, "z-steps-per-mm", stepsize[2]);
+        qdev_prop_set_uint32(toolpath, "e-steps-per-mm", stepsize[3]);
+        sysbus_realize(SYS_BUS_DEVICE(toolpath), &error_fatal);
+    }
+
+    // Optional firmware variable sampling: telemetry=<log>,telemetry-vars=<a;b;...>
+    // with telemetry-us for the period and telemetry-elf when booting a .bbf/.bin.
+    if (arghelper_is_arg("telemetry")) {
+        dev = qdev_new("telemetry");
+        qdev_prop_set_string(dev, "file", arghelper_get_string("telemetry"));
+        qdev_prop_set_string(dev, "elf", arghelper_is_arg("telemetry-elf") ? arghelper_get_string("telemetry-elf") : machine->kernel_filename);
+        if (arghelper_is_arg("telemetry-vars")) {
+            qdev_prop_set_string(dev, "vars", arghelper_get_string("telemetry-vars"));
+        }
+        if (arghelper_is_arg("telemetry-us")) {
+            qdev_prop_set_uint32(dev, "period-us", strtoul(arghelper_get_string("telemetry-us"), NULL, 0));
+        }
+        sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
+    }
+
     {
         static const char names[4] = {'X','Y','Z','E'};
         static const uint8_t addresses[4] = {1, 3,0,2};
@@ -154,7 +257,6 @@ static void prusa_mini_init(MachineState *machine)
         static const uint8_t diag_ports[4] = {GPIO_E, GPIO_E, GPIO_E, GPIO_A};
         static const uint8_t is_inverted[4] = {1,1,0,0};
         static const int32_t ends[4] = { 100*16*182, 100*16*183, 400*16*185,0 };
-        static const int32_t stepsize[4] = { 100*16, 100*16, 400*16, 320*16 };
 
 
         // bus = qdev_get_child_bus(DEVICE(&SOC->usart2),"spi");
@@ -179,13 +281,29 @@ static void prusa_mini_init(MachineState *machine)
             qdev_connect_gpio_out(DEVICE(&SOC->gpio[GPIO_D]), en_pins[i],split_en);
             qemu_irq split_diag = qemu_irq_split( qdev_get_gpio_in(DEVICE(&SOC->gpio[diag_ports[i]]),diag_pins[i]),qdev_get_gpio_in_named(vis,"indicator-logic",i));
             qdev_connect_gpio_out_named(dev,"tmc2209-diag", 0, split_diag);
-            if (i==2) qdev_connect_gpio_out_named(dev,"tmc2209-hard", 0, qdev_get_gpio_in(DEVICE(&SOC->gpio[GPIO_A]),8));
-            qdev_connect_gpio_out_named(dev,"tmc2209-step-out", 0, qdev_get_gpio_in_named(vis,"motor-step",i));
+            qemu_irq step_out = qdev_get_gpio_in_named(vis,"motor-step",i);
+            if (i<3) step_out = qemu_irq_split(step_out, qdev_get_gpio_in_named(probe,"position-in",i));
+            else {
+                step_out = qemu_irq_split(step_out, qdev_get_gpio_in_named(fsensor,"e-position-in",0));
+                qdev_connect_gpio_out_named(fsensor, "jam-out", 0, qdev_get_gpio_in_named(dev,"tmc2209-stall",0));
+            }
+            if (toolpath) step_out = qemu_irq_split(step_out, qdev_get_gpio_in_named(toolpath,"position-in",i));
+            qdev_connect_gpio_out_named(dev,"tmc2209-step-out", 0, step_out);
 
         }
 
     }
 
+    // ESP Wi-Fi module on USART6. The MINI ships without one, so it is only
+    // fitted when there is a network for it to bridge to.
+    if (qemu_find_netdev("mini-esp")!=NULL && SOC->part->num_usarts > 5) {
+        dev = qdev_new("esp8266");
+        qdev_prop_set_string(dev, "netdev", "mini-esp");
+        object_property_set_link(OBJECT(dev), "uart", OBJECT(&SOC->usart[5]), &error_fatal);
+        sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
+        qdev_connect_gpio_out_named(DEVICE(&SOC->usart[5]),"uart-byte-out", 0, qdev_get_gpio_in_named(dev,"esp-byte-in",0));
+    }
+
     uint16_t startvals[] = {18,18, 25, 512, 512};
     uint8_t channels[] = {10,4,3,5,6};
     int tables[] = {5, 1, 2000,0,0};
@@ -203,27 +321,40 @@ static void prusa_mini_init(MachineState *machine)
         qdev_connect_gpio_out_named(dev, "thermistor_value",0, qdev_get_gpio_in_named(DEVICE(&SOC->adc[0]),"adc_data_in",channels[i]));
     }
     // Heaters - bed is B0/ TIM3C3, E is B1/ TIM3C4
-
-    dev = qdev_new("heater");
-    qdev_prop_set_uint8(dev, "thermal_mass_x10",30);
-    qdev_prop_set_uint8(dev,"label", 'E');
-    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
-    qdev_connect_gpio_out_named(DEVICE(&SOC->timers[2]),"pwm_ratio_changed",3,qdev_get_gpio_in_named(dev, "pwm_in",0));
-    qdev_connect_gpio_out_named(dev, "temp_out",0, qdev_get_gpio_in_named(hotend, "thermistor_set_temperature",0));
-    qdev_connect_gpio_out_named(dev, "pwm-out", 0, qdev_get_gpio_in_named(vis,"indicator-analog",8));
-
-    // Bed.
-    dev = qdev_new("heater");
-    qdev_prop_set_uint8(dev, "thermal_mass_x10",3);
-    qdev_prop_set_uint8(dev,"label", 'B');
-    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
-    qdev_connect_gpio_out_named(DEVICE(&SOC->timers[2]),"pwm_ratio_changed",2,qdev_get_gpio_in_named(dev, "pwm_in",0));
-    qdev_connect_gpio_out_named(dev, "temp_out",0, qdev_get_gpio_in_named(bed, "thermistor_set_temperature",0));
-    qdev_connect_gpio_out_named(dev, "pwm-out", 0, qdev_get_gpio_in_named(vis,"indicator-analog",9));
-
-    dev = qdev_new("ir-sensor");
-    sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
-    qdev_connect_gpio_out(dev, 0, qdev_get_gpio_in(DEVICE(&SOC->gpio[GPIO_B]),4));
+    // With cosim=<shm>, an external plant model replaces them: the E and bed
+    // PWM go out on cosim-in 0 and 1, temperatures (x256) come back on cosim-out.
+    if (arghelper_is_arg("cosim")) {
+#ifndef CONFIG_LINUX
+        error_setg(&error_fatal, "cosim needs a Linux host");
+#endif
+        const char *shm = arghelper_get_string("cosim");
+        dev = qdev_new("cosim-shm");
+        qdev_prop_set_string(dev, "shm", strcmp(shm, "true") ? shm : "/mini404-cosim");
+        qdev_prop_set_uint32(dev, "num-in", 2);
+        qdev_prop_set_uint32(dev, "num-out", 2);
+        sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
+        qdev_connect_gpio_out_named(DEVICE(&SOC->timers[2]),"pwm_ratio_changed",3,qemu_irq_split(qdev_get_gpio_in_named(dev, "cosim-in",0), qdev_get_gpio_in_named(vis,"indicator-analog",8)));
+        qdev_connect_gpio_out_named(DEVICE(&SOC->timers[2]),"pwm_ratio_changed",2,qemu_irq_split(qdev_get_gpio_in_named(dev, "cosim-in",1), qdev_get_gpio_in_named(vis,"indicator-analog",9)));
+        qdev_connect_gpio_out_named(dev, "cosim-out",0, qdev_get_gpio_in_named(hotend, "thermistor_set_temperature",0));
+        qdev_connect_gpio_out_named(dev, "cosim-out",1, qdev_get_gpio_in_named(bed, "thermistor_set_temperature",0));
+    } else {
+        dev = qdev_new("heater");
+        qdev_prop_set_uint8(dev, "thermal_mass_x10",30);
+        qdev_prop_set_uint8(dev,"label", 'E');
+        sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
+        qdev_connect_gpio_out_named(DEVICE(&SOC->timers[2]),"pwm_ratio_changed",3,qdev_get_gpio_in_named(dev, "pwm_in",0));
+        qdev_connect_gpio_out_named(dev, "temp_out",0, qdev_get_gpio_in_named(hotend, "thermistor_set_temperature",0));
+        qdev_connect_gpio_out_named(dev, "pwm-out", 0, qdev_get_gpio_in_named(vis,"indicator-analog",8));
+
+        // Bed.
+        dev = qdev_new("heater");
+        qdev_prop_set_uint8(dev, "thermal_mass_x10",3);
+        qdev_prop_set_uint8(dev,"label", 'B');
+        sysbus_realize(SYS_BUS_DEVICE(dev), &error_fatal);
+        qdev_connect_gpio_out_named(DEVICE(&SOC->timers[2]),"pwm_ratio_changed",2,qdev_get_gpio_in_named(dev, "pwm_in",0));
+        qdev_connect_gpio_out_named(dev, "temp_out",0, qdev_get_gpio_in_named(bed, "thermistor_set_temperature",0));
+        qdev_connect_gpio_out_named(dev, "pwm-out", 0, qdev_get_gpio_in_named(vis,"indicator-analog",9));
+    }
 
     // hotend = fan1
     // print fan = fan0
@@ -249,6 +380,9 @@ static void prusa_mini_init(MachineState *machine)
     qdev_connect_gpio_out_named(dev, "encoder-a",0,  qdev_get_gpio_in(DEVICE(&SOC->gpio[GPIO_E]),15));
     qdev_connect_gpio_out_named(dev, "encoder-b",0,  qdev_get_gpio_in(DEVICE(&SOC->gpio[GPIO_E]),13));
 
+    dev = qdev_new("p404-board");
+    sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
+
     // Needs to come last because it has the scripting engine setup.
     dev = qdev_new("p404-scriptcon");
     sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
@@ -352,9 +352,9 @@ typedef struct Stm32Rcc Stm32Rcc;
 #define STM32_RCC(obj) OBJECT_CHECK(Stm32Rcc, (obj), TYPE_STM32_RCC)
 
 /* Checks if the specified peripheral clock is enabled.
- * Generates a hardware error if not.
+ * Prints a warning and returns false if not.
  */
-void stm32_rcc_check_periph_clk(Stm32Rcc *s, stm32_periph_t periph);
+bool stm32_rcc_check_periph_clk(Stm32Rcc *s, stm32_periph_t periph);
 
 /* Sets the IRQ to be called when the specified peripheral clock changes
  * frequency. */
@@ -99,6 +99,23 @@ static void stm32_uart_baud_update(Stm32Uart *s)
 #endif
 }
 
+/* True while the RCC has the USART's peripheral clock turned off. */
+static bool stm32_uart_is_gated(Stm32Uart *s)
+{
+    return s->stm32_rcc && stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph) == 0;
+}
+
+static void stm32_uart_fill_receive_data_register(Stm32Uart *s);
+
+/* Tell whoever feeds the receiver that there is room again. */
+static void stm32_uart_accept_input(Stm32Uart *s)
+{
+    qemu_chr_fe_accept_input(&s->chr);
+    if (s->peer_ready) {
+        s->peer_ready(s->peer_opaque);
+    }
+}
+
 /* Handle a change in the peripheral clock. */
 static void stm32_uart_clk_irq_handler(void *opaque, int n, int level)
 {
@@ -110,6 +127,24 @@ static void stm32_uart_clk_irq_handler(void *opaque, int n, int level)
     if(level) {
         stm32_uart_baud_update(s);
     }
+
+    if (stm32_uart_is_gated(s)) {
+        /* The shift registers stop with the clock. Whatever character was
+         * in flight finishes one character time after the clock returns. */
+        timer_del(s->tx_timer);
+        timer_del(s->rx_timer);
+        return;
+    }
+
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (!s->defs.SR.TC && !timer_pending(s->tx_timer)) {
+        timer_mod(s->tx_timer, now + s->ns_per_char);
+    }
+    if (s->receiving && !timer_pending(s->rx_timer)) {
+        timer_mod(s->rx_timer, now + s->ns_per_char);
+    }
+    stm32_uart_fill_receive_data_register(s);
+    stm32_uart_accept_input(s);
 }
 
 /* Routine which updates the USART's IRQ.  This should be called whenever
@@ -181,27 +216,31 @@ static void stm32_uart_start_tx(Stm32Uart *s, uint32_t value)
     // if (s->chr_write_obj) {
         // s->chr_write(s->chr_write_obj, &ch, 1);
     // }
-#ifdef STM32_UART_NO_BAUD_DELAY
+#ifndef STM32_UART_NO_BAUD_DELAY
+    if (!s->no_baud_delay) {
+        /* Start the transmit delay timer. */
+        timer_mod(s->tx_timer,  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->ns_per_char);
+        return;
+    }
+#endif
     /* If BAUD delays are not being simulated, then immediately mark the
      * transmission as complete.
      */
     stm32_uart_tx_complete(s);
-#else
-    /* Otherwise, start the transmit delay timer. */
-    timer_mod(s->tx_timer,  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->ns_per_char);
-#endif
 }
 
 
 /* Put byte into the receive data register, if we have one and the target is 
  * ready for it. */
-static void stm32_uart_fill_receive_data_register(Stm32Uart *s)
+static void stm32_uart_fill_one(Stm32Uart *s)
 {
     bool enabled = (s->defs.CR1.UE && s->defs.CR1.RE);
 
     /* If we have no more data, or we are emulating baud delay and it's not 
-     * time yet for the next byte, return without filling the RDR */
-    if (!s->rcv_char_bytes || s->receiving) {
+     * time yet for the next byte, return without filling the RDR.
+     * Nothing arrives while the clock is gated either; the bytes wait
+     * in the buffer until it comes back. */
+    if (!s->rcv_char_bytes || s->receiving || stm32_uart_is_gated(s)) {
         return;
     }
 
@@ -233,12 +272,31 @@ static void stm32_uart_fill_receive_data_register(Stm32Uart *s)
     }
 
 #ifndef STM32_UART_NO_BAUD_DELAY
-    /* Indicate the module is receiving and start the delay. */
-    s->receiving = true;
-    timer_mod(s->rx_timer,  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->ns_per_char);
+    if (!s->no_baud_delay) {
+        /* Indicate the module is receiving and start the delay. */
+        s->receiving = true;
+        timer_mod(s->rx_timer,  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->ns_per_char);
+    }
 #endif
 }
 
+/* Without baud delays, the DMA reads DR from within update_irq and that read
+ * lands back here for the next byte; drain in a loop rather than recursing
+ * once per byte. */
+static void stm32_uart_fill_receive_data_register(Stm32Uart *s)
+{
+    if (s->filling) {
+        s->refill = true;
+        return;
+    }
+    s->filling = true;
+    do {
+        s->refill = false;
+        stm32_uart_fill_one(s);
+    } while (s->refill);
+    s->filling = false;
+}
+
 
 
 /* TIMER HANDLERS */
@@ -287,6 +345,25 @@ static void stm32_uart_receive(void *opaque, const uint8_t *buf, int size)
     stm32_uart_fill_receive_data_register(s);
 }
 
+void stm32_uart_set_peer(Stm32Uart *s, void (*ready)(void *opaque), void *opaque)
+{
+    s->peer_ready = ready;
+    s->peer_opaque = opaque;
+    s->no_baud_delay = true;
+}
+
+int stm32_uart_rx_space(Stm32Uart *s)
+{
+    return stm32_uart_can_receive(s);
+}
+
+void stm32_uart_rx_bulk(Stm32Uart *s, const uint8_t *buf, int size)
+{
+    if (size > 0) {
+        stm32_uart_receive(s, buf, size);
+    }
+}
+
 /* REGISTER IMPLEMENTATION */
 
 static void stm32_uart_USART_DR_read(Stm32Uart *s, uint8_t *data_read)
@@ -324,7 +401,7 @@ static void stm32_uart_USART_DR_read(Stm32Uart *s, uint8_t *data_read)
         s->defs.DR.DR = 0; // Clear value.
     }
 
-    qemu_chr_fe_accept_input(&s->chr);
+    stm32_uart_accept_input(s);
     stm32_uart_update_irq(s);
 }
 
@@ -408,7 +485,7 @@ static uint64_t stm32_uart_read(void *opaque, hwaddr addr,
             if(s->defs.SR.ORE) {
                 s->sr_read_since_ore_set = true;
             }
-            qemu_chr_fe_accept_input(&s->chr);
+            stm32_uart_accept_input(s);
             break;
         case USART_DR_OFFSET:
             {
@@ -457,8 +534,12 @@ static void stm32_uart_write(void *opaque, hwaddr addr,
         abort();
     }
 
-    if (s->stm32_rcc)
-        stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph);
+    /* A write to a gated USART has no effect on real hardware. */
+    if (s->stm32_rcc && !stm32_rcc_check_periph_clk(s->stm32_rcc, s->periph)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "USART write to 0x%x ignored, its clock is disabled\n",
+            (unsigned int)addr << 2);
+        return;
+    }
 
     switch (addr) {
         case USART_SR_OFFSET:
@@ -512,7 +593,6 @@ static void stm32_uart_rx_wrapper(void *opaque, int n, int level)
 
 static void stm32_uart_init(Object *obj)
 {
-    qemu_irq *clk_irq;
     Stm32Uart *s = STM32_UART(obj);
 
     // s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
@@ -534,12 +614,6 @@ static void stm32_uart_init(Object *obj)
         timer_new_ns(QEMU_CLOCK_VIRTUAL,
                   (QEMUTimerCB *)stm32_uart_tx_timer_expire, s);
 
-    /* Register handlers to handle updates to the USART's peripheral clock. */
-    clk_irq =
-          qemu_allocate_irqs(stm32_uart_clk_irq_handler, (void *)s, 1);
-    if (s->stm32_rcc)
-        stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
-
     //stm32_uart_connect(s, &s->chr);
 
     s->rcv_char_bytes = 0;
@@ -550,6 +624,15 @@ static void stm32_uart_init(Object *obj)
 static void stm32_uart_realize(DeviceState *dev, Error **errp)
 {
     Stm32Uart *s = STM32_UART(dev);
+
+    /* Register handlers to handle updates to the USART's peripheral clock.
+     * The SoC only hands us the RCC after init, so this can't go there. */
+    if (s->stm32_rcc) {
+        stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph,
+            qemu_allocate_irq(stm32_uart_clk_irq_handler, s, 0));
+        stm32_uart_baud_update(s);
+    }
+
     qemu_chr_fe_set_handlers(&s->chr, stm32_uart_can_receive, stm32_uart_receive, NULL,
             NULL,s,NULL,true);
     qemu_chr_fe_set_echo(&s->chr, true);
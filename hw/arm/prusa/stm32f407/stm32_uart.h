@@ -161,8 +161,24 @@ struct Stm32Uart {
     uint32_t rcv_char_bytes;    /* number of bytes avaialable in rcv_char_buf */
 
     CharBackend chr;
+
+    /* On-board peer that moves whole frames instead of single bytes,
+     * called whenever rcv_char_buf has room again. */
+    void (*peer_ready)(void *opaque);
+    void *peer_opaque;
+    bool no_baud_delay;
+
+    /* Guards against a DMA read of DR re-entering the RDR fill. */
+    bool filling;
+    bool refill;
 };
 
 void stm32_uart_connect(Stm32Uart *s, CharBackend *chr);
 
+/* Attaches an on-board peripheral that feeds the receiver in bulk. The
+ * USART then moves characters without per-character baud delays. */
+void stm32_uart_set_peer(Stm32Uart *s, void (*ready)(void *opaque), void *opaque);
+int stm32_uart_rx_space(Stm32Uart *s);
+void stm32_uart_rx_bulk(Stm32Uart *s, const uint8_t *buf, int size);
+
 #endif // STM32_UART_H
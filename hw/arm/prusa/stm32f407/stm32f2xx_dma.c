@@ -26,6 +26,8 @@
  */
 
 #include "stm32f2xx_dma.h"
+#include "stm32f4xx_spi.h"
+#include "exec/address-spaces.h"
 #include "migration/vmstate.h"
 #include "qemu/log.h"
 
@@ -140,24 +142,77 @@ f2xx_dma_read(void *arg, hwaddr addr, unsigned int size)
     return result;
 }
 
-static void set_DMAR_map(hwaddr src, f2xx_dma_stream *s)
+// USART receive requests (RM0090 tables 42/43): DR address, the streams
+// that can serve it and the channel it is on. UART7/8 only exist on DMA1.
+static const struct {
+    uint32_t dr;
+    uint8_t usart;
+    uint8_t streams;
+    uint8_t channel;
+} dmar_map[] = {
+    { 0x40011004, 1, (1<<2) | (1<<5), 4 },  // USART1, DMA2
+    { 0x40004404, 2, (1<<5),          4 },  // USART2, DMA1
+    { 0x40004804, 3, (1<<1),          4 },  // USART3, DMA1
+    { 0x40004C04, 4, (1<<2),          4 },  // UART4, DMA1
+    { 0x40005004, 5, (1<<0),          4 },  // UART5, DMA1
+    { 0x40011404, 6, (1<<1) | (1<<2), 5 },  // USART6, DMA2
+    { 0x40007804, 7, (1<<3),          5 },  // UART7, DMA1
+    { 0x40007C04, 8, (1<<6),          5 },  // UART8, DMA1
+};
+
+static void set_DMAR_map(hwaddr src, f2xx_dma_stream *s, int stream_no)
 {
-    switch (src)
-    {
-        case 0x40011004: // USART1
-            s->usart_dmar = 1;
-            break;
-        case 0x40004404: // USART2
-            s->usart_dmar = 2;
-            break;
-        case 0x40011404: // USART6
-            s->usart_dmar = 6;
-            break;
-        default:
-            printf("FIXME: Unknown DMAR source %08lx\n",src);
-            s->usart_dmar = -1;
+    int channel = (s->cr & R_DMA_SxCR_CHSEL) >> R_DMA_SxCR_CHSEL_SHIFT;
+    s->usart_dmar = -1;
+    for (int i = 0; i < ARRAY_SIZE(dmar_map); i++) {
+        if (dmar_map[i].dr != src) {
+            continue;
+        }
+        if (!(dmar_map[i].streams & (1 << stream_no)) || dmar_map[i].channel != channel) {
+            qemu_log_mask(LOG_GUEST_ERROR, "f2xx dma: USART%d RX is not on stream %d channel %d\n",
+                dmar_map[i].usart, stream_no, channel);
+            return;
+        }
+        s->usart_dmar = dmar_map[i].usart;
+        return;
     }
+    printf("FIXME: Unknown DMAR source %08lx\n",src);
+}
 
+// Byte-wide memory-to-SPI transfers (display, flash) go to the SPI as one
+// block, so the selected slave can take the whole buffer in a single call.
+static bool f2xx_dma_spi_tx(f2xx_dma_stream *s, f2xx_dma_current_xfer *x)
+{
+    MemoryRegionSection sec;
+    Object *spi;
+    bool done = false;
+
+    if (x->srcsize != 1 || x->destsize != 1 || x->destinc || !s->ndtr) {
+        return false;
+    }
+    sec = memory_region_find(get_system_memory(), x->dest, 1);
+    if (!sec.mr) {
+        return false;
+    }
+    spi = object_dynamic_cast(sec.mr->owner, TYPE_STM32F4XX_SPI);
+    if (spi) {
+        uint8_t *buf = g_malloc(s->ndtr);
+        if (x->srcinc) {
+            cpu_physical_memory_read(x->src, buf, s->ndtr);
+        } else {
+            cpu_physical_memory_read(x->src, buf, 1);
+            memset(buf, buf[0], s->ndtr);
+        }
+        done = stm32f4xx_spi_dma_tx(STM32F4XX_SPI(spi),
+                    sec.offset_within_region, buf, s->ndtr);
+        g_free(buf);
+    }
+    memory_region_unref(sec.mr);
+    if (done) {
+        x->src += x->srcinc * s->ndtr;
+        s->ndtr = 0;
+    }
+    return done;
 }
 
 /* Start a DMA transfer for a given stream. */
@@ -221,18 +276,19 @@ f2xx_dma_stream_start(f2xx_dma_stream *s, int stream_no)
     // If the transfer is perhph to memory, then start teh transfer timer. 
     if (dir==0)
     {
-        set_DMAR_map(s->par, s);
+        set_DMAR_map(s->par, s, stream_no);
         // printf("Routing usart %d to stream %d -  \n", s->usart_dmar, stream_no);
       //  timer_mod(s->rx_timer,  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 10000);
         return;
     }
     // printf("DMA %d :Transferring %d bytes from %08x to %08x\n", stream_no, s->ndtr, x->src, x->dest);
-    while (s->ndtr--) {
-        cpu_physical_memory_read(x->src, buf, x->srcsize);
-        cpu_physical_memory_write(x->dest, buf, x->destsize);
-        x->src += x->srcinc;
-        x->dest += x->destinc;
-
+    if (!f2xx_dma_spi_tx(s, x)) {
+        while (s->ndtr--) {
+            cpu_physical_memory_read(x->src, buf, x->srcsize);
+            cpu_physical_memory_write(x->dest, buf, x->destsize);
+            x->src += x->srcinc;
+            x->dest += x->destinc;
+        }
     }
     /* Transfer complete. */
     s->cr &= ~R_DMA_SxCR_EN;
@@ -554,7 +610,7 @@ f2xx_dma_init(Object *obj)
     memory_region_init_io(&s->iomem, obj, &f2xx_dma_ops, s, "dma", 0x400);
     sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->iomem);
 
-    qdev_init_gpio_in_named(DEVICE(obj),f2xx_dma_usart_dmar,"usart-dmar",7);
+    qdev_init_gpio_in_named(DEVICE(obj),f2xx_dma_usart_dmar,"usart-dmar",F2XX_DMA_NUM_USARTS);
 
     for (i = 0; i < R_DMA_Sx_COUNT; i++) {
         sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->stream[i].irq);
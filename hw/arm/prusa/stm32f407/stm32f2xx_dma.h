@@ -59,6 +59,8 @@
 #define R_DMA_SxCR_CIRC      (1<<8)
 #define R_DMA_SxCR_PINC      (1<<9)
 #define R_DMA_SxCR_MINC      (1<<10)
+#define R_DMA_SxCR_CHSEL_SHIFT (25)
+#define R_DMA_SxCR_CHSEL     (7<<R_DMA_SxCR_CHSEL_SHIFT)
 
 #define R_DMA_SxNDTR         (0x04 / 4)
 #define R_DMA_SxNDTR_EN 0x00000001
@@ -68,6 +70,9 @@
 #define R_DMA_SxFCR          (0x14 / 4)
 
 #define R_DMA_MAX            (0xd0 / 4)
+
+// "usart-dmar" inputs, USART1 through UART8.
+#define F2XX_DMA_NUM_USARTS 8
  
 
 // Stores the active transfer, absracting the direction.
@@ -24,8 +24,15 @@
 
 
 #include "stm32f2xx_pwr.h"
+#include "stm32f2xx_rcc.h"
+#include "stm32f407_exti.h"
 #include "migration/vmstate.h"
+#include "qapi/error.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "sysemu/runstate.h"
+#include "hw/core/cpu.h"
+#include "cpu.h"
 
 //#define DEBUG_STM32F2XX_PWR
 #ifdef DEBUG_STM32F2XX_PWR
@@ -94,7 +101,19 @@ f2xx_pwr_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
 
     switch(addr) {
     case R_PWR_CR:
+        // CWUF and CSBF clear their CSR flag and always read back as zero.
+        if (data & R_PWR_CR_CWUF) {
+            s->regs[R_PWR_CSR] &= ~R_PWR_CSR_WUF;
+        }
+        if (data & R_PWR_CR_CSBF) {
+            s->regs[R_PWR_CSR] &= ~R_PWR_CSR_SBF;
+        }
+        data &= ~(R_PWR_CR_CWUF | R_PWR_CR_CSBF);
+        break;
     case R_PWR_CSR:
+        // WUF and SBF are read-only.
+        data = (data & ~(R_PWR_CSR_WUF | R_PWR_CSR_SBF)) |
+            (s->regs[R_PWR_CSR] & (R_PWR_CSR_WUF | R_PWR_CSR_SBF));
         break;
     default:
         qemu_log_mask(LOG_UNIMP, "f2xx pwr unimplemented write 0x%x+%u size %u val 0x%x\n",
@@ -115,23 +134,98 @@ static const MemoryRegionOps f2xx_pwr_ops = {
     }
 };
 
+// power_state belongs to the vCPU thread. Queued work runs there before the
+// core can leave its halt, so an OFF queued from WFI always lands first.
+static void f2xx_pwr_set_power_state(CPUState *cs, run_on_cpu_data data)
+{
+    ARM_CPU(cs)->power_state = data.host_int;
+}
+
+// Finishes entering or leaving deep sleep once it's safe to touch the clocks.
+static void f2xx_pwr_bh(void *opaque)
+{
+    f2xx_pwr *s = opaque;
+
+    if (s->mode != PWR_MODE_RUN) {
+        if (!s->clocks_stopped) {
+            DPRINTF("entering %s\n", s->mode == PWR_MODE_STOP ? "stop" : "standby");
+            stm32f2xx_rcc_set_stop_mode(s->rcc, true);
+            s->clocks_stopped = true;
+        }
+        return;
+    }
+    // Woken, possibly before the clocks were even stopped.
+    if (s->clocks_stopped) {
+        DPRINTF("leaving stop\n");
+        stm32f2xx_rcc_set_stop_mode(s->rcc, false);
+        s->clocks_stopped = false;
+    }
+    async_run_on_cpu(s->cpu, f2xx_pwr_set_power_state, RUN_ON_CPU_HOST_INT(PSCI_ON));
+}
+
+// The core executed WFI with SLEEPDEEP set. PDDS picks standby over stop.
+// Plain WFI sleep needs nothing from us: the core halts until any interrupt,
+// and peripherals keep their clocks.
+static void f2xx_pwr_sleepdeep(void *opaque, int n, int level)
+{
+    f2xx_pwr *s = opaque;
+
+    if (!level || s->mode != PWR_MODE_RUN) {
+        return;
+    }
+    s->mode = (s->regs[R_PWR_CR] & R_PWR_CR_PDDS) ? PWR_MODE_STANDBY : PWR_MODE_STOP;
+    // Like the Cortex-M wakeup controller, keep the core asleep through any
+    // interrupt that isn't a wakeup source (SysTick, for one).
+    async_run_on_cpu(s->cpu, f2xx_pwr_set_power_state, RUN_ON_CPU_HOST_INT(PSCI_OFF));
+    qemu_bh_schedule(s->bh);
+}
+
+// An unmasked EXTI line fired.
+static void f2xx_pwr_wakeup(void *opaque, int n, int level)
+{
+    f2xx_pwr *s = opaque;
 
-// Return true if we should go into standby mode when the process goes into deepsleep.
-// deepsleep is entered if the SLEEPDEEP bit is set in the SCR register when the processor
-// executes a WFI instruction.
-// bool f2xx_pwr_powerdown_deepsleep(void *opaqe)
-// {
-//     f2xx_pwr *s = opaqe;
-//     return s->regs[R_PWR_CR] & R_PWR_CR_PDDS;
-// }
+    if (!level) {
+        return;
+    }
+    switch (s->mode) {
+    case PWR_MODE_STOP:
+        s->mode = PWR_MODE_RUN;
+        qemu_bh_schedule(s->bh);
+        break;
+    case PWR_MODE_STANDBY:
+        // Standby loses everything but the backup domain; waking is a reset.
+        if (PWR_STANDBY_WAKEUP_LINES & (1U << n)) {
+            DPRINTF("standby wakeup on EXTI%d\n", n);
+            s->regs[R_PWR_CSR] |= R_PWR_CSR_WUF | R_PWR_CSR_SBF;
+            qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
+        }
+        break;
+    default:
+        break;
+    }
+}
 
 static void f2xx_pwr_reset(DeviceState *dev)
 {
     f2xx_pwr *s = STM32F2XX_PWR(dev);
+    // The flags live in the standby domain and survive anything but power-on.
+    uint32_t flags = s->regs[R_PWR_CSR] & (R_PWR_CSR_WUF | R_PWR_CSR_SBF);
 
     memset(s->regs, 0, sizeof(s->regs));
+    s->regs[R_PWR_CSR] = flags;
+    s->mode = PWR_MODE_RUN;
+    s->clocks_stopped = false;
 }
 
+static void f2xx_pwr_realize(DeviceState *dev, Error **errp)
+{
+    f2xx_pwr *s = STM32F2XX_PWR(dev);
+
+    if (!s->rcc || !s->cpu) {
+        error_setg(errp, "stm32f2xx-pwr: RCC and CPU must be set before realize");
+    }
+}
 
 static void
 f2xx_pwr_init(Object *obj)
@@ -143,14 +237,20 @@ f2xx_pwr_init(Object *obj)
 
     s->regs[R_PWR_CR] = 0;
     s->regs[R_PWR_CSR] = 0;
+
+    s->bh = qemu_bh_new(f2xx_pwr_bh, s);
+    qdev_init_gpio_in_named(DEVICE(obj), f2xx_pwr_sleepdeep, "sleepdeep", 1);
+    qdev_init_gpio_in_named(DEVICE(obj), f2xx_pwr_wakeup, "wakeup", F407_EXTI_NUM_LINES);
 }
 
 static const VMStateDescription vmstate_stm32f2xx_pwr = {
     .name = TYPE_STM32F2XX_PWR,
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32_ARRAY(regs, f2xx_pwr,R_PWR_MAX),
+        VMSTATE_UINT8_V(mode, f2xx_pwr, 2),
+        VMSTATE_BOOL_V(clocks_stopped, f2xx_pwr, 2),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -160,6 +260,7 @@ f2xx_pwr_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->reset = f2xx_pwr_reset;
+    dc->realize = f2xx_pwr_realize;
     dc->vmsd = &vmstate_stm32f2xx_pwr;
 }
 
@@ -32,19 +32,45 @@
 #define R_PWR_CR      (0x00/4)
 #define R_PWR_CR_LPDS   0x00000001
 #define R_PWR_CR_PDDS   0x00000002
+#define R_PWR_CR_CWUF   0x00000004
+#define R_PWR_CR_CSBF   0x00000008
 
 #define R_PWR_CSR     (0x04/4)
+#define R_PWR_CSR_WUF   0x00000001
+#define R_PWR_CSR_SBF   0x00000002
 
 #define R_PWR_MAX     (0x08/4)
 
+// EXTI lines that can also bring the chip out of standby:
+// RTC alarm, RTC tamper/timestamp and RTC wakeup.
+#define PWR_STANDBY_WAKEUP_LINES ((1U << 17) | (1U << 21) | (1U << 22))
+
 #define TYPE_STM32F2XX_PWR "stm32f2xx-pwr"
 OBJECT_DECLARE_SIMPLE_TYPE(f2xx_pwr, STM32F2XX_PWR);
 
+enum {
+    PWR_MODE_RUN,
+    PWR_MODE_STOP,
+    PWR_MODE_STANDBY,
+};
+
+struct Stm32f2xxRcc;
+
 typedef struct f2xx_pwr {
     SysBusDevice  busdev;
     MemoryRegion  iomem;
 
     uint32_t      regs[R_PWR_MAX];
+
+    // Set by the SoC before realize.
+    struct Stm32f2xxRcc *rcc;
+    CPUState *cpu;
+
+    uint8_t       mode;
+    bool          clocks_stopped;
+    // Clocks can't be touched from the WFI that enters deep sleep, so
+    // both entering and leaving it are finished from here.
+    QEMUBH        *bh;
 } f2xx_pwr;
 
 #endif //STM32F2XX_PWR_H
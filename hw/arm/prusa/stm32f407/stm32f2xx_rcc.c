@@ -955,6 +955,23 @@ static void stm32_rcc_reset(DeviceState *dev)
     stm32_rcc_RCC_CSR_write(s, RCC_CSR_RESET_VALUE, true);
 }
 
+/* STOP mode halts every oscillator in the 1.2V domain; only LSE/LSI keep
+ * running. On the way out the HSI is restarted and selected as SYSCLK, and
+ * the PLL and HSE stay off until the firmware turns them back on. */
+void stm32f2xx_rcc_set_stop_mode(Stm32f2xxRcc *s, bool stop)
+{
+    if (stop) {
+        clktree_set_enabled(&s->PLLI2SCLK, false);
+        clktree_set_enabled(&s->PLLCLK, false);
+        clktree_set_enabled(&s->HSECLK, false);
+        clktree_set_enabled(&s->HSICLK, false);
+    } else {
+        clktree_set_enabled(&s->HSICLK, true);
+        s->RCC_CFGR_SW = SW_HSI_SELECTED;
+        clktree_set_selected_input(&s->SYSCLK, SW_HSI_SELECTED);
+    }
+}
+
 /* IRQ handler to handle updates to the HCLK frequency.
  * This updates the SysTick scales. */
 static void stm32_rcc_hclk_upd_irq_handler(void *opaque, int n, int level)
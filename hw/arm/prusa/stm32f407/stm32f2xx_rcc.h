@@ -94,3 +94,6 @@ typedef struct Stm32f2xxRcc {
     qemu_irq reset[STM32_PERIPH_COUNT];
 
 } Stm32f2xxRcc;
+
+/* Stops the main oscillators for STOP mode, or restarts on HSI afterwards. */
+void stm32f2xx_rcc_set_stop_mode(Stm32f2xxRcc *s, bool stop);
@@ -24,7 +24,6 @@
  * QEMU stm32f2xx RTC emulation
  */
 #include "stm32f2xx_rtc.h"
-#include <sys/time.h>
 #include "qemu-common.h"
 #include "migration/vmstate.h"
 #include "hw/sysbus.h"
@@ -33,6 +32,7 @@
 #include "hw/irq.h"
 #include "qemu/bcd.h"
 #include "qemu/cutils.h"
+#include "sysemu/sysemu.h"
 
 //#include "hw/arm/stm32.h"
 
@@ -51,6 +51,15 @@
 static void f2xx_update_current_date_and_time(void *arg);
 
 
+// Current time of the clock backing the RTC in microseconds. This follows
+// -rtc clock=host|rt|vm, so with clock=vm the RTC only sees virtual time.
+static int64_t
+f2xx_rtc_clock_us(void)
+{
+    return qemu_clock_get_us(rtc_clock);
+}
+
+
 // Compute the period for the clock (seconds increments) in nanoseconds
 static uint64_t
 f2xx_clock_period_ns(f2xx_rtc *s)
@@ -129,10 +138,8 @@ static time_t
 f2xx_rtc_compute_target_time_from_host_time(f2xx_rtc *s, uint64_t rtc_period_ns,
                                             struct tm *target_tm)
 {
-    // Get the host time in microseconds
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    int64_t host_time_us = tv.tv_sec * 1000000LL + (tv.tv_usec);
+    // Get the RTC reference time in microseconds
+    int64_t host_time_us = f2xx_rtc_clock_us();
 
     // Compute the target time by adding the offset
     int64_t target_time_us = host_time_us + s->host_to_target_offset_us;
@@ -190,10 +197,8 @@ f2xx_rtc_compute_host_to_target_offset(f2xx_rtc *s, int64_t period_ns, time_t ta
     // Convert target ticks to real clock microseconds
     int64_t target_time_us = target_ticks * period_ns / 1000;
 
-    // Get the host time in microseconds
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    int64_t host_time_us = tv.tv_sec * 1000000LL + (tv.tv_usec);
+    // Get the RTC reference time in microseconds
+    int64_t host_time_us = f2xx_rtc_clock_us();
 
     // Get the host to target offset in micro seconds
     return target_time_us - host_time_us;
@@ -243,9 +248,7 @@ f2xx_rtc_read(void *arg, hwaddr addr, unsigned int size)
         uint64_t full_cycle_us = f2xx_clock_period_ns(s) / 1000;
 
         // What fraction of a full cycle are we in?
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        int64_t host_time_us = tv.tv_sec * 1000000LL + (tv.tv_usec);
+        int64_t host_time_us = f2xx_rtc_clock_us();
         host_time_us += s->host_to_target_offset_us;
 
         int64_t host_mod = host_time_us % full_cycle_us;
@@ -393,7 +396,7 @@ f2xx_rtc_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
         if (s->regs[R_RTC_CR] & R_RTC_CR_WUTE) {
             int64_t elapsed = f2xx_wut_period_ns(s, s->regs[R_RTC_WUTR]);
             DPRINTF("%s: scheduling WUT to fire in %f ms\n", __func__, (float)elapsed/1000000.0);
-            timer_mod(s->wu_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + elapsed);
+            timer_mod(s->wu_timer, qemu_clock_get_ns(rtc_clock) + elapsed);
         } else {
             DPRINTF("%s: Cancelling WUT\n", __func__);
             qemu_set_irq(s->wut_irq, 0);
@@ -490,7 +493,7 @@ f2xx_update_current_date_and_time(void *arg)
     }
 
     // Reschedule tick timer to run one tick from now to check for alarms again
-    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_HOST) + period_ns);
+    timer_mod(s->timer, qemu_clock_get_ns(rtc_clock) + period_ns);
 }
 
 
@@ -531,7 +534,7 @@ f2xx_wu_timer(void *arg)
 
     // Reschedule again
     int64_t elapsed = f2xx_wut_period_ns(s, s->regs[R_RTC_WUTR]);
-    timer_mod(s->wu_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + elapsed);
+    timer_mod(s->wu_timer, qemu_clock_get_ns(rtc_clock) + elapsed);
 }
 
 
@@ -596,10 +599,10 @@ f2xx_rtc_init(Object *obj)
     s->host_to_target_offset_us = f2xx_rtc_compute_host_to_target_offset(s,
                                         f2xx_clock_period_ns(s), s->ticks);
 
-    s->timer = timer_new_ns(QEMU_CLOCK_HOST, f2xx_timer, s);
-    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_HOST) + period_ns);
+    s->timer = timer_new_ns(rtc_clock, f2xx_timer, s);
+    timer_mod(s->timer, qemu_clock_get_ns(rtc_clock) + period_ns);
 
-    s->wu_timer = timer_new_ns(QEMU_CLOCK_REALTIME, f2xx_wu_timer, s);
+    s->wu_timer = timer_new_ns(rtc_clock, f2xx_wu_timer, s);
 }
 
 static const VMStateDescription vmstate_stm32f2xx_rtc = {
@@ -88,13 +88,10 @@ static const char *f2xx_tim_reg_names[] = {
 static uint32_t
 f2xx_tim_period(f2xx_tim *s)
 {
-    
-    uint64_t clock_freq = 84000000UL; // APB2 @ 84 Mhz
-    if (s->rcc!=NULL) {
-        clock_freq = stm32_rcc_get_periph_freq(s->rcc, s->periph);
-
+    uint64_t clock_freq = s->clock_freq / (s->defs.PSC+1);
+    if (clock_freq == 0) {
+        return 0;
     }
-    clock_freq/= (s->defs.PSC+1);
     uint32_t interval = 1000000000UL/clock_freq;
     return interval;
 
@@ -102,10 +99,16 @@ f2xx_tim_period(f2xx_tim *s)
 
 static inline int64_t f2xx_tim_ns_to_ticks(f2xx_tim *s, int64_t t)
 {
-    uint64_t clock_freq = stm32_rcc_get_periph_freq(s->rcc, s->periph);
-    return muldiv64(t, clock_freq, 1000000000ULL) / (s->defs.PSC + 1);
+    return muldiv64(t, s->clock_freq, 1000000000ULL) / (s->defs.PSC + 1);
 }
 
+static uint32_t f2xx_tim_get_count(f2xx_tim *s)
+{
+    if (s->clock_freq == 0) {
+        return s->frozen_count;
+    }
+    return f2xx_tim_ns_to_ticks(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)) - s->count_timebase;
+}
 
 static int64_t
 f2xx_tim_next_transition(f2xx_tim *s, int64_t current_time)
@@ -140,6 +143,36 @@ f2xx_tim_timer(void *arg)
 }
 
 
+/*
+ * The RCC gated or re-clocked the timer. While gated the counter holds its
+ * value and no update events are scheduled; on the way back it carries on
+ * from where it stopped, at the new rate.
+ */
+static void f2xx_tim_clk_irq_handler(void *opaque, int n, int level)
+{
+    f2xx_tim *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t count = f2xx_tim_get_count(s);
+    uint32_t freq = stm32_rcc_get_periph_freq(s->rcc, s->periph);
+
+    if (freq == s->clock_freq) {
+        return;
+    }
+    s->clock_freq = freq;
+    if (freq == 0) {
+        s->frozen_count = count;
+        timer_del(s->timer);
+        return;
+    }
+    if (count > s->defs.ARR) {
+        count = 0;
+    }
+    s->count_timebase = f2xx_tim_ns_to_ticks(s, now) - count;
+    if (s->defs.CR1.CEN) {
+        timer_mod(s->timer, now + (int64_t)f2xx_tim_period(s) * (s->defs.ARR + 1 - count));
+    }
+}
+
 static uint64_t
 f2xx_tim_read(void *arg, hwaddr addr, unsigned int size)
 {
@@ -160,7 +193,7 @@ f2xx_tim_read(void *arg, hwaddr addr, unsigned int size)
     case R_TIM_SR:
         break;
     case R_TIM_CNT:
-        r = f2xx_tim_ns_to_ticks(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)) - s->count_timebase; 
+        r = f2xx_tim_get_count(s);
         // printf("Attempted to read count on timer %u (val %u)\n", s->id,r);
     default:
         qemu_log_mask(LOG_UNIMP, "f2xx tim unimplemented read 0x%x+%u size %u val 0x%x\n",
@@ -233,6 +266,12 @@ f2xx_tim_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
           (unsigned int)addr << 2);
         return;
     }
+    if (s->clock_freq == 0) {
+        // Writes to a gated peripheral have no effect on real hardware.
+        qemu_log_mask(LOG_GUEST_ERROR, "f2xx tim %u write to 0x%x while its clock is disabled\n",
+          s->id, (unsigned int)addr << 2);
+        return;
+    }
 
     switch(size) {
     case 1:
@@ -368,6 +407,7 @@ static void f2xx_tim_reset(DeviceState *dev)
     f2xx_tim *s = STM32F4XX_TIMER(dev);
     timer_del(s->timer);
     memset(&s->regs, 0, sizeof(s->regs));
+    s->frozen_count = 0;
     s->count_timebase = f2xx_tim_ns_to_ticks(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
 }
 
@@ -409,9 +449,21 @@ f2xx_tim_init(Object *obj)
     qdev_init_gpio_out_named(DEVICE(dev), s->pwm_enable, "pwm_enable", 4);
 }
 
+static void
+f2xx_tim_realize(DeviceState *dev, Error **errp)
+{
+    f2xx_tim *s = STM32F4XX_TIMER(dev);
+    s->clock_freq = 84000000UL; // APB2 @ 84 Mhz if nobody tells us otherwise.
+    if (s->rcc!=NULL) {
+        s->clock_freq = stm32_rcc_get_periph_freq(s->rcc, s->periph);
+        stm32_rcc_set_periph_clk_irq(s->rcc, s->periph,
+            qemu_allocate_irq(f2xx_tim_clk_irq_handler, s, 0));
+    }
+}
+
 static const VMStateDescription vmstate_stm32f2xx_tim = {
     .name = TYPE_STM32F4XX_TIMER,
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .fields = (VMStateField[]) {
         VMSTATE_TIMER_PTR(timer,f2xx_tim),
@@ -419,6 +471,8 @@ static const VMStateDescription vmstate_stm32f2xx_tim = {
         VMSTATE_UINT8(id,f2xx_tim),
         VMSTATE_INT64(count_timebase,f2xx_tim),
         VMSTATE_INT32(periph,f2xx_tim),
+        VMSTATE_UINT32_V(clock_freq,f2xx_tim,2),
+        VMSTATE_UINT32_V(frozen_count,f2xx_tim,2),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -428,6 +482,7 @@ f2xx_tim_class_init(ObjectClass *klass, void *data)
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->vmsd = &vmstate_stm32f2xx_tim;
     dc->reset = f2xx_tim_reset;
+    dc->realize = f2xx_tim_realize;
 
 }
 
@@ -211,6 +211,10 @@ struct f2xx_tim {
     qemu_irq pwm_enable[4], pwm_pin[4];
 
     int64_t count_timebase;
+    // Input clock as last reported by the RCC; 0 while gated off.
+    uint32_t clock_freq;
+    // CNT held while the clock is gated.
+    uint32_t frozen_count;
 
     stm32_periph_t periph;
     Stm32Rcc *rcc; // RCC for clock speed. 
@@ -28,17 +28,18 @@
 #include "qemu-common.h"
 #include "exec/address-spaces.h"
 #include "sysemu/sysemu.h"
+#include "hw/core/cpu.h"
 #include "stm32f407_soc.h"
 #include "hw/misc/unimp.h"
 #include "net/net.h"
+#include "chardev/char.h"
 #include "hw/i2c/smbus_eeprom.h"
 #include "exec/ramblock.h"
 #define SYSCFG_ADD                     0x40013800
 static const uint32_t usart_addr[] = { 0x40011000, 0x40004400, 0x40004800,
                                        0x40004C00, 0x40005000, 0x40011400,
                                        0x40007800, 0x40007C00 };
-static const uint32_t adc_addr[] = { 0x40012000, 0x40012100, 0x40012200,
-                                     0x40012300, 0x40012400, 0x40012500 };
+static const uint32_t adc_addr[] = { 0x40012000, 0x40012100, 0x40012200 };
 static const uint32_t spi_addr[] =   { 0x40013000, 0x40003800, 0x40003C00,
                                        0x40013400, 0x40015000, 0x40015400 };
 #define EXTI_ADDR                      0x40013C00
@@ -73,10 +74,13 @@ uint32_t gpio_idr_masks[STM_NUM_GPIOS];
     };
 
 #define SYSCFG_IRQ               71
+#define TAMP_STAMP_IRQ           2
+#define RTC_WKUP_IRQ             3
+#define RTC_ALARM_IRQ            41
 static const int usart_irq[] = { 37, 38, 39, 52, 53, 71, 82, 83 };
 // static const int timer_irq[] = { 28, 29, 30, 50 };
 #define ADC_IRQ 18
-static const int spi_irq[] =   { 35, 36, 51, 0, 0, 0 };
+static const int spi_irq[] =   { 35, 36, 51, 84, 85, 86 };
 static const int exti_irq[] =  { 6, 7, 8, 9, 10, 23, 23, 23, 23, 23, 40,
                                  40, 40, 40, 40, 40} ;
 static const int i2c_ev_irq[] = { 31, 33, 72, 95};
@@ -85,6 +89,38 @@ static const int i2c_er_irq[] = { 32, 34, 73, 96};
 static const int dma1_irq[] = { 11,12,13,14,15,16,17 };
 static const int dma2_irq[] = { 56, 57, 58, 59, 60, 68, 69, 70 };
 
+static const STM32F4xxPart stm32f4xx_parts[] = {
+    // name        USARTs ADCs SPIs I2Cs GPIOs
+    { "STM32F405",   6,    3,   3,   3,   9 },
+    { "STM32F407",   6,    3,   3,   3,   9 },
+    { "STM32F415",   6,    3,   3,   3,   9 },
+    { "STM32F417",   6,    3,   3,   3,   9 },
+    { "STM32F427",   8,    3,   6,   3,  11 },
+    { "STM32F429",   8,    3,   6,   3,  11 },
+    { "STM32F437",   8,    3,   6,   3,  11 },
+    { "STM32F439",   8,    3,   6,   3,  11 },
+};
+
+static const STM32F4xxPart *stm32f4xx_find_part(const char *name)
+{
+    for (int i = 0; i < ARRAY_SIZE(stm32f4xx_parts); i++) {
+        if (g_str_has_prefix(name, stm32f4xx_parts[i].name)) {
+            return &stm32f4xx_parts[i];
+        }
+    }
+    return NULL;
+}
+
+// Blocks the part doesn't have still answer, as logged unimplemented regions.
+static void stm32f4xx_unimp_range(const char *fmt, int first, int count,
+                                  const uint32_t *addr)
+{
+    for (int i = first; i < count; i++) {
+        g_autofree char *name = g_strdup_printf(fmt, i + 1);
+        create_unimplemented_device(name, addr[i], 0x400);
+    }
+}
+
 static void stm32f407_soc_initfn(Object *obj)
 {
     STM32F407State *s = STM32F407_SOC(obj);
@@ -123,7 +159,7 @@ static void stm32f407_soc_initfn(Object *obj)
 
     object_initialize_child(obj, "rcc", &s->rcc, TYPE_STM32F2XX_RCC);
 
-    object_initialize_child(obj, "exti", &s->exti, TYPE_STM32F4XX_EXTI);
+    object_initialize_child(obj, "exti", &s->exti, TYPE_STM32F407_EXTI);
 
     object_initialize_child(obj, "rtc", &s->rtc, TYPE_STM32F2XX_RTC);
 
@@ -184,6 +220,29 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     Error *err = NULL;
     int i;
 
+    s->part = stm32f4xx_find_part(s->part_name ? s->part_name : "STM32F407");
+    if (!s->part) {
+        error_setg(errp, "stm32f407-soc: unknown part '%s'", s->part_name);
+        return;
+    }
+    // Everything was created up front for the largest part; drop what this
+    // one doesn't have before it costs MMIO, timers or vmstate.
+    for (i = s->part->num_usarts; i < STM_NUM_USARTS; i++) {
+        object_unparent(OBJECT(&s->usart[i]));
+    }
+    for (i = s->part->num_adcs; i < STM_NUM_ADCS; i++) {
+        object_unparent(OBJECT(&s->adc[i]));
+    }
+    for (i = s->part->num_spis; i < STM_NUM_SPIS; i++) {
+        object_unparent(OBJECT(&s->spi[i]));
+    }
+    for (i = s->part->num_i2cs; i < STM_NUM_I2CS; i++) {
+        object_unparent(OBJECT(&s->i2c[i]));
+    }
+    for (i = s->part->num_gpios; i < STM_NUM_GPIOS; i++) {
+        object_unparent(OBJECT(&s->gpio[i]));
+    }
+
     memory_region_init_rom(&s->flash, OBJECT(dev_soc), "STM32F407.flash",
                            FLASH_SIZE, &err);
     if (err != NULL) {
@@ -221,6 +280,15 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     if (!sysbus_realize(SYS_BUS_DEVICE(&s->armv7m), errp)) {
         return;
     }
+    if (s->canonical_flash_alias) {
+        // Code reached through the boot alias at 0 runs from the real flash
+        // address instead, so it isn't translated and cached twice. Opt-in:
+        // the guest sees the rewritten PC, e.g. in LR and stacked frames.
+        Object *cpu = OBJECT(s->armv7m.cpu);
+        object_property_set_uint(cpu, "code-alias-base", 0, &error_abort);
+        object_property_set_uint(cpu, "code-alias-size", FLASH_SIZE, &error_abort);
+        object_property_set_uint(cpu, "code-alias-target", FLASH_BASE_ADDRESS, &error_abort);
+    }
     /* System configuration controller */
     dev = DEVICE(&s->syscfg);
     if (!sysbus_realize(SYS_BUS_DEVICE(&s->syscfg), errp)) {
@@ -245,7 +313,7 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     sysbus_mmio_map(busdev, 0, 0x40023800);
     sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, STM32_RCC_IRQ));
 
-    for (i=0; i<STM_NUM_GPIOS; i++) {
+    for (i=0; i<s->part->num_gpios; i++) {
         dev = DEVICE(&(s->gpio[i]));
         qdev_prop_set_uint32(dev,"periph",i);
         qdev_prop_set_uint32(dev,"idr-mask",gpio_idr_masks[i]);
@@ -259,8 +327,13 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
 
     // TODO - Connect EXTI and WAKEUP to the GPIOs.
 
+    for (i = s->part->num_gpios; i < STM_NUM_GPIOS; i++) {
+        g_autofree char *name = g_strdup_printf("GPIO%c", 'A' + i);
+        create_unimplemented_device(name, gpio_addr[i], 0x400);
+    }
+
     /* Attach UART (uses USART registers) and USART controllers */
-    for (i = 0; i < STM_NUM_USARTS; i++) {
+    for (i = 0; i < s->part->num_usarts; i++) {
         // if (i==1) continue;
         dev = DEVICE(&(s->usart[i]));
         s->usart[i].periph = STM32_UART1+i;
@@ -339,7 +412,7 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
                                             TYPE_OR_IRQ, errp, NULL)) {
         return;
     }
-    object_property_set_int(OBJECT(&s->adc_irqs), "num-lines", STM_NUM_ADCS,
+    object_property_set_int(OBJECT(&s->adc_irqs), "num-lines", s->part->num_adcs,
                             &error_abort);
     if (!qdev_realize(DEVICE(&s->adc_irqs), NULL, errp)) {
         return;
@@ -347,7 +420,7 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     qdev_connect_gpio_out(DEVICE(&s->adc_irqs), 0,
                           qdev_get_gpio_in(armv7m, ADC_IRQ));
 
-    for (i = 0; i < STM_NUM_ADCS; i++) {
+    for (i = 0; i < s->part->num_adcs; i++) {
         dev = DEVICE(&(s->adc[i]));
         s->adc[i].id = i+1; // STM32 id, i.e. 1-based.
         if (!sysbus_realize(SYS_BUS_DEVICE(&s->adc[i]), errp)) {
@@ -360,7 +433,7 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     }
 
     /* SPI devices */
-    for (i = 0; i < STM_NUM_SPIS; i++) {
+    for (i = 0; i < s->part->num_spis; i++) {
         dev = DEVICE(&(s->spi[i]));
         if (!sysbus_realize(SYS_BUS_DEVICE(&s->spi[i]), errp)) {
             return;
@@ -371,7 +444,7 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     }
 
     /* I2C */
-    for (i = 0; i < STM_NUM_I2CS; i++) {
+    for (i = 0; i < s->part->num_i2cs; i++) {
         dev = DEVICE(&(s->i2c[i]));
         if (!sysbus_realize(SYS_BUS_DEVICE(&s->i2c[i]), errp)) {
             return;
@@ -397,7 +470,8 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
                 sysbus_connect_irq(busdev, j, qdev_get_gpio_in(armv7m, dma2_irq[j]));
         }
     }
-    for (int j=0; j<STM_NUM_USARTS; j++) // Attach the USART dmar IRQs
+    QEMU_BUILD_BUG_ON(STM_NUM_USARTS > F2XX_DMA_NUM_USARTS);
+    for (int j=0; j<s->part->num_usarts; j++) // Attach the USART dmar IRQs
     {
         qemu_irq split_usart =qemu_irq_split(
                                 qdev_get_gpio_in_named(DEVICE(&s->dma[0]), "usart-dmar",j),
@@ -416,6 +490,9 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     for (i = 0; i < 16; i++) {
         sysbus_connect_irq(busdev, i, qdev_get_gpio_in(armv7m, exti_irq[i]));
     }
+    sysbus_connect_irq(busdev, 17, qdev_get_gpio_in(armv7m, RTC_ALARM_IRQ));
+    sysbus_connect_irq(busdev, 21, qdev_get_gpio_in(armv7m, TAMP_STAMP_IRQ));
+    sysbus_connect_irq(busdev, 22, qdev_get_gpio_in(armv7m, RTC_WKUP_IRQ));
     for (i = 0; i < 16; i++) {
         qdev_connect_gpio_out(DEVICE(&s->syscfg), i, qdev_get_gpio_in(dev, i));
     }
@@ -431,12 +508,11 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
         return;
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_mmio_map(busdev, 0, 0x40023000);
-    // TODO - RTC wakeup exti
-    // sysbus_connect_irq(SYS_BUS_DEVICE(rtc_dev), 0, qdev_get_gpio_in(exti_dev, 17));
-    // // Alarm B
-    // sysbus_connect_irq(SYS_BUS_DEVICE(rtc_dev), 1, qdev_get_gpio_in(exti_dev, 17));
-    // // Wake up timer
-    // sysbus_connect_irq(SYS_BUS_DEVICE(rtc_dev), 2, qdev_get_gpio_in(exti_dev, 22));
+    // RTC alarms A and B share EXTI17, the wakeup timer is on EXTI22.
+    busdev = SYS_BUS_DEVICE(&s->rtc);
+    sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(DEVICE(&s->exti), 17));
+    sysbus_connect_irq(busdev, 1, qdev_get_gpio_in(DEVICE(&s->exti), 17));
+    sysbus_connect_irq(busdev, 2, qdev_get_gpio_in(DEVICE(&s->exti), 22));
 
     dev = DEVICE(&s->flashIF);
     if (!sysbus_realize(SYS_BUS_DEVICE(&s->flashIF),errp))
@@ -445,10 +521,18 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     sysbus_mmio_map(busdev, 0, 0x40023C00);
 
     dev = DEVICE(&s->pwr);
+    s->pwr.rcc = &s->rcc;
+    s->pwr.cpu = CPU(s->armv7m.cpu);
     if (!sysbus_realize(SYS_BUS_DEVICE(&s->pwr),errp))
         return;
     busdev = SYS_BUS_DEVICE(dev);
     sysbus_mmio_map(busdev, 0, 0x40007000);
+    qdev_connect_gpio_out_named(DEVICE(s->armv7m.cpu), "v7m-sleepdeep", 0,
+        qdev_get_gpio_in_named(dev, "sleepdeep", 0));
+    for (i = 0; i < F407_EXTI_NUM_LINES; i++) {
+        qdev_connect_gpio_out_named(DEVICE(&s->exti), "wakeup", i,
+            qdev_get_gpio_in_named(dev, "wakeup", i));
+    }
 
     s->iwdg.rcc = (Stm32Rcc*)&s->rcc;
     dev = DEVICE(&s->iwdg);
@@ -472,12 +556,18 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     sysbus_mmio_map(busdev, 0, 0xE0000000UL);
 
     // IRQs: FS wakeup: 42 FS Global: 67
+    // In device mode the CDC-ACM function the firmware presents is bridged to
+    // the "mini-usb" chardev, if there is one.
+    if (qemu_chr_find("mini-usb")!=NULL) {
+        qdev_prop_set_chr(DEVICE(&s->otg_fs), "chardev", qemu_chr_find("mini-usb"));
+    }
     if (!sysbus_realize(SYS_BUS_DEVICE(&s->otg_fs),errp))
     {
         return;
     }    
     memory_region_add_subregion(system_memory, 0x50000000UL,
         sysbus_mmio_get_region(SYS_BUS_DEVICE(&s->otg_fs), 0));
+    sysbus_connect_irq(SYS_BUS_DEVICE(&s->otg_fs), 0, qdev_get_gpio_in(armv7m, 67));
 
 
     // USB IRQs:
@@ -514,6 +604,10 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
     // create_unimplemented_device("timer[13]",   0x40001C00, 0x400);
     // create_unimplemented_device("timer[14]",   0x40002000, 0x400);
     //create_unimplemented_device("RTC and BKP", 0x40002800, 0x400);
+    stm32f4xx_unimp_range("UART%d", s->part->num_usarts, STM_NUM_USARTS, usart_addr);
+    stm32f4xx_unimp_range("ADC%d", s->part->num_adcs, STM_NUM_ADCS, adc_addr);
+    stm32f4xx_unimp_range("SPI%d", s->part->num_spis, STM_NUM_SPIS, spi_addr);
+    stm32f4xx_unimp_range("I2C%d", s->part->num_i2cs, STM_NUM_I2CS, i2c_addr);
     create_unimplemented_device("WWDG",        0x40002C00, 0x400);
     //create_unimplemented_device("IWDG",        0x40003000, 0x400);
     create_unimplemented_device("I2S2ext",     0x40003000, 0x400);
@@ -547,6 +641,8 @@ static void stm32f407_soc_realize(DeviceState *dev_soc, Error **errp)
 
 static Property stm32f407_soc_properties[] = {
     DEFINE_PROP_STRING("cpu-type", STM32F407State, cpu_type),
+    DEFINE_PROP_STRING("part", STM32F407State, part_name),
+    DEFINE_PROP_BOOL("canonical-flash-alias", STM32F407State, canonical_flash_alias, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -29,7 +29,7 @@
 #include "hw/misc/stm32f4xx_syscfg.h"
 #include "hw/timer/stm32f2xx_timer.h"
 // #include "hw/char/stm32f2xx_usart.h"
-#include "hw/misc/stm32f4xx_exti.h"
+#include "stm32f407_exti.h"
 #include "hw/or-irq.h"
 #include "stm32f4xx_adc.h"
 #include "stm32f2xx_crc.h"
@@ -53,14 +53,25 @@
 #define TYPE_STM32F407_SOC "stm32f407-soc"
 OBJECT_DECLARE_SIMPLE_TYPE(STM32F407State, STM32F407_SOC)
 
-#define STM_NUM_USARTS 7
+// Upper bounds across the parts in stm32f4xx_parts[]; how many of each a
+// given part really has comes from its table entry.
+#define STM_NUM_USARTS 8
 #define STM_NUM_TIMERS 14
-#define STM_NUM_ADCS 6
+#define STM_NUM_ADCS 3
 #define STM_NUM_SPIS 6
 #define STM_NUM_I2CS 3
 #define STM_NUM_GPIOS 11
 #define STM_NUM_DMAS 2
 
+typedef struct STM32F4xxPart {
+    const char *name;   // Matched as a prefix, so "STM32F407VGT6" is an F407.
+    uint8_t num_usarts;
+    uint8_t num_adcs;
+    uint8_t num_spis;
+    uint8_t num_i2cs;
+    uint8_t num_gpios;
+} STM32F4xxPart;
+
 #define FLASH_BASE_ADDRESS 0x08000000
 #define FLASH_SIZE (1024 * 1024)
 #define SRAM_BASE_ADDRESS 0x20000000
@@ -89,11 +100,15 @@ struct STM32F407State {
     /*< public >*/
 
     char *cpu_type;
+    char *part_name;
+    const STM32F4xxPart *part;
+
+    bool canonical_flash_alias;
 
     ARMv7MState armv7m;
 
     STM32F4xxSyscfgState syscfg;
-    STM32F4xxExtiState exti;
+    STM32F407ExtiState exti;
     // STM32F2XXUsartState usart[STM_NUM_USARTS];
     Stm32Uart usart[STM_NUM_USARTS];
     #ifdef PARTIAL_TIMER
@@ -167,6 +167,37 @@ static void stm32f4xx_spi_write(void *opaque, hwaddr addr,
     }
 }
 
+bool stm32f4xx_spi_dma_tx(STM32F4XXSPIState *s, hwaddr addr,
+                          const uint8_t *buf, size_t len)
+{
+    bool lsbfirst = s->regs[R_CR1] & R_CR1_LSBFIRST;
+    uint8_t *swapped = NULL;
+    uint8_t last;
+    size_t i;
+
+    if ((addr >> 2) != R_DR || (s->regs[R_CR1] & R_CR1_DFF) || len == 0) {
+        return false;
+    }
+    if (lsbfirst) {
+        swapped = g_malloc(len);
+        for (i = 0; i < len; i++) {
+            swapped[i] = bitswap(buf[i]);
+        }
+        buf = swapped;
+    }
+    // Nothing reads DR between DMA writes, so every byte but the last
+    // is an overrun, same as writing them one by one.
+    if (len > 1 || (s->regs[R_SR] & R_SR_RXNE)) {
+        s->regs[R_SR] |= R_SR_OVR;
+    }
+    ssi_transfer_block(s->ssi, buf, NULL, len - 1);
+    last = ssi_transfer(s->ssi, buf[len - 1]);
+    s->regs[R_DR] = lsbfirst ? bitswap(last) : last;
+    s->regs[R_SR] |= R_SR_RXNE | R_SR_TXE;
+    g_free(swapped);
+    return true;
+}
+
 static const MemoryRegionOps stm32f4xx_spi_ops = {
     .read = stm32f4xx_spi_read,
     .write = stm32f4xx_spi_write,
@@ -61,4 +61,11 @@ struct STM32F4XXSPIState {
     SSIBus *ssi;
 };
 
+/* Memory-to-peripheral DMA of @len 8-bit frames to register @addr. Sends
+ * them as one SSI block and returns true if @addr is DR in 8-bit mode;
+ * otherwise does nothing and the DMA must write them one at a time.
+ */
+bool stm32f4xx_spi_dma_tx(STM32F4XXSPIState *s, hwaddr addr,
+                          const uint8_t *buf, size_t len);
+
 #endif /* HW_STM32F4XX_SPI_H */
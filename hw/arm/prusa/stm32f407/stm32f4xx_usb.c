@@ -29,6 +29,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
 #include "qapi/error.h"
 #include "hw/usb/dwc2-regs.h"
 #include "stm32f4xx_usb.h"
@@ -768,6 +769,699 @@ static void STM32F4xx_enable_chan(STM32F4xxUSBState *s,  uint32_t index)
     qemu_bh_schedule(s->async_bh);
 }
 
+/*
+ * Device mode
+ *
+ * There is no USB host on the other end of the cable, so a minimal one is
+ * built in: once the firmware connects (clears DCTL.SFTDISCON), it resets
+ * the bus, enumerates the device, picks the bulk endpoints of the CDC data
+ * interface out of the configuration descriptor and then moves whole
+ * packets between those endpoints and the chardev. OUT transfers are paced
+ * at the full-speed bit rate; IN data is taken as soon as it hits the FIFO.
+ */
+
+enum {
+    CDC_DETACHED,
+    CDC_CONNECTED,
+    CDC_RESET,
+    CDC_GET_DEVICE,
+    CDC_SET_ADDRESS,
+    CDC_GET_CONFIG_HEADER,
+    CDC_GET_CONFIG,
+    CDC_SET_CONFIG,
+    CDC_SET_LINE_CODING,
+    CDC_SET_LINE_STATE,
+    CDC_RUNNING,
+    CDC_FAILED,
+};
+
+enum {
+    CTL_IDLE,
+    CTL_DATA_IN,
+    CTL_DATA_OUT,
+    CTL_STATUS_IN,
+    CTL_STATUS_OUT,
+};
+
+#define CDC_REQ_SET_LINE_CODING         0x20
+#define CDC_REQ_SET_CONTROL_LINE_STATE  0x22
+#define CDC_DEVICE_ADDRESS              1
+
+#define CDC_CONNECT_NS      (100 * SCALE_MS)    /* Host debounce after attach */
+#define CDC_RESET_NS        (10 * SCALE_MS)     /* Bus reset length */
+#define CDC_TURNAROUND_NS   (10 * SCALE_US)
+
+static inline bool STM32F4xx_is_device(STM32F4xxUSBState *s)
+{
+    return !(s->gintsts & GINTSTS_CURMODE_HOST);
+}
+
+static uint32_t STM32F4xx_dev_ep_mps(uint32_t ctl, int ep)
+{
+    static const uint32_t ep0_mps[] = { 64, 32, 16, 8 };
+
+    if (ep == 0) {
+        return ep0_mps[ctl & 0x3];
+    }
+    return get_field(ctl, DXEPCTL_MPS);
+}
+
+/* Fold the per-endpoint interrupts into DAINT and GINTSTS */
+static void STM32F4xx_dev_update_irq(STM32F4xxUSBState *s)
+{
+    uint32_t daint = 0;
+    int ep;
+
+    for (ep = 0; ep < STM32F4xx_NB_EPS; ep++) {
+        uint32_t inmsk = s->diepmsk;
+
+        /* IN data leaves the FIFO as soon as it is written */
+        if (s->fifo_level[ep] == 0) {
+            s->diepint(ep) |= DXEPINT_TXFEMP;
+        } else {
+            s->diepint(ep) &= ~DXEPINT_TXFEMP;
+        }
+        if (s->diepempmsk & (1 << ep)) {
+            inmsk |= DXEPINT_TXFEMP;
+        }
+        if (s->diepint(ep) & inmsk) {
+            daint |= 1 << ep;
+        }
+        if (s->doepint(ep) & s->doepmsk) {
+            daint |= 1 << (ep + 16);
+        }
+    }
+    s->daint = daint;
+    daint &= s->daintmsk;
+
+    if (daint & 0xffff) {
+        s->gintsts |= GINTSTS_IEPINT;
+    } else {
+        s->gintsts &= ~GINTSTS_IEPINT;
+    }
+    if (daint >> 16) {
+        s->gintsts |= GINTSTS_OEPINT;
+    } else {
+        s->gintsts &= ~GINTSTS_OEPINT;
+    }
+    STM32F4xx_update_irq(s);
+}
+
+static void STM32F4xx_cdc_kick(STM32F4xxUSBState *s, int64_t delay)
+{
+    timer_mod_anticipate_ns(s->cdc_timer,
+                            qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + delay);
+}
+
+/* Queue a status word and its data in the Rx FIFO */
+static bool STM32F4xx_dev_rx_push(STM32F4xxUSBState *s, int ep, int pktsts,
+                                  const uint8_t *data, uint32_t len)
+{
+    uint32_t words = DIV_ROUND_UP(len, 4);
+    rxstatus_t sts = { .raw = 0 };
+    uint32_t i;
+
+    if (s->rx_fifo_level + words + 1 > STM32F4xx_RX_FIFO_SIZE) {
+        return false;
+    }
+    sts.chnum = ep;
+    sts.bcnt = len;
+    sts.pktsts = pktsts;
+    s->fifo_ram[s->rx_fifo_tail++] = sts.raw;
+    s->rx_fifo_tail %= STM32F4xx_RX_FIFO_SIZE;
+    for (i = 0; i < words; i++) {
+        uint8_t word[4] = { 0 };
+        memcpy(word, data + i * 4, MIN(4, len - i * 4));
+        s->fifo_ram[s->rx_fifo_tail++] = ldl_le_p(word);
+        s->rx_fifo_tail %= STM32F4xx_RX_FIFO_SIZE;
+    }
+    s->rx_fifo_level += words + 1;
+    STM32F4xx_raise_global_irq(s, GINTSTS_RXFLVL);
+    return true;
+}
+
+/* An OUT data packet, accounted against the endpoint's transfer size */
+static bool STM32F4xx_dev_out_packet(STM32F4xxUSBState *s, int ep,
+                                     const uint8_t *data, uint32_t len)
+{
+    uint32_t tsiz = s->doeptsiz(ep);
+    uint32_t xfer = get_field(tsiz, DXEPTSIZ_XFERSIZE);
+    uint32_t pkts = get_field(tsiz, DXEPTSIZ_PKTCNT);
+
+    if (!STM32F4xx_dev_rx_push(s, ep, GRXSTS_PKTSTS_OUTRX, data, len)) {
+        return false;
+    }
+    set_field(&tsiz, xfer - MIN(xfer, len), DXEPTSIZ_XFERSIZE);
+    set_field(&tsiz, pkts ? pkts - 1 : 0, DXEPTSIZ_PKTCNT);
+    s->doeptsiz(ep) = tsiz;
+    return true;
+}
+
+/* End an OUT transfer; the endpoint NAKs until the firmware re-arms it */
+static bool STM32F4xx_dev_out_done(STM32F4xxUSBState *s, int ep)
+{
+    if (!STM32F4xx_dev_rx_push(s, ep, GRXSTS_PKTSTS_OUTDONE, NULL, 0)) {
+        return false;
+    }
+    s->doepctl(ep) |= DXEPCTL_NAKSTS;
+    return true;
+}
+
+/*
+ * The core raises the endpoint interrupts for SETUP and OUT completion
+ * once the firmware pops the matching status entry, i.e. after it has
+ * read all the data queued ahead of it.
+ */
+static void STM32F4xx_dev_rx_popped(STM32F4xxUSBState *s, uint32_t raw)
+{
+    rxstatus_t sts = { .raw = raw };
+    int ep = sts.chnum;
+
+    if (ep >= STM32F4xx_NB_EPS) {
+        return;
+    }
+    switch (sts.pktsts) {
+    case GRXSTS_PKTSTS_SETUPDONE:
+        s->doepint(ep) |= DXEPINT_SETUP;
+        break;
+    case GRXSTS_PKTSTS_OUTDONE:
+        s->doepctl(ep) &= ~DXEPCTL_EPENA;
+        s->doepctl(ep) |= DXEPCTL_NAKSTS;
+        s->doepint(ep) |= DXEPINT_XFERCOMPL;
+        break;
+    default:
+        return;
+    }
+    STM32F4xx_dev_update_irq(s);
+}
+
+static void STM32F4xx_cdc_ctl_done(STM32F4xxUSBState *s, bool ok);
+
+static bool STM32F4xx_cdc_parse_config(STM32F4xxUSBState *s)
+{
+    const uint8_t *d = s->ctl_buf;
+    uint16_t pos = 0;
+    int cls = -1;
+
+    s->cdc_in_ep = s->cdc_out_ep = 0;
+    if (s->ctl_len < 9) {
+        return false;
+    }
+    s->cdc_config = d[5];
+    while (pos + 2 <= s->ctl_len && d[pos] >= 2 && pos + d[pos] <= s->ctl_len) {
+        const uint8_t *desc = &d[pos];
+        if (desc[1] == USB_DT_INTERFACE && desc[0] >= 9) {
+            cls = desc[5];
+            if (cls == USB_CLASS_COMM) {
+                s->cdc_comm_if = desc[2];
+            }
+        } else if (desc[1] == USB_DT_ENDPOINT && desc[0] >= 7 &&
+                   cls == USB_CLASS_CDC_DATA &&
+                   (desc[3] & 0x3) == USB_ENDPOINT_XFER_BULK) {
+            if (desc[2] & USB_DIR_IN) {
+                s->cdc_in_ep = s->cdc_in_ep ? s->cdc_in_ep : desc[2] & 0xf;
+            } else {
+                s->cdc_out_ep = s->cdc_out_ep ? s->cdc_out_ep : desc[2] & 0xf;
+            }
+        }
+        pos += desc[0];
+    }
+    return s->cdc_in_ep && s->cdc_in_ep < STM32F4xx_NB_EPS &&
+           s->cdc_out_ep && s->cdc_out_ep < STM32F4xx_NB_EPS;
+}
+
+/* A packet the firmware queued on an IN endpoint reached the host */
+static void STM32F4xx_cdc_in_packet(STM32F4xxUSBState *s, int ep,
+                                    const uint8_t *data, uint32_t len,
+                                    bool short_pkt)
+{
+    if (ep == 0) {
+        if (s->ctl_stage == CTL_DATA_IN) {
+            uint32_t copy = MIN(len, sizeof(s->ctl_buf) - s->ctl_len);
+            memcpy(&s->ctl_buf[s->ctl_len], data, copy);
+            s->ctl_len += copy;
+            if (short_pkt || s->ctl_len >= lduw_le_p(&s->ctl_setup[6])) {
+                s->ctl_stage = CTL_STATUS_OUT;
+                STM32F4xx_cdc_kick(s, CDC_TURNAROUND_NS);
+            }
+        } else if (s->ctl_stage == CTL_STATUS_IN && len == 0) {
+            STM32F4xx_cdc_ctl_done(s, true);
+        }
+        return;
+    }
+    if (s->cdc_state == CDC_RUNNING && ep == s->cdc_in_ep && len) {
+        qemu_chr_fe_write_all(&s->cdc_chr, data, len);
+    }
+}
+
+/* Hand over as many whole packets of the enabled IN transfer as are queued */
+static void STM32F4xx_dev_in_service(STM32F4xxUSBState *s, int ep)
+{
+    uint8_t buf[DXEPCTL_MPS_LIMIT + 4];
+    uint32_t tsiz = s->dieptsiz(ep);
+    uint32_t xfer = get_field(tsiz, DXEPTSIZ_XFERSIZE);
+    uint32_t pkts = get_field(tsiz, DXEPTSIZ_PKTCNT);
+    uint32_t mps = STM32F4xx_dev_ep_mps(s->diepctl(ep), ep);
+    uint32_t i;
+
+    while ((s->diepctl(ep) & DXEPCTL_EPENA) && pkts > 0) {
+        uint32_t len = MIN(xfer, mps);
+        uint32_t words = DIV_ROUND_UP(len, 4);
+
+        if (s->fifo_level[ep] < words) {
+            break;
+        }
+        for (i = 0; i < words; i++) {
+            stl_le_p(&buf[i * 4], s->tx_fifos[ep][i]);
+        }
+        s->fifo_level[ep] -= words;
+        memmove(s->tx_fifos[ep], &s->tx_fifos[ep][words],
+                s->fifo_level[ep] * sizeof(uint32_t));
+        xfer -= len;
+        pkts--;
+        if (xfer == 0 || len < mps) {
+            pkts = 0;
+            s->diepctl(ep) &= ~DXEPCTL_EPENA;
+            s->diepint(ep) |= DXEPINT_XFERCOMPL;
+        }
+        set_field(&tsiz, xfer, DXEPTSIZ_XFERSIZE);
+        set_field(&tsiz, pkts, DXEPTSIZ_PKTCNT);
+        s->dieptsiz(ep) = tsiz;
+        STM32F4xx_cdc_in_packet(s, ep, buf, len, len < mps);
+    }
+    STM32F4xx_dev_update_irq(s);
+}
+
+static void STM32F4xx_dev_fifo_write(STM32F4xxUSBState *s, int ep, uint32_t val)
+{
+    if (ep >= STM32F4xx_NB_EPS || s->fifo_level[ep] >= STM32F4xx_EP_FIFO_SIZE) {
+        qemu_log_mask(LOG_GUEST_ERROR, "Wrote to a full FIFO (data discarded)!\n");
+        return;
+    }
+    s->tx_fifos[ep][s->fifo_level[ep]++] = val;
+    STM32F4xx_dev_in_service(s, ep);
+}
+
+/* Start a control transfer on EP0; OUT data must already be in ctl_buf */
+static void STM32F4xx_cdc_ctl_start(STM32F4xxUSBState *s, uint8_t type,
+                                    uint8_t request, uint16_t value,
+                                    uint16_t index, uint16_t length)
+{
+    if (s->rx_fifo_level + 4 > STM32F4xx_RX_FIFO_SIZE) {
+        STM32F4xx_cdc_kick(s, s->usb_frame_time);
+        return;
+    }
+    s->ctl_setup[0] = type;
+    s->ctl_setup[1] = request;
+    stw_le_p(&s->ctl_setup[2], value);
+    stw_le_p(&s->ctl_setup[4], index);
+    stw_le_p(&s->ctl_setup[6], length);
+
+    /* A SETUP clears any stall left from the previous request */
+    s->diepctl(0) &= ~DXEPCTL_STALL;
+    s->doepctl(0) &= ~DXEPCTL_STALL;
+    STM32F4xx_dev_rx_push(s, 0, GRXSTS_PKTSTS_SETUPRX, s->ctl_setup, 8);
+    STM32F4xx_dev_rx_push(s, 0, GRXSTS_PKTSTS_SETUPDONE, NULL, 0);
+
+    if (length == 0) {
+        s->ctl_stage = CTL_STATUS_IN;
+    } else if (type & USB_DIR_IN) {
+        s->ctl_len = 0;
+        s->ctl_stage = CTL_DATA_IN;
+    } else {
+        s->ctl_stage = CTL_DATA_OUT;
+    }
+}
+
+/* Stages the host drives once the firmware has armed EP0 OUT */
+static void STM32F4xx_cdc_ctl_continue(STM32F4xxUSBState *s)
+{
+    if (!(s->doepctl(0) & DXEPCTL_EPENA)) {
+        return;
+    }
+    switch (s->ctl_stage) {
+    case CTL_DATA_OUT:
+        if (STM32F4xx_dev_out_packet(s, 0, s->ctl_buf, s->ctl_len) &&
+            STM32F4xx_dev_out_done(s, 0)) {
+            s->ctl_stage = CTL_STATUS_IN;
+        }
+        break;
+    case CTL_STATUS_OUT:
+        if (STM32F4xx_dev_out_packet(s, 0, NULL, 0) &&
+            STM32F4xx_dev_out_done(s, 0)) {
+            STM32F4xx_cdc_ctl_done(s, true);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void STM32F4xx_cdc_ctl_done(STM32F4xxUSBState *s, bool ok)
+{
+    s->ctl_stage = CTL_IDLE;
+
+    switch (s->cdc_state) {
+    case CDC_GET_CONFIG_HEADER:
+        ok &= s->ctl_len >= 9;
+        break;
+    case CDC_GET_CONFIG:
+        ok &= STM32F4xx_cdc_parse_config(s);
+        break;
+    case CDC_GET_DEVICE:
+    case CDC_SET_LINE_CODING:
+    case CDC_SET_LINE_STATE:
+        /* A host carries on without these */
+        ok = true;
+        break;
+    default:
+        break;
+    }
+
+    if (!ok) {
+        qemu_log_mask(LOG_GUEST_ERROR, "USB CDC: enumeration failed in step %u\n",
+                      s->cdc_state);
+        s->cdc_state = CDC_FAILED;
+        return;
+    }
+    s->cdc_state++;
+    if (s->cdc_state == CDC_RUNNING) {
+        qemu_chr_fe_accept_input(&s->cdc_chr);
+    }
+    STM32F4xx_cdc_kick(s, s->usb_frame_time);
+}
+
+/* Move one transfer's worth of chardev data to the bulk OUT endpoint */
+static void STM32F4xx_cdc_bulk_out(STM32F4xxUSBState *s)
+{
+    int ep = s->cdc_out_ep;
+    uint32_t mps = STM32F4xx_dev_ep_mps(s->doepctl(ep), ep);
+    uint32_t room = get_field(s->doeptsiz(ep), DXEPTSIZ_XFERSIZE);
+    uint32_t sent = 0;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (!s->cdc_rx_len || !mps ||
+        (s->doepctl(ep) & (DXEPCTL_EPENA | DXEPCTL_NAKSTS)) != DXEPCTL_EPENA) {
+        return;
+    }
+    if (now < s->cdc_busy_until) {
+        timer_mod_anticipate_ns(s->cdc_timer, s->cdc_busy_until);
+        return;
+    }
+
+    /*
+     * Whole packets while both sides have them; the transfer then ends
+     * with whatever is left, as it would on a short packet.
+     */
+    while (sent < s->cdc_rx_len && room) {
+        uint32_t len = MIN(MIN(mps, room), s->cdc_rx_len - sent);
+        if (!STM32F4xx_dev_out_packet(s, ep, &s->cdc_rx_buf[sent], len)) {
+            break;
+        }
+        sent += len;
+        room -= len;
+        if (len < mps) {
+            break;
+        }
+    }
+    if (sent == 0 || !STM32F4xx_dev_out_done(s, ep)) {
+        STM32F4xx_cdc_kick(s, s->usb_frame_time);
+        return;
+    }
+
+    s->cdc_rx_len -= sent;
+    memmove(s->cdc_rx_buf, &s->cdc_rx_buf[sent], s->cdc_rx_len);
+    s->cdc_busy_until = now + sent * 8 * s->usb_bit_time;
+    qemu_chr_fe_accept_input(&s->cdc_chr);
+}
+
+static void STM32F4xx_cdc_step(void *opaque)
+{
+    STM32F4xxUSBState *s = opaque;
+    uint8_t *line = s->ctl_buf;
+
+    if (!STM32F4xx_is_device(s)) {
+        return;
+    }
+    if (s->ctl_stage != CTL_IDLE) {
+        STM32F4xx_cdc_ctl_continue(s);
+        return;
+    }
+
+    switch (s->cdc_state) {
+    case CDC_CONNECTED:
+        STM32F4xx_raise_global_irq(s, GINTSTS_USBRST);
+        s->cdc_state = CDC_RESET;
+        STM32F4xx_cdc_kick(s, CDC_RESET_NS);
+        break;
+    case CDC_RESET:
+        set_field(&s->dsts, DSTS_ENUMSPD_FS48, DSTS_ENUMSPD);
+        STM32F4xx_raise_global_irq(s, GINTSTS_ENUMDONE);
+        s->cdc_state = CDC_GET_DEVICE;
+        STM32F4xx_cdc_kick(s, s->usb_frame_time);
+        break;
+    case CDC_GET_DEVICE:
+        STM32F4xx_cdc_ctl_start(s, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR,
+                                USB_DT_DEVICE << 8, 0, 18);
+        break;
+    case CDC_SET_ADDRESS:
+        STM32F4xx_cdc_ctl_start(s, USB_DIR_OUT, USB_REQ_SET_ADDRESS,
+                                CDC_DEVICE_ADDRESS, 0, 0);
+        break;
+    case CDC_GET_CONFIG_HEADER:
+        STM32F4xx_cdc_ctl_start(s, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR,
+                                USB_DT_CONFIG << 8, 0, 9);
+        break;
+    case CDC_GET_CONFIG:
+        STM32F4xx_cdc_ctl_start(s, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR,
+                                USB_DT_CONFIG << 8, 0,
+                                MIN(lduw_le_p(&s->ctl_buf[2]), sizeof(s->ctl_buf)));
+        break;
+    case CDC_SET_CONFIG:
+        STM32F4xx_cdc_ctl_start(s, USB_DIR_OUT, USB_REQ_SET_CONFIGURATION,
+                                s->cdc_config, 0, 0);
+        break;
+    case CDC_SET_LINE_CODING:
+        /* 115200 8N1; the firmware only needs to see one */
+        stl_le_p(&line[0], 115200);
+        line[4] = 0;
+        line[5] = 0;
+        line[6] = 8;
+        s->ctl_len = 7;
+        STM32F4xx_cdc_ctl_start(s, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                                CDC_REQ_SET_LINE_CODING, 0, s->cdc_comm_if, 7);
+        break;
+    case CDC_SET_LINE_STATE:
+        /* DTR and RTS, which is what tells the firmware a host is listening */
+        STM32F4xx_cdc_ctl_start(s, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                                CDC_REQ_SET_CONTROL_LINE_STATE, 0x3, s->cdc_comm_if, 0);
+        break;
+    case CDC_RUNNING:
+        STM32F4xx_cdc_bulk_out(s);
+        break;
+    default:
+        break;
+    }
+}
+
+static void STM32F4xx_cdc_attach(STM32F4xxUSBState *s)
+{
+    if (!qemu_chr_fe_backend_connected(&s->cdc_chr)) {
+        return;
+    }
+    s->cdc_state = CDC_CONNECTED;
+    s->ctl_stage = CTL_IDLE;
+    s->cdc_busy_until = 0;
+    STM32F4xx_cdc_kick(s, CDC_CONNECT_NS);
+}
+
+static void STM32F4xx_cdc_detach(STM32F4xxUSBState *s)
+{
+    s->cdc_state = CDC_DETACHED;
+    s->ctl_stage = CTL_IDLE;
+    timer_del(s->cdc_timer);
+}
+
+static int STM32F4xx_cdc_can_receive(void *opaque)
+{
+    STM32F4xxUSBState *s = opaque;
+
+    if (s->cdc_state != CDC_RUNNING) {
+        return 0;
+    }
+    return sizeof(s->cdc_rx_buf) - s->cdc_rx_len;
+}
+
+static void STM32F4xx_cdc_receive(void *opaque, const uint8_t *buf, int size)
+{
+    STM32F4xxUSBState *s = opaque;
+
+    assert(size <= sizeof(s->cdc_rx_buf) - s->cdc_rx_len);
+    memcpy(&s->cdc_rx_buf[s->cdc_rx_len], buf, size);
+    s->cdc_rx_len += size;
+    STM32F4xx_cdc_kick(s, 0);
+}
+
+/* Common DIEPCTLx/DOEPCTLx write semantics; returns the new register value */
+static uint32_t STM32F4xx_depctl_update(uint32_t old, uint32_t val, int ep,
+                                        uint32_t *intr)
+{
+    uint32_t ctl = val & ~(DXEPCTL_EPDIS | DXEPCTL_SETD1PID | DXEPCTL_SETD0PID |
+                           DXEPCTL_SNAK | DXEPCTL_CNAK | DXEPCTL_NAKSTS);
+
+    /* The core clears EPENA and owns NAKSTS; writing 0 leaves them alone */
+    ctl |= old & (DXEPCTL_EPENA | DXEPCTL_NAKSTS);
+    if (val & DXEPCTL_SNAK) {
+        ctl |= DXEPCTL_NAKSTS;
+    }
+    if (val & DXEPCTL_CNAK) {
+        ctl &= ~DXEPCTL_NAKSTS;
+    }
+    if ((val & DXEPCTL_EPDIS) && (ctl & DXEPCTL_EPENA)) {
+        ctl &= ~DXEPCTL_EPENA;
+        *intr |= DXEPINT_EPDISBLD;
+    }
+    if (ep == 0) {
+        ctl |= DXEPCTL_USBACTEP;
+    }
+    return ctl;
+}
+
+static void STM32F4xx_diepctl_write(STM32F4xxUSBState *s, int ep, uint32_t val)
+{
+    uint32_t old = s->diepctl(ep);
+
+    s->diepctl(ep) = STM32F4xx_depctl_update(old, val, ep, &s->diepint(ep));
+    if (ep == 0 && (val & DXEPCTL_STALL) && s->ctl_stage != CTL_IDLE) {
+        STM32F4xx_cdc_ctl_done(s, false);
+    }
+    if ((s->diepctl(ep) & DXEPCTL_EPENA) && !(old & DXEPCTL_EPENA)) {
+        STM32F4xx_dev_in_service(s, ep);
+    }
+    STM32F4xx_dev_update_irq(s);
+}
+
+static void STM32F4xx_doepctl_write(STM32F4xxUSBState *s, int ep, uint32_t val)
+{
+    uint32_t old = s->doepctl(ep);
+
+    s->doepctl(ep) = STM32F4xx_depctl_update(old, val, ep, &s->doepint(ep));
+    if (ep == 0 && (val & DXEPCTL_STALL) && s->ctl_stage != CTL_IDLE) {
+        STM32F4xx_cdc_ctl_done(s, false);
+    }
+    if ((s->doepctl(ep) & DXEPCTL_EPENA) && !(old & DXEPCTL_EPENA)) {
+        /* The host has something to send as soon as the endpoint is armed */
+        STM32F4xx_cdc_kick(s, CDC_TURNAROUND_NS);
+    }
+    STM32F4xx_dev_update_irq(s);
+}
+
+static void STM32F4xx_dctl_write(STM32F4xxUSBState *s, uint32_t val)
+{
+    uint32_t old = s->dctl;
+    uint32_t nak = old & (DCTL_GOUTNAKSTS | DCTL_GNPINNAKSTS);
+
+    if (val & DCTL_SGNPINNAK) {
+        nak |= DCTL_GNPINNAKSTS;
+        s->gintsts |= GINTSTS_GINNAKEFF;
+    }
+    if (val & DCTL_CGNPINNAK) {
+        nak &= ~DCTL_GNPINNAKSTS;
+        s->gintsts &= ~GINTSTS_GINNAKEFF;
+    }
+    if (val & DCTL_SGOUTNAK) {
+        nak |= DCTL_GOUTNAKSTS;
+        s->gintsts |= GINTSTS_GOUTNAKEFF;
+    }
+    if (val & DCTL_CGOUTNAK) {
+        nak &= ~DCTL_GOUTNAKSTS;
+        s->gintsts &= ~GINTSTS_GOUTNAKEFF;
+    }
+    s->dctl = (val & ~(DCTL_CGOUTNAK | DCTL_SGOUTNAK | DCTL_CGNPINNAK |
+                       DCTL_SGNPINNAK | DCTL_GOUTNAKSTS | DCTL_GNPINNAKSTS)) | nak;
+
+    if (STM32F4xx_is_device(s) && ((old ^ s->dctl) & DCTL_SFTDISCON)) {
+        if (s->dctl & DCTL_SFTDISCON) {
+            STM32F4xx_cdc_detach(s);
+        } else {
+            STM32F4xx_cdc_attach(s);
+        }
+    }
+    STM32F4xx_update_irq(s);
+}
+
+static uint64_t STM32F4xx_dreg_read(void *ptr, hwaddr addr, unsigned size)
+{
+    STM32F4xxUSBState *s = ptr;
+    int ep;
+
+    switch (addr) {
+    case DCFG ... DIEPEMPMSK:
+        return s->dreg0[(addr - DCFG) >> 2];
+    case DIEPCTL0 ... DIEPCTL0 + STM32F4xx_DEPREG_SIZE - 1:
+        ep = (addr - DIEPCTL0) >> 5;
+        if (addr == DTXFSTS(ep)) {
+            /* Packets leave as soon as they are complete: all space is free */
+            return ep ? s->dieptxf[ep - 1] >> FIFOSIZE_DEPTH_SHIFT :
+                        s->gnptxfsiz_txfd;
+        }
+        return s->diepreg[(addr - DIEPCTL0) >> 2];
+    case DOEPCTL0 ... DOEPCTL0 + STM32F4xx_DEPREG_SIZE - 1:
+        return s->doepreg[(addr - DOEPCTL0) >> 2];
+    default:
+        return 0;
+    }
+}
+
+static void STM32F4xx_dreg_write(void *ptr, hwaddr addr, uint64_t val,
+                                 unsigned size)
+{
+    STM32F4xxUSBState *s = ptr;
+    int ep;
+
+    switch (addr) {
+    case DCTL:
+        STM32F4xx_dctl_write(s, val);
+        break;
+    case DSTS:
+    case DAINT:
+        /* Read-only */
+        break;
+    case DCFG:
+    case DIEPMSK:
+    case DOEPMSK:
+    case DAINTMSK:
+    case DIEPEMPMSK:
+        s->dreg0[(addr - DCFG) >> 2] = val;
+        STM32F4xx_dev_update_irq(s);
+        break;
+    case DIEPCTL0 ... DIEPCTL0 + STM32F4xx_DEPREG_SIZE - 1:
+        ep = (addr - DIEPCTL0) >> 5;
+        if (addr == DIEPCTL(ep)) {
+            STM32F4xx_diepctl_write(s, ep, val);
+        } else if (addr == DIEPINT(ep)) {
+            s->diepint(ep) &= ~val;
+            STM32F4xx_dev_update_irq(s);
+        } else if (addr != DTXFSTS(ep)) {
+            s->diepreg[(addr - DIEPCTL0) >> 2] = val;
+        }
+        break;
+    case DOEPCTL0 ... DOEPCTL0 + STM32F4xx_DEPREG_SIZE - 1:
+        ep = (addr - DOEPCTL0) >> 5;
+        if (addr == DOEPCTL(ep)) {
+            STM32F4xx_doepctl_write(s, ep, val);
+        } else if (addr == DOEPINT(ep)) {
+            s->doepint(ep) &= ~val;
+            STM32F4xx_dev_update_irq(s);
+        } else {
+            s->doepreg[(addr - DOEPCTL0) >> 2] = val;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 // static const char *glbregnm[] = {
 //     "GOTGCTL  ", "GOTGINT  ", "GAHBCFG  ", "GUSBCFG  ", "GRSTCTL  ",
 //     "GINTSTS  ", "GINTMSK  ", "GRXSTSR  ", "GRXSTSP  ", "GRXFSIZ  ",
@@ -797,7 +1491,14 @@ static uint64_t STM32F4xx_glbreg_read(void *ptr, hwaddr addr, int index,
         // printf("RX fifo pop (STSP): %08x @ %u\n", s->fifo_ram[s->rx_fifo_head], s->rx_fifo_head);
         if(s->rx_fifo_level>0) {
             val = s->fifo_ram[s->rx_fifo_head++];
+            s->rx_fifo_head %= STM32F4xx_RX_FIFO_SIZE;
             s->rx_fifo_level--;
+            if (s->rx_fifo_level == 0) {
+                STM32F4xx_lower_global_irq(s, GINTSTS_RXFLVL);
+            }
+            if (STM32F4xx_is_device(s)) {
+                STM32F4xx_dev_rx_popped(s, val);
+            }
         } // else: val will be 0 from s->GRXSTSP;
         break;
     case GRXSTSR:
@@ -870,6 +1571,17 @@ static void STM32F4xx_flush_tx(void *ptr)
     STM32F4xxUSBState *s = ptr;
     uint16_t index = (s->grstctl & GRSTCTL_TXFNUM_MASK) >> GRSTCTL_TXFNUM_SHIFT;
 
+    if (STM32F4xx_is_device(s)) {
+        /* TXFNUM 0x10 flushes all the endpoint FIFOs */
+        if (index == 0x10) {
+            memset(s->fifo_level, 0, sizeof(s->fifo_level));
+        } else if (index < STM32F4xx_NB_EPS) {
+            s->fifo_level[index] = 0;
+        }
+        STM32F4xx_dev_update_irq(s);
+        return;
+    }
+
     if (index==0b1000 || index>0)
     {
         printf("FIXME: >0 flush\n");
@@ -923,16 +1635,31 @@ static void STM32F4xx_glbreg_write(void *ptr, hwaddr addr, int index, uint64_t v
             printf("FIXME: USB dma not implemented!\n");
         }
         break;
+    case GUSBCFG:
+        if (val & GUSBCFG_FORCEDEVMODE) {
+            s->gintsts &= ~GINTSTS_CURMODE_HOST;
+            if (!(old & GUSBCFG_FORCEDEVMODE) && !(s->dctl & DCTL_SFTDISCON)) {
+                STM32F4xx_cdc_attach(s);
+            }
+        } else if (val & GUSBCFG_FORCEHOSTMODE) {
+            s->gintsts |= GINTSTS_CURMODE_HOST;
+            STM32F4xx_cdc_detach(s);
+        }
+        break;
     case GRSTCTL:
         val |= GRSTCTL_AHBIDLE;
         val &= ~GRSTCTL_DMAREQ;
         if (!(old & GRSTCTL_TXFFLSH) && (val & GRSTCTL_TXFFLSH)) {
-                /* TODO - TX fifo flush */
+            /* The flush acts on the TXFNUM written along with it */
+            *mmio = val;
             STM32F4xx_flush_tx(s);
         }
         if (!(old & GRSTCTL_RXFFLSH) && (val & GRSTCTL_RXFFLSH)) {
-                /* TODO - RX fifo flush */
-            qemu_log_mask(LOG_UNIMP, "Rx FIFO flush not implemented\n");
+            s->rx_fifo_head = 0;
+            s->rx_fifo_tail = 0;
+            s->rx_fifo_level = 0;
+            s->gintsts &= ~GINTSTS_RXFLVL;
+            iflg = 1;
         }
         if (!(old & GRSTCTL_IN_TKNQ_FLSH) && (val & GRSTCTL_IN_TKNQ_FLSH)) {
                 /* TODO - device IN token queue flush */
@@ -1284,8 +2011,10 @@ static uint64_t STM32F4xx_hsotg_read(void *ptr, hwaddr addr, unsigned size)
     case HSOTG_REG(0x100):
         val = STM32F4xx_fszreg_read(ptr, addr, (addr - HSOTG_REG(0x100)) >> 2, size);
         break;
-    case HSOTG_REG(0x104) ... HSOTG_REG(0x3fc):
-        /* Gadget-mode registers, just return 0 for now */
+    case DPTXFSIZN(1) ... DPTXFSIZN(STM32F4xx_NB_EPS - 1):
+        val = ((STM32F4xxUSBState *)ptr)->dieptxf[(addr - DPTXFSIZN(1)) >> 2];
+        break;
+    case DPTXFSIZN(STM32F4xx_NB_EPS) ... HSOTG_REG(0x3fc):
         val = 0;
         break;
     case HSOTG_REG(0x400) ... HSOTG_REG(0x4fc):
@@ -1295,8 +2024,7 @@ static uint64_t STM32F4xx_hsotg_read(void *ptr, hwaddr addr, unsigned size)
         val = STM32F4xx_hreg1_read(ptr, addr, (addr - HSOTG_REG(0x500)) >> 2, size);
         break;
     case HSOTG_REG(0x800) ... HSOTG_REG(0xdfc):
-        /* Gadget-mode registers, just return 0 for now */
-        val = 0;
+        val = STM32F4xx_dreg_read(ptr, addr, size);
         break;
     case HSOTG_REG(0xe00) ... HSOTG_REG(0xffc):
         val = STM32F4xx_pcgreg_read(ptr, addr, (addr - HSOTG_REG(0xe00)) >> 2, size);
@@ -1318,8 +2046,10 @@ static void STM32F4xx_hsotg_write(void *ptr, hwaddr addr, uint64_t val,
     case HSOTG_REG(0x100):
         STM32F4xx_fszreg_write(ptr, addr, (addr - HSOTG_REG(0x100)) >> 2, val, size);
         break;
-    case HSOTG_REG(0x104) ... HSOTG_REG(0x3fc):
-        /* Gadget-mode registers, do nothing for now */
+    case DPTXFSIZN(1) ... DPTXFSIZN(STM32F4xx_NB_EPS - 1):
+        ((STM32F4xxUSBState *)ptr)->dieptxf[(addr - DPTXFSIZN(1)) >> 2] = val;
+        break;
+    case DPTXFSIZN(STM32F4xx_NB_EPS) ... HSOTG_REG(0x3fc):
         break;
     case HSOTG_REG(0x400) ... HSOTG_REG(0x4fc):
         STM32F4xx_hreg0_write(ptr, addr, (addr - HSOTG_REG(0x400)) >> 2, val, size);
@@ -1328,7 +2058,7 @@ static void STM32F4xx_hsotg_write(void *ptr, hwaddr addr, uint64_t val,
         STM32F4xx_hreg1_write(ptr, addr, (addr - HSOTG_REG(0x500)) >> 2, val, size);
         break;
     case HSOTG_REG(0x800) ... HSOTG_REG(0xdfc):
-        /* Gadget-mode registers, do nothing for now */
+        STM32F4xx_dreg_write(ptr, addr, val, size);
         break;
     case HSOTG_REG(0xe00) ... HSOTG_REG(0xffc):
         STM32F4xx_pcgreg_write(ptr, addr, (addr - HSOTG_REG(0xe00)) >> 2, val, size);
@@ -1375,6 +2105,10 @@ static void STM32F4xx_hreg2_write(void *ptr, hwaddr addr, uint64_t val,
     STM32F4xxUSBState *s = ptr;
     uint8_t index = addr >> 12;
     trace_usb_stm_hreg2_write(addr, addr >> 12, orig, s->fifo_tail[index], val);
+    if (STM32F4xx_is_device(s)) {
+        STM32F4xx_dev_fifo_write(s, index, val);
+        return;
+    }
     if (s->fifo_level[index]==s->gnptxfsiz_txfd) {
         qemu_log_mask(LOG_GUEST_ERROR, "Wrote to a full FIFO (data discarded)!\n");
     }
@@ -1502,6 +2236,13 @@ static void STM32F4xx_reset_enter(Object *obj, ResetType type)
     memset(s->hreg1, 0, sizeof(s->hreg1));
     memset(s->pcgreg, 0, sizeof(s->pcgreg));
 
+    memset(s->dieptxf, 0, sizeof(s->dieptxf));
+    memset(s->dreg0, 0, sizeof(s->dreg0));
+    memset(s->diepreg, 0, sizeof(s->diepreg));
+    memset(s->doepreg, 0, sizeof(s->doepreg));
+    STM32F4xx_cdc_detach(s);
+    s->cdc_rx_len = 0;
+
     s->sof_time = 0;
     s->frame_number = 0;
     s->fi = USB_FRMINTVL - 1;
@@ -1601,6 +2342,10 @@ static void STM32F4xx_realize(DeviceState *dev, Error **errp)
     s->frame_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, STM32F4xx_work_timer, s);
     s->async_bh = qemu_bh_new(STM32F4xx_work_bh, s);
 
+    s->cdc_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, STM32F4xx_cdc_step, s);
+    qemu_chr_fe_set_handlers(&s->cdc_chr, STM32F4xx_cdc_can_receive,
+                             STM32F4xx_cdc_receive, NULL, NULL, s, NULL, true);
+
     qdev_init_gpio_in_named(dev,stm32f4xx_usb_reset,"rcc-reset",1);
 
     sysbus_init_irq(sbd, &s->irq);
@@ -1648,10 +2393,33 @@ static const VMStateDescription vmstate_STM32F4xx_state_packet = {
     },
 };
 
+static int STM32F4xx_post_load(void *opaque, int version_id)
+{
+    STM32F4xxUSBState *s = opaque;
+    int i;
+
+    if (s->rx_fifo_head >= STM32F4xx_RX_FIFO_SIZE ||
+        s->rx_fifo_tail >= STM32F4xx_RX_FIFO_SIZE ||
+        s->rx_fifo_level > STM32F4xx_RX_FIFO_SIZE ||
+        s->cdc_rx_len > sizeof(s->cdc_rx_buf) ||
+        s->ctl_len > sizeof(s->ctl_buf) ||
+        s->cdc_in_ep >= STM32F4xx_NB_EPS ||
+        s->cdc_out_ep >= STM32F4xx_NB_EPS) {
+        return -EINVAL;
+    }
+    for (i = 0; i < STM32F4xx_NB_CHAN; i++) {
+        if (s->fifo_level[i] > STM32F4xx_EP_FIFO_SIZE) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
 const VMStateDescription vmstate_STM32F4xx_state = {
     .name = "STM32F4xx",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
+    .post_load = STM32F4xx_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32_ARRAY(glbreg, STM32F4xxUSBState,
                              STM32F4xx_GLBREG_SIZE / sizeof(uint32_t)),
@@ -1688,12 +2456,36 @@ const VMStateDescription vmstate_STM32F4xx_state = {
         VMSTATE_UINT32(rx_fifo_tail,STM32F4xxUSBState),
         VMSTATE_UINT32(rx_fifo_level,STM32F4xxUSBState),
         VMSTATE_UINT8(is_ping, STM32F4xxUSBState),
+
+        VMSTATE_UINT32_ARRAY_V(dieptxf, STM32F4xxUSBState,
+                               STM32F4xx_NB_EPS - 1, 2),
+        VMSTATE_UINT32_ARRAY_V(dreg0, STM32F4xxUSBState,
+                               STM32F4xx_DREG0_SIZE / sizeof(uint32_t), 2),
+        VMSTATE_UINT32_ARRAY_V(diepreg, STM32F4xxUSBState,
+                               STM32F4xx_DEPREG_SIZE / sizeof(uint32_t), 2),
+        VMSTATE_UINT32_ARRAY_V(doepreg, STM32F4xxUSBState,
+                               STM32F4xx_DEPREG_SIZE / sizeof(uint32_t), 2),
+        VMSTATE_TIMER_PTR_V(cdc_timer, STM32F4xxUSBState, 2),
+        VMSTATE_INT64_V(cdc_busy_until, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_V(cdc_state, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_V(ctl_stage, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_ARRAY_V(ctl_setup, STM32F4xxUSBState, 8, 2),
+        VMSTATE_UINT8_ARRAY_V(ctl_buf, STM32F4xxUSBState, 256, 2),
+        VMSTATE_UINT16_V(ctl_len, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_V(cdc_config, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_V(cdc_comm_if, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_V(cdc_in_ep, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_V(cdc_out_ep, STM32F4xxUSBState, 2),
+        VMSTATE_UINT8_ARRAY_V(cdc_rx_buf, STM32F4xxUSBState,
+                              STM32F4xx_CDC_BUF_SIZE, 2),
+        VMSTATE_UINT32_V(cdc_rx_len, STM32F4xxUSBState, 2),
         VMSTATE_END_OF_LIST()
     }
 };
 
 static Property STM32F4xx_usb_properties[] = {
     DEFINE_PROP_UINT32("usb_version", STM32F4xxUSBState, usb_version, 2),
+    DEFINE_PROP_CHR("chardev", STM32F4xxUSBState, cdc_chr),
     DEFINE_PROP_END_OF_LIST(),
 };
 
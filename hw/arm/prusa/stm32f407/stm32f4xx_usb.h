@@ -27,6 +27,7 @@
 #include "sysemu/dma.h"
 #include "qemu/units.h"
 #include "qom/object.h"
+#include "chardev/char-fe.h"
 
 #define STM32F4xx_MMIO_SIZE      0xCFFF // CSRs and FIFOs
 
@@ -34,6 +35,9 @@
 // N.B - device has max 12, but the LL HAL code resets up to 16 (likely for other device compat)
 #define STM32F4xx_MAX_XFER_SIZE  65536   /* Max transfer size expected in HCTSIZ */
 
+#define STM32F4xx_NB_EPS         6        /* Device-mode endpoints (FS has 4, HS 6) */
+#define STM32F4xx_CDC_BUF_SIZE   4096     /* Chardev bytes waiting for the bulk OUT endpoint */
+
 #define STM32F4xx_EP_FIFO_SIZE 4*KiB / sizeof(uint32_t)
 #define STM32F4xx_RX_FIFO_SIZE (128*KiB)/sizeof(uint32_t)
 
@@ -138,6 +142,9 @@ struct STM32F4xxUSBState {
         };
     };
 
+    /* Device-mode Tx FIFO sizes, 104... */
+    uint32_t dieptxf[STM32F4xx_NB_EPS - 1];
+
     union {
 #define STM32F4xx_HREG0_SIZE     0x44
         uint32_t hreg0[STM32F4xx_HREG0_SIZE / sizeof(uint32_t)];
@@ -166,6 +173,37 @@ struct STM32F4xxUSBState {
 #define hcdma(_ch)      hreg1[((_ch) << 3) + 5] /* 514, 534, ... */
 #define hcdmab(_ch)     hreg1[((_ch) << 3) + 7] /* 51c, 53c, ... */
 
+    union {
+#define STM32F4xx_DREG0_SIZE     0x38
+        uint32_t dreg0[STM32F4xx_DREG0_SIZE / sizeof(uint32_t)];
+        struct {
+            uint32_t dcfg;          /* 800 */
+            uint32_t dctl;          /* 804 */
+            uint32_t dsts;          /* 808 */
+            uint32_t rsvd2;         /* 80c */
+            uint32_t diepmsk;       /* 810 */
+            uint32_t doepmsk;       /* 814 */
+            uint32_t daint;         /* 818 */
+            uint32_t daintmsk;      /* 81c */
+            uint32_t rsvd3[2];      /* 820-824 */
+            uint32_t dvbusdis;      /* 828 */
+            uint32_t dvbuspulse;    /* 82c */
+            uint32_t rsvd4;         /* 830 */
+            uint32_t diepempmsk;    /* 834 */
+        };
+    };
+
+#define STM32F4xx_DEPREG_SIZE    (0x20 * STM32F4xx_NB_EPS)
+    uint32_t diepreg[STM32F4xx_DEPREG_SIZE / sizeof(uint32_t)];
+    uint32_t doepreg[STM32F4xx_DEPREG_SIZE / sizeof(uint32_t)];
+
+#define diepctl(_ep)    diepreg[((_ep) << 3) + 0] /* 900, 920, ... */
+#define diepint(_ep)    diepreg[((_ep) << 3) + 2] /* 908, 928, ... */
+#define dieptsiz(_ep)   diepreg[((_ep) << 3) + 4] /* 910, 930, ... */
+#define doepctl(_ep)    doepreg[((_ep) << 3) + 0] /* b00, b20, ... */
+#define doepint(_ep)    doepreg[((_ep) << 3) + 2] /* b08, b28, ... */
+#define doeptsiz(_ep)   doepreg[((_ep) << 3) + 4] /* b10, b30, ... */
+
     union {
 #define STM32F4xx_PCGREG_SIZE    0x08
         uint32_t pcgreg[STM32F4xx_PCGREG_SIZE / sizeof(uint32_t)];
@@ -212,6 +250,25 @@ struct STM32F4xxUSBState {
     uint32_t rx_fifo_level;
     uint8_t is_ping;
 
+    /*
+     * Device mode: a built-in host enumerates the CDC-ACM function the
+     * firmware presents and bridges its bulk endpoints to a chardev.
+     */
+    CharBackend cdc_chr;
+    QEMUTimer *cdc_timer;
+    int64_t cdc_busy_until;
+    uint8_t cdc_state;
+    uint8_t ctl_stage;
+    uint8_t ctl_setup[8];
+    uint8_t ctl_buf[256];
+    uint16_t ctl_len;
+    uint8_t cdc_config;
+    uint8_t cdc_comm_if;
+    uint8_t cdc_in_ep;
+    uint8_t cdc_out_ep;
+    uint8_t cdc_rx_buf[STM32F4xx_CDC_BUF_SIZE];
+    uint32_t cdc_rx_len;
+
 };
 
 struct STM32F4xxClass {
@@ -0,0 +1,167 @@
+/*
+    p404_board.c - Board-level script actions (in-memory
+    checkpoint/rollback) for Mini404.
+
+	Copyright 2021 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of Mini404.
+
+	Mini404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Mini404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Mini404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "migration/snapshot.h"
+#include "hw/sysbus.h"
+#include "p404scriptable.h"
+#include "macros.h"
+#include "ScriptHost_C.h"
+
+#define TYPE_P404_BOARD "p404-board"
+
+OBJECT_DECLARE_SIMPLE_TYPE(BoardState, P404_BOARD)
+
+struct BoardState {
+    SysBusDevice parent_obj;
+    /*< private >*/
+    /*< public >*/
+    // Snapshots stop the VM, which can't be done from a vCPU thread
+    // (where virtual timers run under icount), so they run from a BH.
+    QEMUBH *bh;
+    int op;         // Action in flight, or -1
+    bool op_done;
+    bool op_ok;
+    char *name;
+    int64_t target_ns;  // For TravelTo
+
+    // Deliberately no vmstate - this must survive a rollback.
+};
+
+enum {
+    ACT_CHECKPOINT,
+    ACT_ROLLBACK,
+    ACT_AUTO_CHECKPOINT,
+    ACT_TRAVEL_TO,
+};
+
+OBJECT_DEFINE_TYPE_SIMPLE_WITH_INTERFACES(BoardState, p404_board, P404_BOARD, SYS_BUS_DEVICE, {TYPE_P404_SCRIPTABLE}, {NULL})
+
+static void p404_board_finalize(Object *obj)
+{
+    BoardState *s = P404_BOARD(obj);
+    qemu_bh_delete(s->bh);
+    g_free(s->name);
+}
+
+static void p404_board_bh(void *opaque)
+{
+    BoardState *s = P404_BOARD(opaque);
+    Error *err = NULL;
+    int ret;
+
+    if (s->op == ACT_CHECKPOINT) {
+        ret = save_memory_snapshot(s->name, &err);
+    } else if (s->op == ACT_TRAVEL_TO) {
+        ret = memory_checkpoint_goto(s->target_ns, false, &err);
+    } else {
+        ret = load_memory_snapshot(s->name, &err);
+    }
+    if (ret < 0) {
+        error_report_err(err);
+    }
+    s->op_ok = ret == 0;
+    s->op_done = true;
+}
+
+static int p404_board_process_action(P404ScriptIF *obj, unsigned int action, script_args args)
+{
+    BoardState *s = P404_BOARD(obj);
+    switch (action)
+    {
+        case ACT_CHECKPOINT:
+        case ACT_ROLLBACK:
+        {
+            if (s->op < 0) {
+                g_free(s->name);
+                s->name = g_strdup(scripthost_get_string(args, 0));
+                s->op = action;
+                s->op_done = false;
+                qemu_bh_schedule(s->bh);
+                return ScriptLS_Waiting;
+            } else if (!s->op_done) {
+                return ScriptLS_Waiting;
+            }
+            s->op = -1;
+            return s->op_ok ? ScriptLS_Finished : ScriptLS_Error;
+        }
+        case ACT_AUTO_CHECKPOINT:
+        {
+            Error *err = NULL;
+            if (memory_checkpoints_start(scripthost_get_int(args, 0), MAX(scripthost_get_int(args, 1), 0), 0, &err) < 0) {
+                error_report_err(err);
+                return ScriptLS_Error;
+            }
+            return ScriptLS_Finished;
+        }
+        case ACT_TRAVEL_TO:
+        {
+            if (s->op < 0) {
+                s->target_ns = (int64_t)scripthost_get_int(args, 0) * SCALE_MS;
+                s->op = action;
+                s->op_done = false;
+                qemu_bh_schedule(s->bh);
+                return ScriptLS_Waiting;
+            } else if (!s->op_done) {
+                return ScriptLS_Waiting;
+            } else if (s->op_ok && qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < s->target_ns) {
+                // Restored; now replaying forward to the requested time.
+                return ScriptLS_Waiting;
+            }
+            s->op = -1;
+            return s->op_ok ? ScriptLS_Finished : ScriptLS_Error;
+        }
+        default:
+            return ScriptLS_Unhandled;
+    }
+}
+
+static void p404_board_init(Object *obj)
+{
+    BoardState *s = P404_BOARD(obj);
+    s->op = -1;
+    s->bh = qemu_bh_new(p404_board_bh, s);
+
+    script_handle pScript = script_instance_new(P404_SCRIPTABLE(obj), "Board");
+
+    script_register_action(pScript, "Checkpoint", "Saves the whole machine state in memory under the given name", ACT_CHECKPOINT);
+    script_add_arg_string(pScript, ACT_CHECKPOINT);
+    script_register_action(pScript, "Rollback", "Restores the machine state saved with Checkpoint under the given name", ACT_ROLLBACK);
+    script_add_arg_string(pScript, ACT_ROLLBACK);
+    script_register_action(pScript, "AutoCheckpoint", "Keeps the given number of checkpoints, taken every given number of ms of virtual time", ACT_AUTO_CHECKPOINT);
+    script_add_arg_int(pScript, ACT_AUTO_CHECKPOINT);
+    script_add_arg_int(pScript, ACT_AUTO_CHECKPOINT);
+    script_register_action(pScript, "TravelTo", "Goes back to the given virtual time in ms from the nearest earlier automatic checkpoint", ACT_TRAVEL_TO);
+    script_add_arg_int(pScript, ACT_TRAVEL_TO);
+
+    scripthost_register_scriptable(pScript);
+}
+
+static void p404_board_class_init(ObjectClass *oc, void *data)
+{
+    P404ScriptIFClass *sc = P404_SCRIPTABLE_CLASS(oc);
+    sc->ScriptHandler = p404_board_process_action;
+}
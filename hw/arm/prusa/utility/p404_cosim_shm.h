@@ -0,0 +1,54 @@
+/*
+    p404_cosim_shm.h - Shared-memory mailbox between the cosim-shm device
+	and an external plant model process.
+
+	The emulator creates the POSIX shm object and fills in the header; the
+	plant maps it and waits for magic to appear. Every quantum of virtual
+	time the emulator writes in[], bumps seq_to_plant and futex-waits on
+	seq_to_emu. The plant advances its model by quantum_ns, writes out[]
+	and sets seq_to_emu to the sequence it answered. Both sequence words are
+	futexes, so either side sleeps in the kernel rather than on a socket.
+
+	Plain C with no QEMU dependencies so plant bindings can include it.
+
+	Copyright 2021 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of Mini404.
+
+	Mini404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Mini404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Mini404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef P404_COSIM_SHM_H
+#define P404_COSIM_SHM_H
+
+#include <stdint.h>
+
+#define P404_COSIM_SHM_MAGIC 0x53433450u // "P4CS"
+#define P404_COSIM_SHM_VERSION 1
+#define P404_COSIM_SHM_CHANNELS 32
+
+typedef struct P404CoSimMailbox {
+    uint32_t magic;         // Written last by the emulator
+    uint32_t version;
+    uint32_t num_in;        // Channels used in in[]
+    uint32_t num_out;       // Channels used in out[]
+    int64_t quantum_ns;
+    int64_t time_ns;        // Virtual time at the end of the quantum
+    uint32_t seq_to_plant;  // Futex, emulator -> plant
+    uint32_t seq_to_emu;    // Futex, plant -> emulator
+    int32_t in[P404_COSIM_SHM_CHANNELS];    // Emulator signals to the plant
+    int32_t out[P404_COSIM_SHM_CHANNELS];   // Plant signals to the emulator
+} P404CoSimMailbox;
+
+#endif // P404_COSIM_SHM_H
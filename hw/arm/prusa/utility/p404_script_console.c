@@ -30,6 +30,7 @@
 #include "hw/qdev-properties.h"
 #include "sysemu/sysemu.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/readline.h"
 #include "ui/console.h"
 
@@ -291,6 +292,18 @@ static void scriptcon_realize(DeviceState *d, Error **errp)
    
 }
 
+// The polling timer is part of the machine state so a rollback also
+// brings back when the script is next serviced.
+static const VMStateDescription vmstate_scriptcon = {
+    .name = TYPE_P404_SCRIPT_CONSOLE,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_TIMER_PTR(scripting, ScriptConsoleState),
+        VMSTATE_END_OF_LIST(),
+    }
+};
+
 static Property scriptcon_properties[] = {
     DEFINE_PROP_BOOL("no_echo", ScriptConsoleState, disable_echo, false),
     DEFINE_PROP_END_OF_LIST(),
@@ -306,6 +319,7 @@ static void scriptcon_class_init(ObjectClass *klass, void *data)
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = scriptcon_realize;
     dc->user_creatable = true;
+    dc->vmsd = &vmstate_scriptcon;
    
 //    //dc->reset = scriptcon_reset;
     device_class_set_props(dc, scriptcon_properties);
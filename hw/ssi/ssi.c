@@ -21,11 +21,29 @@
 
 struct SSIBus {
     BusState parent_obj;
+
+    /*
+     * Cached view of which slave is addressed, rebuilt lazily after a CS
+     * change. When @direct is set, at most one slave can respond and it is
+     * @selected (or nobody, if NULL); otherwise the bus is walked.
+     */
+    bool cache_valid;
+    bool direct;
+    SSISlave *selected;
 };
 
 #define TYPE_SSI_BUS "SSI"
 OBJECT_DECLARE_SIMPLE_TYPE(SSIBus, SSI_BUS)
 
+static void ssi_bus_invalidate(SSISlave *s)
+{
+    BusState *b = qdev_get_parent_bus(DEVICE(s));
+
+    if (b) {
+        SSI_BUS(b)->cache_valid = false;
+    }
+}
+
 static const TypeInfo ssi_bus_info = {
     .name = TYPE_SSI_BUS,
     .parent = TYPE_BUS,
@@ -42,17 +60,25 @@ static void ssi_cs_default(void *opaque, int n, int level)
         if (ssc->set_cs) {
             ssc->set_cs(s, cs);
         }
+        ssi_bus_invalidate(s);
     }
     s->cs = cs;
 }
 
+static bool ssi_slave_selected(SSISlave *dev)
+{
+    SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(dev);
+
+    return (dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+           (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+           ssc->cs_polarity == SSI_CS_NONE;
+}
+
 static uint32_t ssi_transfer_raw_default(SSISlave *dev, uint32_t val)
 {
     SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(dev);
 
-    if ((dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
-            (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
-            ssc->cs_polarity == SSI_CS_NONE) {
+    if (ssi_slave_selected(dev)) {
         return ssc->transfer(dev, val);
     }
     return 0;
@@ -68,6 +94,7 @@ static void ssi_slave_realize(DeviceState *dev, Error **errp)
         qdev_init_gpio_in_named(dev, ssi_cs_default, SSI_GPIO_CS, 1);
     }
 
+    ssi_bus_invalidate(s);
     ssc->realize(s, errp);
 }
 
@@ -111,6 +138,32 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name)
     return SSI_BUS(bus);
 }
 
+static void ssi_bus_update_cache(SSIBus *bus)
+{
+    BusState *b = BUS(bus);
+    BusChild *kid;
+    int n_selected = 0;
+
+    bus->direct = true;
+    bus->selected = NULL;
+    QTAILQ_FOREACH(kid, &b->children, sibling) {
+        SSISlave *slave = SSI_SLAVE(kid->child);
+        SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(slave);
+
+        if (ssc->transfer_raw != ssi_transfer_raw_default) {
+            /* Device handles CS itself, must see every transfer */
+            bus->direct = false;
+        } else if (ssi_slave_selected(slave)) {
+            bus->selected = slave;
+            n_selected++;
+        }
+    }
+    if (n_selected > 1) {
+        bus->direct = false;
+    }
+    bus->cache_valid = true;
+}
+
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
 {
     BusState *b = BUS(bus);
@@ -118,6 +171,16 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     SSISlaveClass *ssc;
     uint32_t r = 0;
 
+    if (!bus->cache_valid) {
+        ssi_bus_update_cache(bus);
+    }
+    if (bus->direct) {
+        if (!bus->selected) {
+            return 0;
+        }
+        return SSI_SLAVE_GET_CLASS(bus->selected)->transfer(bus->selected, val);
+    }
+
     QTAILQ_FOREACH(kid, &b->children, sibling) {
         SSISlave *slave = SSI_SLAVE(kid->child);
         ssc = SSI_SLAVE_GET_CLASS(slave);
@@ -127,10 +190,42 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+void ssi_transfer_block(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                        size_t len)
+{
+    size_t i;
+
+    if (!bus->cache_valid) {
+        ssi_bus_update_cache(bus);
+    }
+    if (bus->direct && bus->selected) {
+        SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(bus->selected);
+
+        if (ssc->transfer_block) {
+            ssc->transfer_block(bus->selected, tx, rx, len);
+            return;
+        }
+    }
+
+    for (i = 0; i < len; i++) {
+        uint8_t r = ssi_transfer(bus, tx[i]);
+        if (rx) {
+            rx[i] = r;
+        }
+    }
+}
+
+static int ssi_slave_post_load(void *opaque, int version_id)
+{
+    ssi_bus_invalidate(SSI_SLAVE(opaque));
+    return 0;
+}
+
 const VMStateDescription vmstate_ssi_slave = {
     .name = "SSISlave",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = ssi_slave_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_BOOL(cs, SSISlave),
         VMSTATE_END_OF_LIST()
@@ -52,6 +52,13 @@ struct SSISlaveClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSISlave *dev, uint32_t val);
+
+    /* optional: move @len 8-bit frames in one call while selected. @rx may
+     * be NULL if the master discards the received data. Without it,
+     * ssi_transfer_block() falls back to one transfer per frame.
+     */
+    void (*transfer_block)(SSISlave *dev, const uint8_t *tx, uint8_t *rx,
+                           size_t len);
 };
 
 struct SSISlave {
@@ -104,4 +111,8 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
 
+/* Transfer @len 8-bit frames from @tx, storing replies in @rx unless NULL */
+void ssi_transfer_block(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                        size_t len);
+
 #endif
@@ -18,4 +18,13 @@
 int save_snapshot(const char *name, Error **errp);
 int load_snapshot(const char *name, Error **errp);
 
+int save_memory_snapshot(const char *name, Error **errp);
+int load_memory_snapshot(const char *name, Error **errp);
+int delete_memory_snapshot(const char *name, Error **errp);
+
+int memory_checkpoints_start(int64_t period_ms, unsigned count,
+                             unsigned key_interval, Error **errp);
+void memory_checkpoints_stop(void);
+int memory_checkpoint_goto(int64_t clock_ns, bool pause, Error **errp);
+
 #endif
@@ -53,6 +53,9 @@ int64_t icount_to_ns(int64_t icount);
 /* configure the icount options, including "shift" */
 void icount_configure(QemuOpts *opts, Error **errp);
 
+/* false if icount was configured with sleep=off */
+bool icount_sleep_enabled(void);
+
 /* used by tcg vcpu thread to calc icount budget */
 int64_t icount_round(int64_t count);
 
@@ -0,0 +1,536 @@
+/*
+ * Periodic in-memory checkpoint chains
+ *
+ * Every period of virtual time a checkpoint of the VM is kept in memory.
+ * Guest RAM is tracked with the migration dirty log: a checkpoint holds
+ * the device state plus only the pages written since the checkpoint before
+ * it, each XBZRLE-encoded against its previous contents. Every Nth
+ * checkpoint is a keyframe that holds all of RAM, so trimming the chain
+ * never leaves a delta without its base. Going back to a point in time
+ * restores the nearest earlier checkpoint and lets the VM run forward to
+ * the requested time, which is exact when icount makes execution
+ * deterministic.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qemu/units.h"
+#include "qemu/bswap.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "exec/memory.h"
+#include "exec/ram_addr.h"
+#include "migration/snapshot.h"
+#include "migration/misc.h"
+#include "migration/global_state.h"
+#include "sysemu/runstate.h"
+#include "sysemu/replay.h"
+#include "ram.h"
+#include "savevm.h"
+#include "xbzrle.h"
+
+enum {
+    PAGE_ZERO,
+    PAGE_XBZRLE,
+    PAGE_RAW,
+};
+
+/* Closes the page records of a checkpoint */
+#define CHECKPOINT_END UINT32_MAX
+
+typedef struct Checkpoint {
+    int64_t clock_ns;
+    bool key;                   /* All of RAM rather than the dirty pages */
+    uint8_t *ram;               /* Page records */
+    size_t ram_size;
+    MemorySnapshot dev;         /* Device state, without RAM */
+} Checkpoint;
+
+/* A migratable RAM block and what the chain knows about it */
+typedef struct CheckpointBlock {
+    RAMBlock *rb;
+    uint8_t *shadow;            /* Contents as of the newest checkpoint */
+    unsigned long *dirty;
+    size_t pages;
+} CheckpointBlock;
+
+static struct {
+    QEMUTimer *timer;
+    QEMUTimer *stop_timer;
+    QEMUBH *bh;
+    MemoryListener listener;
+    int64_t period_ns;
+    unsigned count;
+    unsigned key_interval;
+    unsigned since_key;
+    bool dirty_lost;            /* Someone else used the dirty log */
+    GQueue chain;               /* Oldest first */
+    CheckpointBlock *blocks;
+    unsigned num_blocks;
+    uint8_t *enc;               /* One encoded page */
+    MemorySnapshot scratch;
+} cp;
+
+static void checkpoint_free(Checkpoint *c)
+{
+    g_free(c->ram);
+    g_free(c->dev.data);
+    g_free(c);
+}
+
+/*
+ * A migration or savevm starts the dirty log too, clears the bits it
+ * consumes and stops the log when done, so the next checkpoint can't
+ * trust the log and must be a keyframe.
+ */
+static void checkpoint_log_global_start(MemoryListener *listener)
+{
+    cp.dirty_lost = true;
+}
+
+static void checkpoint_log_global_stop(MemoryListener *listener)
+{
+    cp.dirty_lost = true;
+}
+
+/* Move the migration dirty bits of each block into its own bitmap */
+static void checkpoint_sync_dirty(void)
+{
+    memory_global_dirty_log_sync();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        for (unsigned i = 0; i < cp.num_blocks; i++) {
+            CheckpointBlock *b = &cp.blocks[i];
+            unsigned long *bmap = b->rb->bmap;
+
+            /* Nothing else uses bmap while no migration is running */
+            b->rb->bmap = b->dirty;
+            cpu_physical_memory_sync_dirty_bitmap(b->rb, 0,
+                                                  b->rb->used_length);
+            b->rb->bmap = bmap;
+        }
+    }
+}
+
+static void checkpoint_put_page(GByteArray *out, uint32_t block,
+                                uint32_t page, uint8_t tag)
+{
+    uint32_t be[2] = { cpu_to_be32(block), cpu_to_be32(page) };
+
+    g_byte_array_append(out, (uint8_t *)be, sizeof(be));
+    g_byte_array_append(out, &tag, 1);
+}
+
+/*
+ * Record the pages of RAM that changed since the shadow copy, or all of
+ * them for a keyframe, and bring the shadow up to date.
+ */
+static void checkpoint_encode_ram(Checkpoint *c)
+{
+    GByteArray *out = g_byte_array_new();
+    uint32_t end = cpu_to_be32(CHECKPOINT_END);
+
+    for (unsigned i = 0; i < cp.num_blocks; i++) {
+        CheckpointBlock *b = &cp.blocks[i];
+        unsigned long page = c->key ? 0 : find_first_bit(b->dirty, b->pages);
+
+        while (page < b->pages) {
+            size_t off = page << TARGET_PAGE_BITS;
+            uint8_t *host = b->rb->host + off;
+            uint8_t *old = b->shadow + off;
+            int elen = -1;
+
+            if (!c->key) {
+                elen = xbzrle_encode_buffer(old, host, TARGET_PAGE_SIZE,
+                                            cp.enc, TARGET_PAGE_SIZE);
+            }
+            if (elen == 0) {
+                /* Written back with the same contents */
+            } else if (elen > 0) {
+                uint16_t be = cpu_to_be16(elen);
+                checkpoint_put_page(out, i, page, PAGE_XBZRLE);
+                g_byte_array_append(out, (uint8_t *)&be, 2);
+                g_byte_array_append(out, cp.enc, elen);
+            } else if (buffer_is_zero(host, TARGET_PAGE_SIZE)) {
+                checkpoint_put_page(out, i, page, PAGE_ZERO);
+            } else {
+                checkpoint_put_page(out, i, page, PAGE_RAW);
+                g_byte_array_append(out, host, TARGET_PAGE_SIZE);
+            }
+            if (elen != 0) {
+                memcpy(old, host, TARGET_PAGE_SIZE);
+            }
+
+            page = c->key ? page + 1 : find_next_bit(b->dirty, b->pages,
+                                                     page + 1);
+        }
+        bitmap_zero(b->dirty, b->pages);
+    }
+    g_byte_array_append(out, (uint8_t *)&end, sizeof(end));
+
+    c->ram_size = out->len;
+    c->ram = g_byte_array_free(out, false);
+}
+
+/* Apply the page records of c on top of guest RAM */
+static int checkpoint_decode_ram(Checkpoint *c)
+{
+    const uint8_t *src = c->ram, *end = c->ram + c->ram_size;
+
+    while (src + 4 <= end) {
+        uint32_t block = ldl_be_p(src);
+        uint32_t page;
+        uint8_t *host;
+        uint16_t elen;
+
+        if (block == CHECKPOINT_END) {
+            return 0;
+        }
+        if (src + 9 > end || block >= cp.num_blocks) {
+            return -EINVAL;
+        }
+        page = ldl_be_p(src + 4);
+        if (page >= cp.blocks[block].pages) {
+            return -EINVAL;
+        }
+        host = cp.blocks[block].rb->host + ((size_t)page << TARGET_PAGE_BITS);
+        src += 8;
+
+        switch (*src++) {
+        case PAGE_ZERO:
+            memset(host, 0, TARGET_PAGE_SIZE);
+            break;
+        case PAGE_XBZRLE:
+            elen = lduw_be_p(src);
+            src += 2;
+            if (xbzrle_decode_buffer((uint8_t *)src, elen, host,
+                                     TARGET_PAGE_SIZE) < 0) {
+                return -EINVAL;
+            }
+            src += elen;
+            break;
+        case PAGE_RAW:
+            memcpy(host, src, TARGET_PAGE_SIZE);
+            src += TARGET_PAGE_SIZE;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+    return -EINVAL;
+}
+
+static void checkpoint_blocks_init(void)
+{
+    RAMBlock *rb;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(rb) {
+            cp.num_blocks++;
+        }
+        cp.blocks = g_new0(CheckpointBlock, cp.num_blocks);
+        cp.num_blocks = 0;
+        RAMBLOCK_FOREACH_MIGRATABLE(rb) {
+            CheckpointBlock *b = &cp.blocks[cp.num_blocks++];
+
+            b->rb = rb;
+            b->pages = rb->used_length >> TARGET_PAGE_BITS;
+            b->shadow = g_malloc(rb->used_length);
+            b->dirty = bitmap_new(b->pages);
+        }
+    }
+    cp.enc = g_malloc(TARGET_PAGE_SIZE);
+}
+
+static void checkpoint_blocks_free(void)
+{
+    for (unsigned i = 0; i < cp.num_blocks; i++) {
+        g_free(cp.blocks[i].shadow);
+        g_free(cp.blocks[i].dirty);
+    }
+    g_free(cp.blocks);
+    cp.blocks = NULL;
+    g_free(cp.enc);
+    cp.enc = NULL;
+    cp.num_blocks = 0;
+}
+
+/* Drop the oldest checkpoint, and any deltas left without their keyframe */
+static void checkpoint_drop_oldest(void)
+{
+    Checkpoint *c;
+
+    checkpoint_free(g_queue_pop_head(&cp.chain));
+    while ((c = g_queue_peek_head(&cp.chain)) && !c->key) {
+        checkpoint_free(g_queue_pop_head(&cp.chain));
+    }
+}
+
+static void checkpoint_take(void *opaque)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    Checkpoint *c;
+    Error *err = NULL;
+    int saved_vm_running;
+
+    if (!cp.period_ns) {
+        return;
+    }
+    /* A running migration owns the dirty log; try again next period */
+    if (!migration_is_idle()) {
+        timer_mod(cp.timer, now + cp.period_ns);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    if (global_state_store()) {
+        error_report("Error saving global state");
+        memory_checkpoints_stop();
+        return;
+    }
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    if (memory_snapshot_write_devices(&cp.scratch, &err) < 0) {
+        error_report_err(err);
+        memory_checkpoints_stop();
+        goto out;
+    }
+
+    if (!global_dirty_log) {
+        memory_global_dirty_log_start();
+    }
+    checkpoint_sync_dirty();
+
+    c = g_new0(Checkpoint, 1);
+    c->clock_ns = now;
+    c->key = cp.dirty_lost || cp.since_key >= cp.key_interval ||
+             g_queue_is_empty(&cp.chain);
+    cp.dirty_lost = false;
+    checkpoint_encode_ram(c);
+    c->dev.data = g_memdup(cp.scratch.data, cp.scratch.size);
+    c->dev.capacity = c->dev.size = cp.scratch.size;
+    cp.since_key = c->key ? 1 : cp.since_key + 1;
+
+    g_queue_push_tail(&cp.chain, c);
+    while (g_queue_get_length(&cp.chain) > cp.count) {
+        checkpoint_drop_oldest();
+    }
+
+    timer_mod(cp.timer, now + cp.period_ns);
+out:
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+/*
+ * Saving stops the VM, which a vCPU thread can't do, and virtual timers run
+ * in the vCPU thread under icount; so the timer only kicks a bottom half.
+ */
+static void checkpoint_timer_cb(void *opaque)
+{
+    qemu_bh_schedule(cp.bh);
+}
+
+static void checkpoint_stop_cb(void *opaque)
+{
+    vm_stop(RUN_STATE_PAUSED);
+}
+
+int memory_checkpoints_start(int64_t period_ms, unsigned count,
+                             unsigned key_interval, Error **errp)
+{
+    if (period_ms <= 0 || count < 1) {
+        error_setg(errp, "Checkpoint period and count must be positive");
+        return -EINVAL;
+    }
+    if (migration_is_blocked(errp)) {
+        return -EINVAL;
+    }
+    if (!migration_is_idle()) {
+        error_setg(errp, "Can't start checkpoints during a migration");
+        return -EBUSY;
+    }
+
+    if (!cp.bh) {
+        cp.bh = qemu_bh_new(checkpoint_take, NULL);
+        cp.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, checkpoint_timer_cb, NULL);
+        cp.stop_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, checkpoint_stop_cb,
+                                     NULL);
+        cp.listener.log_global_start = checkpoint_log_global_start;
+        cp.listener.log_global_stop = checkpoint_log_global_stop;
+        g_queue_init(&cp.chain);
+    }
+
+    cp.period_ns = period_ms * SCALE_MS;
+    cp.count = count;
+    /*
+     * Trimming drops a keyframe together with its deltas, so keep groups
+     * small enough that at least half the chain survives.
+     */
+    cp.key_interval = MAX(MIN(key_interval ? key_interval : 16, count / 2), 1);
+    while (g_queue_get_length(&cp.chain) > cp.count) {
+        checkpoint_drop_oldest();
+    }
+
+    if (!cp.blocks) {
+        checkpoint_blocks_init();
+        memory_listener_register(&cp.listener, &address_space_memory);
+        memory_global_dirty_log_start();
+    }
+
+    /* The first checkpoint is taken right away */
+    qemu_bh_schedule(cp.bh);
+    return 0;
+}
+
+void memory_checkpoints_stop(void)
+{
+    Checkpoint *c;
+
+    if (!cp.bh) {
+        return;
+    }
+    cp.period_ns = 0;
+    timer_del(cp.timer);
+    timer_del(cp.stop_timer);
+    while ((c = g_queue_pop_head(&cp.chain))) {
+        checkpoint_free(c);
+    }
+    if (cp.blocks) {
+        memory_listener_unregister(&cp.listener);
+        /* Leave the log alone if a migration has taken it over */
+        if (migration_is_idle()) {
+            memory_global_dirty_log_stop();
+        }
+        checkpoint_blocks_free();
+    }
+    g_free(cp.scratch.data);
+    cp.scratch.data = NULL;
+    cp.scratch.capacity = cp.scratch.size = 0;
+}
+
+int memory_checkpoint_goto(int64_t clock_ns, bool pause, Error **errp)
+{
+    Checkpoint *c = NULL;
+    GList *l, *key;
+    int saved_vm_running;
+    int ret = 0;
+
+    if (cp.bh) {
+        for (l = g_queue_peek_tail_link(&cp.chain); l; l = l->prev) {
+            if (((Checkpoint *)l->data)->clock_ns <= clock_ns) {
+                c = l->data;
+                break;
+            }
+        }
+    }
+    if (!c) {
+        error_setg(errp, "No checkpoint at or before %" PRId64 " ns",
+                   clock_ns);
+        return -ENOENT;
+    }
+    for (key = l; !((Checkpoint *)key->data)->key; key = key->prev) {
+        /* The head of the chain is always a keyframe */
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    /*
+     * Flush the record/replay queue. Now the VM state is going
+     * to change. Therefore we don't need to preserve its consistency
+     */
+    replay_flush_events();
+    qemu_system_reset(SHUTDOWN_CAUSE_NONE);
+
+    /* Rebuild RAM from the keyframe forward; loading the CPU flushes TBs */
+    for (; ret == 0; key = key->next) {
+        ret = checkpoint_decode_ram(key->data);
+        if (key == l) {
+            break;
+        }
+    }
+    if (ret < 0) {
+        error_setg(errp, "Checkpoint at %" PRId64 " ns is corrupt",
+                   c->clock_ns);
+        return ret;
+    }
+    ret = memory_snapshot_read_devices(&c->dev, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Deltas taken from here on are against the restored RAM */
+    if (!global_dirty_log) {
+        memory_global_dirty_log_start();
+    }
+    checkpoint_sync_dirty();
+    for (unsigned i = 0; i < cp.num_blocks; i++) {
+        CheckpointBlock *b = &cp.blocks[i];
+        memcpy(b->shadow, b->rb->host, b->rb->used_length);
+        bitmap_zero(b->dirty, b->pages);
+    }
+    cp.dirty_lost = false;
+
+    /* Whatever followed is another future now */
+    while (g_queue_peek_tail(&cp.chain) != c) {
+        checkpoint_free(g_queue_pop_tail(&cp.chain));
+    }
+    cp.since_key = 0;
+    for (l = g_queue_peek_tail_link(&cp.chain); l; l = l->prev) {
+        cp.since_key++;
+        if (((Checkpoint *)l->data)->key) {
+            break;
+        }
+    }
+
+    if (cp.period_ns) {
+        timer_mod(cp.timer, c->clock_ns + cp.period_ns);
+    }
+    if (saved_vm_running) {
+        vm_start();
+    }
+    if (pause) {
+        if (clock_ns > c->clock_ns) {
+            timer_mod(cp.stop_timer, clock_ns);
+        } else {
+            vm_stop(RUN_STATE_PAUSED);
+        }
+    }
+    return 0;
+}
+
+void qmp_x_checkpoint_chain_start(int64_t period_ms, int64_t count,
+                                  bool has_keyframe_interval,
+                                  int64_t keyframe_interval, Error **errp)
+{
+    if (count > UINT_MAX || keyframe_interval < 0 ||
+        keyframe_interval > UINT_MAX) {
+        error_setg(errp, "Checkpoint count or keyframe interval out of range");
+        return;
+    }
+    memory_checkpoints_start(period_ms, count,
+                             has_keyframe_interval ? keyframe_interval : 0,
+                             errp);
+}
+
+void qmp_x_checkpoint_chain_stop(Error **errp)
+{
+    memory_checkpoints_stop();
+}
+
+void qmp_x_checkpoint_chain_goto(int64_t time_ns, bool has_pause, bool pause,
+                                 Error **errp)
+{
+    memory_checkpoint_goto(time_ns, has_pause ? pause : true, errp);
+}
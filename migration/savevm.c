@@ -53,6 +53,7 @@
 #include "qemu/main-loop.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -2960,6 +2961,262 @@ err_drain:
     return ret;
 }
 
+/*
+ * In-memory snapshots: the same stream savevm writes, kept in a named
+ * buffer instead of a block device so a state can be restored repeatedly
+ * in milliseconds.
+ */
+static GHashTable *memory_snapshots;
+
+static void memory_snapshot_free(gpointer opaque)
+{
+    MemorySnapshot *snap = opaque;
+
+    g_free(snap->data);
+    g_free(snap);
+}
+
+/* Lend the snapshot storage to a buffer channel for one save or load */
+static QIOChannelBuffer *memory_snapshot_open(MemorySnapshot *snap)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(0);
+
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-memory-snapshot");
+    bioc->data = snap->data;
+    bioc->capacity = snap->capacity;
+    bioc->usage = snap->size;
+    snap->data = NULL;
+    return bioc;
+}
+
+/* Take the storage back before the channel is closed, which would free it */
+static void memory_snapshot_close(MemorySnapshot *snap, QIOChannelBuffer *bioc)
+{
+    snap->data = bioc->data;
+    snap->capacity = bioc->capacity;
+    snap->size = bioc->usage;
+    bioc->data = NULL;
+    bioc->capacity = bioc->usage = bioc->offset = 0;
+}
+
+/* Allocate the buffer the first time a snapshot is written */
+void memory_snapshot_reserve(MemorySnapshot *snap)
+{
+    if (!snap->data) {
+        snap->capacity = ram_bytes_total() + MEMORY_SNAPSHOT_SLACK;
+        snap->data = g_malloc(snap->capacity);
+    }
+}
+
+/* Save the whole VM state into snap, leaving the run state as it was */
+int memory_snapshot_write(MemorySnapshot *snap, Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int saved_vm_running;
+    int ret;
+
+    saved_vm_running = runstate_is_running();
+
+    ret = global_state_store();
+    if (ret) {
+        error_setg(errp, "Error saving global state");
+        return ret;
+    }
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    memory_snapshot_reserve(snap);
+    bioc = memory_snapshot_open(snap);
+    bioc->usage = 0;
+    f = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ret = qemu_savevm_state(f, errp);
+    qemu_fflush(f);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Error while writing VM state");
+        }
+    }
+    memory_snapshot_close(snap, bioc);
+    qemu_fclose(f);
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+    return ret;
+}
+
+/* Restore the VM state held in snap, leaving the run state as it was */
+int memory_snapshot_read(MemorySnapshot *snap, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int saved_vm_running;
+    int ret;
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    /*
+     * Flush the record/replay queue. Now the VM state is going
+     * to change. Therefore we don't need to preserve its consistency
+     */
+    replay_flush_events();
+
+    bioc = memory_snapshot_open(snap);
+    f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    qemu_system_reset(SHUTDOWN_CAUSE_NONE);
+    mis->from_src_file = f;
+
+    ret = qemu_loadvm_state(f);
+    memory_snapshot_close(snap, bioc);
+    migration_incoming_state_destroy();
+
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading VM state", ret);
+        return ret;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+    return 0;
+}
+
+/* Save the device state of the stopped VM into snap, leaving RAM out */
+int memory_snapshot_write_devices(MemorySnapshot *snap, Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    bioc = memory_snapshot_open(snap);
+    bioc->usage = 0;
+    f = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ret = qemu_save_device_state(f);
+    qemu_fflush(f);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Error while writing device state");
+    }
+    memory_snapshot_close(snap, bioc);
+    qemu_fclose(f);
+    return ret;
+}
+
+/*
+ * Load device state written by memory_snapshot_write_devices(). The VM
+ * must be stopped and RAM already restored by the caller.
+ */
+int memory_snapshot_read_devices(MemorySnapshot *snap, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    bioc = memory_snapshot_open(snap);
+    f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+    mis->from_src_file = f;
+
+    /* qemu_load_device_state() expects the file header to be consumed */
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        ret = -EINVAL;
+    } else {
+        ret = qemu_load_device_state(f);
+    }
+    memory_snapshot_close(snap, bioc);
+    migration_incoming_state_destroy();
+
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading device state", ret);
+    }
+    return ret;
+}
+
+int save_memory_snapshot(const char *name, Error **errp)
+{
+    MemorySnapshot *snap;
+    int ret;
+
+    if (migration_is_blocked(errp)) {
+        return -EINVAL;
+    }
+
+    if (!replay_can_snapshot()) {
+        error_setg(errp, "Record/replay does not allow making snapshot "
+                   "right now. Try once more later.");
+        return -EINVAL;
+    }
+
+    if (!memory_snapshots) {
+        memory_snapshots = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, memory_snapshot_free);
+    }
+
+    /* Re-saving a name reuses its buffer, so only the first save allocates */
+    snap = g_hash_table_lookup(memory_snapshots, name);
+    if (!snap) {
+        snap = g_new0(MemorySnapshot, 1);
+        g_hash_table_insert(memory_snapshots, g_strdup(name), snap);
+    }
+
+    ret = memory_snapshot_write(snap, errp);
+    if (ret < 0) {
+        g_hash_table_remove(memory_snapshots, name);
+    }
+    return ret;
+}
+
+int load_memory_snapshot(const char *name, Error **errp)
+{
+    MemorySnapshot *snap = NULL;
+
+    if (memory_snapshots) {
+        snap = g_hash_table_lookup(memory_snapshots, name);
+    }
+    if (!snap) {
+        error_setg(errp, "No memory snapshot named '%s'", name);
+        return -ENOENT;
+    }
+    return memory_snapshot_read(snap, errp);
+}
+
+int delete_memory_snapshot(const char *name, Error **errp)
+{
+    if (!memory_snapshots || !g_hash_table_remove(memory_snapshots, name)) {
+        error_setg(errp, "No memory snapshot named '%s'", name);
+        return -ENOENT;
+    }
+    return 0;
+}
+
+void qmp_x_memory_snapshot_save(const char *name, Error **errp)
+{
+    save_memory_snapshot(name, errp);
+}
+
+void qmp_x_memory_snapshot_load(const char *name, Error **errp)
+{
+    load_memory_snapshot(name, errp);
+}
+
+void qmp_x_memory_snapshot_delete(const char *name, Error **errp)
+{
+    delete_memory_snapshot(name, errp);
+}
+
 void vmstate_register_ram(MemoryRegion *mr, DeviceState *dev)
 {
     qemu_ram_set_idstr(mr->ram_block,
@@ -65,4 +65,20 @@ void qemu_loadvm_state_cleanup(void);
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
 int qemu_load_device_state(QEMUFile *f);
 
+/* A whole-VM migration stream held in memory */
+typedef struct MemorySnapshot {
+    uint8_t *data;
+    size_t capacity;
+    size_t size;
+} MemorySnapshot;
+
+/* Room for device state and page headers on top of guest RAM */
+#define MEMORY_SNAPSHOT_SLACK (1 * MiB)
+
+void memory_snapshot_reserve(MemorySnapshot *snap);
+int memory_snapshot_write(MemorySnapshot *snap, Error **errp);
+int memory_snapshot_read(MemorySnapshot *snap, Error **errp);
+int memory_snapshot_write_devices(MemorySnapshot *snap, Error **errp);
+int memory_snapshot_read_devices(MemorySnapshot *snap, Error **errp);
+
 #endif
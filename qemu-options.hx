@@ -3964,17 +3964,22 @@ SRST
 ERST
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>,rrsnapshot=<snapshot>]\n" \
+    "-icount [shift=N|auto|freq=HZ][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>,rrsnapshot=<snapshot>]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
-    "                instruction, enable aligning the host and virtual clocks\n" \
+    "                instruction (or a fixed HZ instructions per second),\n" \
+    "                enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
 SRST
-``-icount [shift=N|auto][,rr=record|replay,rrfile=filename,rrsnapshot=snapshot]``
+``-icount [shift=N|auto|freq=HZ][,rr=record|replay,rrfile=filename,rrsnapshot=snapshot]``
     Enable virtual instruction counter. The virtual cpu will execute one
     instruction every 2^N ns of virtual time. If ``auto`` is specified
     then the virtual cpu speed will be automatically adjusted to keep
     virtual time within a few seconds of real time.
 
+    ``freq=HZ`` may be given instead of ``shift`` to execute exactly HZ
+    instructions per second of virtual time, for ratios that are not a
+    power of two (e.g. ``freq=168000000`` to match a 168MHz core clock).
+
     When the virtual cpu is sleeping, the virtual time will advance at
     default speed unless ``sleep=on|off`` is specified. With
     ``sleep=on|off``, the virtual time will jump to the next timer
@@ -51,6 +51,13 @@ static bool icount_sleep = true;
 /* Arbitrarily pick 1MIPS as the minimum allowable speed.  */
 #define MAX_ICOUNT_SHIFT 10
 
+/*
+ * Fixed instruction rate in Hz when configured with freq=N, used in place
+ * of the power-of-two shift so the virtual clock can track a guest core
+ * clock such as 168MHz exactly. 0 means the shift is in effect.
+ */
+static uint32_t icount_freq;
+
 /*
  * 0 = Do not count executed instructions.
  * 1 = Fixed conversion of insn to ns via "shift" option
@@ -159,6 +166,9 @@ int64_t icount_get(void)
 
 int64_t icount_to_ns(int64_t icount)
 {
+    if (icount_freq) {
+        return muldiv64(icount, NANOSECONDS_PER_SECOND, icount_freq);
+    }
     return icount << qatomic_read(&timers_state.icount_time_shift);
 }
 
@@ -231,6 +241,10 @@ static void icount_adjust_vm(void *opaque)
 
 int64_t icount_round(int64_t count)
 {
+    if (icount_freq) {
+        int64_t insns = muldiv64(count, icount_freq, NANOSECONDS_PER_SECOND);
+        return icount_to_ns(insns) < count ? insns + 1 : insns;
+    }
     int shift = qatomic_read(&timers_state.icount_time_shift);
     return (count + (1 << shift) - 1) >> shift;
 }
@@ -394,6 +408,11 @@ void icount_start_warp_timer(void)
     }
 }
 
+bool icount_sleep_enabled(void)
+{
+    return icount_sleep;
+}
+
 void icount_account_warp_timer(void)
 {
     if (!icount_enabled() || !icount_sleep) {
@@ -420,10 +439,30 @@ void icount_account_warp_timer(void)
 void icount_configure(QemuOpts *opts, Error **errp)
 {
     const char *option = qemu_opt_get(opts, "shift");
+    uint64_t freq = qemu_opt_get_number(opts, "freq", 0);
     bool sleep = qemu_opt_get_bool(opts, "sleep", true);
     bool align = qemu_opt_get_bool(opts, "align", false);
     long time_shift = -1;
 
+    if (qemu_opt_get(opts, "freq") != NULL) {
+        if (option) {
+            error_setg(errp, "shift and freq are incompatible");
+            return;
+        }
+        if (freq < (NANOSECONDS_PER_SECOND >> MAX_ICOUNT_SHIFT)
+            || freq > NANOSECONDS_PER_SECOND) {
+            error_setg(errp, "icount: Invalid freq value");
+            return;
+        }
+        /* Keep the shift as the nearest approximation for its users. */
+        for (time_shift = 0;
+             (NANOSECONDS_PER_SECOND >> (time_shift + 1)) >= freq;
+             time_shift++) {
+            /* nothing */
+        }
+        option = "freq";
+    }
+
     if (!option) {
         if (qemu_opt_get(opts, "align") != NULL) {
             error_setg(errp, "Please specify shift option when using align");
@@ -436,7 +475,9 @@ void icount_configure(QemuOpts *opts, Error **errp)
         return;
     }
 
-    if (strcmp(option, "auto") != 0) {
+    if (time_shift >= 0) {
+        icount_freq = freq;
+    } else if (strcmp(option, "auto") != 0) {
         if (qemu_strtol(option, NULL, 0, &time_shift) < 0
             || time_shift < 0 || time_shift > MAX_ICOUNT_SHIFT) {
             error_setg(errp, "icount: Invalid shift value");
@@ -459,6 +459,9 @@ static QemuOptsList qemu_icount_opts = {
         {
             .name = "shift",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "freq",
+            .type = QEMU_OPT_NUMBER,
         }, {
             .name = "align",
             .type = QEMU_OPT_BOOL,
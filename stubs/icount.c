@@ -30,6 +30,10 @@ int64_t icount_to_ns(int64_t icount)
     abort();
     return 0;
 }
+bool icount_sleep_enabled(void)
+{
+    return true;
+}
 int64_t icount_round(int64_t count)
 {
     abort();
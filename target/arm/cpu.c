@@ -1040,6 +1040,8 @@ static void arm_cpu_initfn(Object *obj)
                              "gicv3-maintenance-interrupt", 1);
     qdev_init_gpio_out_named(DEVICE(cpu), &cpu->pmu_interrupt,
                              "pmu-interrupt", 1);
+    qdev_init_gpio_out_named(DEVICE(cpu), &cpu->v7m_sleepdeep,
+                             "v7m-sleepdeep", 1);
 #endif
 
     /* DTB consumers generally don't in fact care what the 'compatible'
@@ -1245,6 +1247,19 @@ void arm_cpu_post_init(Object *obj)
                                        OBJ_PROP_FLAG_READWRITE);
     }
 
+    if (arm_feature(&cpu->env, ARM_FEATURE_M)) {
+        /* Settable after realize, like init-svtor, so a SoC can set it up */
+        object_property_add_uint32_ptr(obj, "code-alias-base",
+                                       &cpu->code_alias_base,
+                                       OBJ_PROP_FLAG_READWRITE);
+        object_property_add_uint32_ptr(obj, "code-alias-size",
+                                       &cpu->code_alias_size,
+                                       OBJ_PROP_FLAG_READWRITE);
+        object_property_add_uint32_ptr(obj, "code-alias-target",
+                                       &cpu->code_alias_target,
+                                       OBJ_PROP_FLAG_READWRITE);
+    }
+
     qdev_property_add_static(DEVICE(obj), &arm_cpu_cfgend_property);
 
     if (arm_feature(&cpu->env, ARM_FEATURE_GENERIC_TIMER)) {
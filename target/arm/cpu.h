@@ -798,6 +798,11 @@ struct ARMCPU {
     qemu_irq gicv3_maintenance_interrupt;
     /* GPIO output for the PMU interrupt */
     qemu_irq pmu_interrupt;
+    /*
+     * GPIO output for the M-profile SLEEPDEEP signal, pulsed when WFI halts
+     * the core with SCR.SLEEPDEEP set so the SoC can enter its deep sleep mode
+     */
+    qemu_irq v7m_sleepdeep;
 
     /* MemoryRegion to use for secure physical accesses */
     MemoryRegion *secure_memory;
@@ -849,6 +854,17 @@ struct ARMCPU {
     /* For v8M, initial value of the Secure VTOR */
     uint32_t init_svtor;
 
+    /*
+     * M profile: window of the address space that is an alias of other
+     * code (e.g. flash remapped at 0 by the boot mode). Execution landing
+     * in [code_alias_base, code_alias_base + code_alias_size) continues at
+     * the same offset from code_alias_target, so both views share TBs.
+     * A size of 0 disables this.
+     */
+    uint32_t code_alias_base;
+    uint32_t code_alias_size;
+    uint32_t code_alias_target;
+
     /* [QEMU_]KVM_ARM_TARGET_* constant for this CPU, or
      * QEMU_KVM_ARM_TARGET_NONE if the kernel doesn't support this CPU type.
      */
@@ -24,6 +24,7 @@
 #include "internals.h"
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
+#include "hw/irq.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -304,6 +305,19 @@ void HELPER(wfi)(CPUARMState *env, uint32_t insn_len)
                         target_el);
     }
 
+#ifndef CONFIG_USER_ONLY
+    if (arm_feature(env, ARM_FEATURE_M) &&
+        (env->v7m.scr[env->v7m.secure] & R_V7M_SCR_SLEEPDEEP_MASK)) {
+        /*
+         * Let the SoC pick its deep sleep mode. It must not touch virtual
+         * time from here: under icount this is not an I/O boundary.
+         */
+        qemu_mutex_lock_iothread();
+        qemu_irq_pulse(env_archcpu(env)->v7m_sleepdeep);
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+
     cs->exception_index = EXCP_HLT;
     cs->halted = 1;
     cpu_loop_exit(cs);
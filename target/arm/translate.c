@@ -8487,6 +8487,9 @@ static void arm_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cs)
     dc->user = (dc->current_el == 0);
 #endif
     dc->fp_excp_el = FIELD_EX32(tb_flags, TBFLAG_ANY, FPEXC_EL);
+    dc->code_alias_base = cpu->code_alias_base;
+    dc->code_alias_size = cpu->code_alias_size;
+    dc->code_alias_target = cpu->code_alias_target;
 
     if (arm_feature(env, ARM_FEATURE_M)) {
         dc->vfp_enabled = 1;
@@ -8667,6 +8670,22 @@ static bool arm_pre_translate_insn(DisasContext *dc)
         return true;
     }
 
+    if (unlikely(dc->base.pc_next - dc->code_alias_base < dc->code_alias_size)) {
+        /*
+         * Execution has entered the code alias window: rather than
+         * translate the same bytes a second time, branch to the same
+         * offset in the canonical view. The PC changes only here, when
+         * the guest actually runs an aliased instruction, so state
+         * inspection (gdbstub, TB lookup) never sees it rewritten.
+         */
+        gen_set_condexec(dc);
+        gen_goto_tb(dc, 0, dc->base.pc_next - dc->code_alias_base +
+                    dc->code_alias_target);
+        /* Cover the first halfword so the TB has a non-zero size */
+        dc->base.pc_next += 2;
+        return true;
+    }
+
     return false;
 }
 
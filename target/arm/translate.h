@@ -46,6 +46,10 @@ typedef struct DisasContext {
     bool v8m_fpccr_s_wrong; /* true if v8M FPCCR.S != v8m_secure */
     bool v7m_new_fp_ctxt_needed; /* ASPEN set but no active FP context */
     bool v7m_lspact; /* FPCCR.LSPACT set */
+    /* M profile code alias window, see ARMCPU::code_alias_base */
+    uint32_t code_alias_base;
+    uint32_t code_alias_size;
+    uint32_t code_alias_target;
     /* Immediate value in AArch32 SVC insn; must be set if is_jmp == DISAS_SWI
      * so that top level loop can generate correct syndrome information.
      */
@@ -0,0 +1,392 @@
+/*
+ * QTest microbenchmarks for the STM32F407 peripheral models of the
+ * Prusa Mini board.
+ *
+ * Each case drives a single model directly over the qtest protocol, without
+ * any firmware, checks that it still behaves and reports how many operations
+ * per second it managed. The qtest round trip is part of every operation, so
+ * the numbers are for comparing one build of a model against another rather
+ * than against hardware.
+ *
+ * By default each case runs a short loop so the suite doubles as a quick
+ * regression check; pass -m perf for long enough runs to measure.
+ *
+ * The parts case is not a benchmark: it only realizes the board once for
+ * every entry in the SoC part table.
+ *
+ * This code is licensed under the GPL version 2 or later.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqos/libqtest.h"
+
+#define RCC_BASE            0x40023800
+#define RCC_AHB1ENR         (RCC_BASE + 0x30)
+#define RCC_APB1ENR         (RCC_BASE + 0x40)
+#define RCC_APB2ENR         (RCC_BASE + 0x44)
+
+#define GPIOC_BASE          0x40020800
+#define GPIOD_BASE          0x40020C00
+#define GPIOE_BASE          0x40021000
+#define GPIO_ODR            0x14
+#define GPIO_BSRR           0x18
+
+#define SPI2_BASE           0x40003800
+#define SPI_CR1             0x00
+#define SPI_SR              0x08
+#define SPI_DR              0x0C
+#define SPI_CR1_SPE         (1 << 6)
+#define SPI_CR1_MSTR        (1 << 2)
+#define SPI_SR_TXE          (1 << 1)
+#define SPI_SR_RXNE         (1 << 0)
+
+/* The st7789v sits on SPI2, selected by PC9 (low) with D/C on PD11. */
+#define LCD_CS_PIN          9
+#define LCD_CD_PIN          11
+#define LCD_RAMWR           0x2C
+
+#define DMA2_BASE           0x40026400
+#define DMA_LIFCR           0x08
+#define DMA_S0CR            0x10
+#define DMA_S0NDTR          0x14
+#define DMA_S0PAR           0x18
+#define DMA_S0M0AR          0x1C
+#define DMA_SxCR_EN         (1 << 0)
+#define DMA_SxCR_DIR_M2M    (2 << 6)
+#define DMA_SxCR_PINC       (1 << 9)
+#define DMA_SxCR_MINC       (1 << 10)
+#define DMA_SxCR_PSIZE_32   (2 << 11)
+#define DMA_SxCR_MSIZE_32   (2 << 13)
+
+#define SRAM_SRC            0x20000000
+#define SRAM_DST            0x20008000
+#define DMA_BLOCK           256
+
+#define USART1_BASE         0x40011000
+#define USART_SR            0x00
+#define USART_DR            0x04
+#define USART_BRR           0x08
+#define USART_CR1           0x0C
+#define USART_SR_TC         (1 << 6)
+#define USART_CR1_UE        (1 << 13)
+#define USART_CR1_TE        (1 << 3)
+
+#define I2C1_BASE           0x40005400
+#define I2C_CR1             0x00
+#define I2C_DR              0x10
+#define I2C_SR1             0x14
+#define I2C_SR2             0x18
+#define I2C_CR1_PE          (1 << 0)
+#define I2C_CR1_START       (1 << 8)
+#define I2C_CR1_STOP        (1 << 9)
+#define I2C_SR1_SB          (1 << 0)
+#define I2C_SR1_ADDR        (1 << 1)
+#define I2C_SR1_RXNE        (1 << 6)
+#define I2C_SR1_TXE         (1 << 7)
+#define I2C_SR1_AF          (1 << 10)
+#define EEPROM_ADDR         0x53
+#define EEPROM_PAGE         32
+
+#define TIM2_BASE           0x40000000
+#define TIM_CR1             0x00
+#define TIM_CNT             0x24
+#define TIM_PSC             0x28
+#define TIM_ARR             0x2C
+#define TIM_CR1_CEN         (1 << 0)
+
+#define ADC1_BASE           0x40012000
+#define ADC_SR              0x00
+#define ADC_CR2             0x08
+#define ADC_SQR3            0x34
+#define ADC_DR              0x4C
+#define ADC_SR_EOC          (1 << 1)
+#define ADC_CR2_ADON        (1 << 0)
+#define ADC_CR2_SWSTART     (1 << 30)
+
+typedef struct BenchState {
+    QTestState *qts;
+    char *kernel;
+} BenchState;
+
+static unsigned bench_iterations(unsigned quick, unsigned perf)
+{
+    return g_test_perf() ? perf : quick;
+}
+
+static void bench_report(const char *what, unsigned ops)
+{
+    double elapsed = g_test_timer_elapsed();
+
+    g_test_message("%s: %u ops in %.3f s, %.0f ops/s", what, ops, elapsed,
+                   elapsed > 0 ? ops / elapsed : 0);
+}
+
+/*
+ * The machine wants a firmware image; an empty vector table is enough
+ * since the qtest accelerator never runs the CPU.
+ */
+static void bench_start_part(BenchState *b, const char *part)
+{
+    static const uint8_t blank[1024];
+    GError *err = NULL;
+    int fd;
+
+    fd = g_file_open_tmp("prusa-mini-bench-XXXXXX.bin", &b->kernel, &err);
+    g_assert_no_error(err);
+    g_assert_cmpint(write(fd, blank, sizeof(blank)), ==, sizeof(blank));
+    close(fd);
+
+    b->qts = qtest_initf("-M prusa-mini -kernel %s -append part=%s", b->kernel, part);
+
+    /* Clock everything the cases touch, as firmware would first. */
+    qtest_writel(b->qts, RCC_AHB1ENR, 0x1f | (1 << 21) | (1 << 22));
+    qtest_writel(b->qts, RCC_APB1ENR,
+                 (1 << 0) | (1 << 14) | (1 << 15) | (1 << 17) | (1 << 21));
+    qtest_writel(b->qts, RCC_APB2ENR, (1 << 4) | (1 << 8));
+}
+
+static void bench_start(BenchState *b)
+{
+    bench_start_part(b, "STM32F407VGT6");
+}
+
+static void bench_stop(BenchState *b)
+{
+    qtest_quit(b->qts);
+    unlink(b->kernel);
+    g_free(b->kernel);
+}
+
+static void test_parts(void)
+{
+    static const char *parts[] = {
+        "STM32F405", "STM32F407", "STM32F415", "STM32F417",
+        "STM32F427", "STM32F429", "STM32F437", "STM32F439",
+    };
+    BenchState b;
+
+    for (int i = 0; i < ARRAY_SIZE(parts); i++) {
+        bench_start_part(&b, parts[i]);
+        bench_stop(&b);
+    }
+}
+
+static void test_gpio_bsrr(void)
+{
+    BenchState b;
+    unsigned i, n = bench_iterations(2000, 200000);
+
+    bench_start(&b);
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        qtest_writel(b.qts, GPIOE_BASE + GPIO_BSRR,
+                     (i & 1) ? 1u << 16 : 1u);
+    }
+    bench_report("GPIO BSRR toggle", n);
+
+    qtest_writel(b.qts, GPIOE_BASE + GPIO_BSRR, 1u << 5);
+    g_assert_cmphex(qtest_readl(b.qts, GPIOE_BASE + GPIO_ODR) & 0x21, ==, 0x20);
+    qtest_writel(b.qts, GPIOE_BASE + GPIO_BSRR, (1u << 5) << 16);
+    g_assert_cmphex(qtest_readl(b.qts, GPIOE_BASE + GPIO_ODR) & 0x21, ==, 0);
+    bench_stop(&b);
+}
+
+static void test_spi_st7789v(void)
+{
+    BenchState b;
+    unsigned i, n = bench_iterations(2000, 200000);
+
+    bench_start(&b);
+    qtest_writel(b.qts, SPI2_BASE + SPI_CR1, SPI_CR1_SPE | SPI_CR1_MSTR);
+
+    qtest_writel(b.qts, GPIOC_BASE + GPIO_BSRR, (1u << LCD_CS_PIN) << 16);
+    qtest_writel(b.qts, GPIOD_BASE + GPIO_BSRR, (1u << LCD_CD_PIN) << 16);
+    qtest_writel(b.qts, SPI2_BASE + SPI_DR, LCD_RAMWR);
+    qtest_writel(b.qts, GPIOD_BASE + GPIO_BSRR, 1u << LCD_CD_PIN);
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        qtest_writel(b.qts, SPI2_BASE + SPI_DR, i & 0xff);
+    }
+    bench_report("SPI2 byte to st7789v", n);
+
+    g_assert_cmphex(qtest_readl(b.qts, SPI2_BASE + SPI_SR) &
+                    (SPI_SR_TXE | SPI_SR_RXNE), ==, SPI_SR_TXE | SPI_SR_RXNE);
+    qtest_readl(b.qts, SPI2_BASE + SPI_DR);
+    g_assert_cmphex(qtest_readl(b.qts, SPI2_BASE + SPI_SR) & SPI_SR_RXNE, ==, 0);
+
+    qtest_writel(b.qts, GPIOC_BASE + GPIO_BSRR, 1u << LCD_CS_PIN);
+    bench_stop(&b);
+}
+
+static void test_dma_m2m(void)
+{
+    BenchState b;
+    uint8_t src[DMA_BLOCK], dst[DMA_BLOCK];
+    unsigned i, n = bench_iterations(200, 20000);
+
+    for (i = 0; i < DMA_BLOCK; i++) {
+        src[i] = i * 7 + 1;
+    }
+
+    bench_start(&b);
+    qtest_memwrite(b.qts, SRAM_SRC, src, sizeof(src));
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        qtest_writel(b.qts, DMA2_BASE + DMA_S0NDTR, DMA_BLOCK / 4);
+        qtest_writel(b.qts, DMA2_BASE + DMA_S0PAR, SRAM_SRC);
+        qtest_writel(b.qts, DMA2_BASE + DMA_S0M0AR, SRAM_DST);
+        qtest_writel(b.qts, DMA2_BASE + DMA_S0CR,
+                     DMA_SxCR_DIR_M2M | DMA_SxCR_PINC | DMA_SxCR_MINC |
+                     DMA_SxCR_PSIZE_32 | DMA_SxCR_MSIZE_32 | DMA_SxCR_EN);
+        qtest_writel(b.qts, DMA2_BASE + DMA_LIFCR, 0x3d);
+    }
+    bench_report("DMA2 256-byte mem-to-mem", n);
+
+    g_assert_cmphex(qtest_readl(b.qts, DMA2_BASE + DMA_S0CR) & DMA_SxCR_EN, ==, 0);
+    qtest_memread(b.qts, SRAM_DST, dst, sizeof(dst));
+    g_assert_cmpmem(src, sizeof(src), dst, sizeof(dst));
+    bench_stop(&b);
+}
+
+static void test_uart_tx(void)
+{
+    BenchState b;
+    unsigned i, n = bench_iterations(500, 50000);
+
+    bench_start(&b);
+    /* 16 MHz HSI / 115200 baud */
+    qtest_writel(b.qts, USART1_BASE + USART_BRR, 0x8b);
+    qtest_writel(b.qts, USART1_BASE + USART_CR1, USART_CR1_UE | USART_CR1_TE);
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        qtest_writel(b.qts, USART1_BASE + USART_DR, 'A' + i % 26);
+        while (!(qtest_readl(b.qts, USART1_BASE + USART_SR) & USART_SR_TC)) {
+            qtest_clock_step_next(b.qts);
+        }
+    }
+    bench_report("USART1 TX character", n);
+    bench_stop(&b);
+}
+
+static void i2c_start(QTestState *qts, uint8_t addr_rw)
+{
+    qtest_writel(qts, I2C1_BASE + I2C_CR1, I2C_CR1_PE | I2C_CR1_START);
+    g_assert_true(qtest_readl(qts, I2C1_BASE + I2C_SR1) & I2C_SR1_SB);
+    qtest_writel(qts, I2C1_BASE + I2C_DR, addr_rw);
+    g_assert_cmphex(qtest_readl(qts, I2C1_BASE + I2C_SR1) &
+                    (I2C_SR1_ADDR | I2C_SR1_AF), ==, I2C_SR1_ADDR);
+    qtest_readl(qts, I2C1_BASE + I2C_SR2);
+}
+
+static void i2c_stop(QTestState *qts)
+{
+    qtest_writel(qts, I2C1_BASE + I2C_CR1, I2C_CR1_PE | I2C_CR1_STOP);
+}
+
+static void eeprom_set_pointer(QTestState *qts, uint16_t offset)
+{
+    i2c_start(qts, EEPROM_ADDR << 1);
+    g_assert_true(qtest_readl(qts, I2C1_BASE + I2C_SR1) & I2C_SR1_TXE);
+    qtest_writel(qts, I2C1_BASE + I2C_DR, offset >> 8);
+    qtest_writel(qts, I2C1_BASE + I2C_DR, offset & 0xff);
+}
+
+static void test_i2c_eeprom(void)
+{
+    BenchState b;
+    uint8_t page[EEPROM_PAGE];
+    unsigned i, n = bench_iterations(1000, 100000);
+
+    bench_start(&b);
+
+    eeprom_set_pointer(b.qts, 0);
+    for (i = 0; i < EEPROM_PAGE; i++) {
+        page[i] = 0xa5 ^ i;
+        qtest_writel(b.qts, I2C1_BASE + I2C_DR, page[i]);
+    }
+    i2c_stop(b.qts);
+
+    eeprom_set_pointer(b.qts, 0);
+    i2c_start(b.qts, EEPROM_ADDR << 1 | 1);
+    g_assert_true(qtest_readl(b.qts, I2C1_BASE + I2C_SR1) & I2C_SR1_RXNE);
+
+    /* The pointer wraps at the end of the part, so just keep reading. */
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        uint8_t data = qtest_readl(b.qts, I2C1_BASE + I2C_DR);
+        if (i < EEPROM_PAGE) {
+            g_assert_cmphex(data, ==, page[i]);
+        }
+    }
+    bench_report("I2C1 EEPROM byte read", n);
+
+    i2c_stop(b.qts);
+    bench_stop(&b);
+}
+
+static void test_tim_cnt(void)
+{
+    BenchState b;
+    uint32_t first, last = 0;
+    unsigned i, n = bench_iterations(2000, 200000);
+
+    bench_start(&b);
+    qtest_writel(b.qts, TIM2_BASE + TIM_PSC, 0);
+    qtest_writel(b.qts, TIM2_BASE + TIM_ARR, 0xffff);
+    qtest_writel(b.qts, TIM2_BASE + TIM_CR1, TIM_CR1_CEN);
+
+    first = qtest_readl(b.qts, TIM2_BASE + TIM_CNT);
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        last = qtest_readl(b.qts, TIM2_BASE + TIM_CNT);
+    }
+    bench_report("TIM2 CNT read", n);
+
+    /* Time only moves when the test steps it. */
+    g_assert_cmpuint(last, ==, first);
+    qtest_clock_step(b.qts, 1000);
+    g_assert_cmpuint(qtest_readl(b.qts, TIM2_BASE + TIM_CNT), !=, last);
+    bench_stop(&b);
+}
+
+static void test_adc_conversion(void)
+{
+    BenchState b;
+    unsigned i, n = bench_iterations(1000, 100000);
+
+    bench_start(&b);
+    qtest_writel(b.qts, ADC1_BASE + ADC_SQR3, 10);
+    qtest_writel(b.qts, ADC1_BASE + ADC_CR2, ADC_CR2_ADON);
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        qtest_writel(b.qts, ADC1_BASE + ADC_CR2, ADC_CR2_ADON | ADC_CR2_SWSTART);
+        g_assert_true(qtest_readl(b.qts, ADC1_BASE + ADC_SR) & ADC_SR_EOC);
+        qtest_readl(b.qts, ADC1_BASE + ADC_DR);
+        qtest_writel(b.qts, ADC1_BASE + ADC_SR, 0);
+    }
+    bench_report("ADC1 conversion", n);
+
+    g_assert_false(qtest_readl(b.qts, ADC1_BASE + ADC_SR) & ADC_SR_EOC);
+    bench_stop(&b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/prusa-mini/parts", test_parts);
+    qtest_add_func("/prusa-mini/bench/gpio-bsrr", test_gpio_bsrr);
+    qtest_add_func("/prusa-mini/bench/spi-st7789v", test_spi_st7789v);
+    qtest_add_func("/prusa-mini/bench/dma-m2m", test_dma_m2m);
+    qtest_add_func("/prusa-mini/bench/uart-tx", test_uart_tx);
+    qtest_add_func("/prusa-mini/bench/i2c-eeprom", test_i2c_eeprom);
+    qtest_add_func("/prusa-mini/bench/tim-cnt", test_tim_cnt);
+    qtest_add_func("/prusa-mini/bench/adc", test_adc_conversion);
+
+    return g_test_run();
+}